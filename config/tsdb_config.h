@@ -1,24 +1,121 @@
 #pragma once
 
 #include <string>
-#include <format>
+#include <cstdint>
 
 namespace config
 {
+    /**
+     * WAL durability modes
+     * every_write:  each append writes + fsyncs before returning
+     * group_commit: appends share one write + fsync per window, callers wait
+     * async:        appends return immediately, commits run in the background
+     */
+    enum class WalSync
+    {
+        every_write,
+        group_commit,
+        async
+    };
+
+    /**
+     * MemTable storage modes
+     * raw:        every point kept as a Data
+     * compressed: points gorilla-encoded into chunks as they arrive, only a
+     *             short raw tail per series
+     */
+    enum class MemTableMode
+    {
+        raw,
+        compressed
+    };
+
     // Turns on print debugging
     static constexpr bool debug                 (true);
 
-    static std::string wal_path                 ("../disk/wal.wal");
+    static std::string wal_dir                  ("../disk/wal/");
+    static constexpr size_t wal_segment_bytes   (64 * (1 << 20));
+    static constexpr WalSync wal_sync_mode      (WalSync::group_commit);
+
+    // Extra time a group commit waits for more writers to join
+    // 0 = groups form only while the previous fsync is in flight
+    static constexpr size_t wal_group_window_ms (0);
 
     static std::string sstable_dir              ("../disk/sstables/");
     static std::string sstable_path             (sstable_dir + "sstable_");
 
+    // Every known series tag, see TagIndex
+    static std::string tag_index_path           (sstable_dir + "TAGS");
+
+    // Interned series ids and their labels, see SeriesRegistry
+    static std::string series_registry_path     (sstable_dir + "SERIES");
+
+    // Longest accepted tag / label set key
+    static constexpr size_t max_tag_bytes       (1024);
+
+    // Points per independently decodable SSTable chunk
+    static constexpr size_t sstable_chunk_points (1024);
+
+    // Try every value codec per chunk when writing an SSTable and keep the
+    // smallest (see chunk_codec.h), false = gorilla only
+    static constexpr bool sstable_choose_codec (true);
+
+    // Points of a pre-encoded MemTable chunk tried against every codec on
+    // flush. The whole chunk is only decoded and re-encoded when another
+    // codec wins on them, so a flush of XOR-friendly series stays close to
+    // a copy; a chunk whose first points suit gorilla keeps gorilla until
+    // compaction re-encodes it
+    static constexpr size_t sstable_codec_probe_points (128);
+
+    // Series per worker before a MemTable flush encodes in parallel
+    static constexpr size_t memtable_parallel_flush_series (32);
+
+    // Overlapping chunks per worker before a read decodes in parallel
+    static constexpr size_t sstable_parallel_decode_chunks (16);
+
+    // Decoded SSTable chunk cache for hot historical reads
+    static constexpr size_t block_cache_bytes   (64 * (1 << 20));
+    static constexpr size_t block_cache_shards  (16);
+
+    // Per-SSTable Bloom filter on tags, lets reads skip files without the
+    // series. Bits per key is derived from the false positive rate when 0
+    static constexpr size_t bloom_bits_per_key (0);
+    static constexpr double bloom_false_positive_rate (0.01);
+
+    // Rollup bucket widths written next to every SSTable (rollup_<id>.db),
+    // /query reads them instead of raw points when its step allows
+    static constexpr int64_t rollup_resolutions_ms[] = {1000, 60 * 1000, 60 * 60 * 1000};
+
+    // Compaction: once this many flushed (level 0) SSTables exist they are
+    // merged into one level 1 file per time partition
+    static constexpr size_t compaction_trigger_files (4);
+    static constexpr int64_t compaction_partition_ms (60 * 60 * 1000);
+
+    // Compaction write budget so it doesn't starve ingest of disk bandwidth
+    static constexpr size_t compaction_bytes_per_sec (32 * (1 << 20));
+
+    // Cap on buckets (or LTTB points) one /query may return
+    static constexpr size_t query_max_buckets   (100000);
+
+    // Points formatted per streamed /read response chunk
+    static constexpr size_t json_chunk_points   (4096);
+
+    // Cap on series one multi-series /read (tags= / match=) may return
+    static constexpr size_t multi_read_max_series (1000);
+
     // Network
     static std::string host                     ("0.0.0.0");
     static constexpr id_t port                  (9090);
 
-    // # bytes before WAL flush
+    // # independently locked MemTable stripes (tag hash)
+    static constexpr size_t memtable_shards     (16);
+
+    // # bytes before WAL flush (compressed size in compressed mode)
     static constexpr size_t memtable_bytes =    1 * (1 << 20);
+    static constexpr MemTableMode memtable_mode (MemTableMode::compressed);
+
+    // Raw points per series before they are encoded into its open chunk
+    static constexpr size_t memtable_tail_points (64);
 
     const std::string get_sstable_path (const std::string& id)
     {
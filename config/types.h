@@ -4,12 +4,17 @@
 #include <map>
 #include <string>
 #include <iostream>
+#include <vector>
+#include <limits>
 
 using tag_t     = std::string;
 using id_t      = uint32_t;
 using data_t    = double;
 using byte_t    = uint8_t;
 
+// Interned series key, 0 = not interned (see SeriesRegistry)
+using series_id_t = uint32_t;
+
 /**
  * Single unit of timeseries data
  */
@@ -25,4 +30,66 @@ struct Data
     }
 };
 
+/**
+ * Struct-of-arrays series, timestamps and values in their own contiguous
+ * columns so scans over one of them vectorize
+ */
+struct Columns
+{
+    std::vector<time_t> ts;
+    std::vector<data_t> values;
+
+    size_t size () const
+    {
+        return ts.size ();
+    }
+
+    void reserve (size_t n)
+    {
+        ts.reserve (n);
+        values.reserve (n);
+    }
+
+    void push_back (const Data& point)
+    {
+        ts.push_back (point.time_ms);
+        values.push_back (point.value);
+    }
+
+    Data at (size_t i) const
+    {
+        return Data {ts[i], values[i]};
+    }
+};
+
+/**
+ * Single tagged point, as received by /write
+ */
+struct Point
+{
+    tag_t tag;
+    Data data;
+    series_id_t series {0};
+};
+
+/**
+ * Time window of a query, inclusive on both ends
+ */
+struct TimeRange
+{
+    time_t start = std::numeric_limits<time_t>::min ();
+    time_t end = std::numeric_limits<time_t>::max ();
+
+    bool contains (time_t time_ms) const
+    {
+        return time_ms >= start && time_ms <= end;
+    }
+
+    bool overlaps (time_t min_ms, time_t max_ms) const
+    {
+        return min_ms <= end && max_ms >= start;
+    }
+};
+
 using table_t   = std::map<std::string, std::vector<Data>>;
+using batch_t   = std::vector<Point>;
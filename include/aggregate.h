@@ -0,0 +1,446 @@
+#pragma once
+
+#include <map>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <string_view>
+#include <algorithm>
+#include "types.h"
+#include "simd_agg.h"
+
+/**
+ * Per-bucket aggregation functions of /query
+ */
+enum class AggFn
+{
+    min,
+    max,
+    avg,
+    sum,
+    count,
+    first,
+    last
+};
+
+/**
+ * Name -> AggFn, false if unknown
+ */
+inline bool parse_agg (std::string_view name, AggFn& fn)
+{
+    static const std::pair<std::string_view, AggFn> names[] =
+    {
+        {"min", AggFn::min}, {"max", AggFn::max}, {"avg", AggFn::avg},
+        {"sum", AggFn::sum}, {"count", AggFn::count},
+        {"first", AggFn::first}, {"last", AggFn::last}
+    };
+
+    for (const auto& [key, value] : names)
+        if (key == name)
+        {
+            fn = value;
+            return true;
+        }
+
+    return false;
+}
+
+/**
+ * AggFn -> name
+ */
+inline const char* agg_name (AggFn fn)
+{
+    switch (fn)
+    {
+        case AggFn::min:   return "min";
+        case AggFn::max:   return "max";
+        case AggFn::avg:   return "avg";
+        case AggFn::sum:   return "sum";
+        case AggFn::count: return "count";
+        case AggFn::first: return "first";
+        case AggFn::last:  return "last";
+    }
+
+    return "";
+}
+
+/**
+ * Running summary of the points in one time bucket
+ * Sources arrive in any order, first/last go by timestamp (later arrival
+ * wins a tie for last, matching read order)
+ */
+struct Bucket
+{
+    size_t count {0};
+    data_t min {std::numeric_limits<data_t>::infinity ()};
+    data_t max {-std::numeric_limits<data_t>::infinity ()};
+    data_t sum {0};
+    Data first {std::numeric_limits<time_t>::max (), 0};
+    Data last {std::numeric_limits<time_t>::min (), 0};
+
+    /**
+     * Fold one point in
+     */
+    void add (const Data& point)
+    {
+        ++count;
+        min = std::min (min, point.value);
+        max = std::max (max, point.value);
+        sum += point.value;
+
+        if (point.time_ms < first.time_ms)
+            first = point;
+        if (point.time_ms >= last.time_ms)
+            last = point;
+    }
+
+    /**
+     * Fold in another summary of the same bucket
+     */
+    void merge (const Bucket& other)
+    {
+        count += other.count;
+        min = std::min (min, other.min);
+        max = std::max (max, other.max);
+        sum += other.sum;
+
+        if (other.first.time_ms < first.time_ms)
+            first = other.first;
+        if (other.last.time_ms >= last.time_ms)
+            last = other.last;
+    }
+
+    /**
+     * Result of fn over the bucket
+     */
+    data_t get (AggFn fn) const
+    {
+        switch (fn)
+        {
+            case AggFn::min:   return min;
+            case AggFn::max:   return max;
+            case AggFn::avg:   return count ? sum / count : 0;
+            case AggFn::sum:   return sum;
+            case AggFn::count: return static_cast<data_t> (count);
+            case AggFn::first: return first.value;
+            case AggFn::last:  return last.value;
+        }
+
+        return 0;
+    }
+};
+
+/**
+ * Folds point spans into fixed-width buckets aligned to origin
+ * Memory grows with the number of non-empty buckets, not points
+ */
+class BucketAggregator
+{
+private:
+    time_t origin;
+    time_t step;
+    size_t max_buckets;
+    std::map<time_t, Bucket> buckets;
+    bool overflow {false};
+
+    /**
+     * Bucket number of t (floor division)
+     */
+    time_t index_of (time_t t) const
+    {
+        time_t offset = t - origin;
+        return offset >= 0 ? offset / step : -((-offset - 1) / step) - 1;
+    }
+
+public:
+    /**
+     * origin: start of bucket 0, step: bucket width (ms)
+     * max_buckets: cap on non-empty buckets, beyond it overflowed () is set
+     */
+    BucketAggregator (time_t origin, time_t step, size_t max_buckets)
+        : origin (origin), step (std::max<time_t> (step, 1)), max_buckets (max_buckets) {}
+
+    /**
+     * Fold ascending columns, each bucket's run is found by binary search
+     * and summarized by the SIMD kernel
+     */
+    void add (const time_t* ts, const data_t* values, size_t n)
+    {
+        size_t i = 0;
+        while (i < n)
+        {
+            time_t idx = index_of (ts[i]);
+            time_t bucket_end = origin + (idx + 1) * step;
+            size_t run_end = std::lower_bound (ts + i, ts + n, bucket_end) - ts;
+
+            auto it = buckets.find (idx);
+            if (it == buckets.end ())
+            {
+                if (buckets.size () >= max_buckets)
+                {
+                    overflow = true;
+                    return;
+                }
+                it = buckets.emplace (idx, Bucket {}).first;
+            }
+
+            simd::Summary summary = simd::summarize (values + i, run_end - i);
+            Bucket part;
+            part.count = summary.count;
+            part.sum = summary.sum;
+            part.min = summary.min;
+            part.max = summary.max;
+            part.first = Data {ts[i], values[i]};
+            part.last = Data {ts[run_end - 1], values[run_end - 1]};
+            it->second.merge (part);
+
+            i = run_end;
+        }
+    }
+
+    /**
+     * Fold an ascending span of points, scalar
+     */
+    void add (const Data* points, size_t n)
+    {
+        // Runs of points share a bucket, look it up once per run
+        size_t i = 0;
+        while (i < n)
+        {
+            time_t idx = index_of (points[i].time_ms);
+            time_t bucket_end = origin + (idx + 1) * step;
+
+            auto it = buckets.find (idx);
+            if (it == buckets.end ())
+            {
+                if (buckets.size () >= max_buckets)
+                {
+                    overflow = true;
+                    return;
+                }
+                it = buckets.emplace (idx, Bucket {}).first;
+            }
+
+            for (; i < n && points[i].time_ms < bucket_end; ++i)
+                it->second.add (points[i]);
+        }
+    }
+
+    /**
+     * Fold a pre-aggregated summary starting at t (e.g. a rollup bucket)
+     * It must not straddle one of our buckets
+     */
+    void add_partial (time_t t, const Bucket& part)
+    {
+        time_t idx = index_of (t);
+        auto it = buckets.find (idx);
+        if (it == buckets.end ())
+        {
+            if (buckets.size () >= max_buckets)
+            {
+                overflow = true;
+                return;
+            }
+            it = buckets.emplace (idx, Bucket {}).first;
+        }
+
+        it->second.merge (part);
+    }
+
+    /**
+     * Start time of bucket idx
+     */
+    time_t bucket_start (time_t idx) const
+    {
+        return origin + idx * step;
+    }
+
+    /**
+     * buckets getter, keyed by bucket number
+     */
+    const std::map<time_t, Bucket>& get_buckets () const
+    {
+        return buckets;
+    }
+
+    /**
+     * Whether points were dropped for exceeding max_buckets
+     */
+    bool overflowed () const
+    {
+        return overflow;
+    }
+};
+
+/**
+ * Largest-Triangle-Three-Buckets style visual downsampling in two passes
+ * Pass 1 collects per-bucket centroids, pass 2 keeps the point of each
+ * bucket spanning the largest triangle with its neighbours' centroids.
+ * Using the previous centroid rather than the previously chosen point
+ * (classic LTTB) makes buckets independent, so sources can be streamed in
+ * any order. The first and last points are always kept
+ */
+class LttbSampler
+{
+private:
+    struct Centroid
+    {
+        size_t count {0};
+        double time_sum {0};
+        double value_sum {0};
+    };
+
+    time_t t0;
+    time_t t1;
+    size_t threshold;
+    size_t n_buckets;
+    std::vector<Centroid> centroids;
+    std::vector<std::pair<double, Data>> best;
+    std::vector<std::pair<double, double>> prev_anchor, next_anchor;
+    Bucket ends;
+    std::vector<Data> all;
+    bool keep_all {false};
+
+    /**
+     * Inner bucket of t
+     */
+    size_t bucket_of (time_t t) const
+    {
+        long double span = static_cast<long double> (t1) - t0 + 1;
+        size_t b = static_cast<size_t> ((static_cast<long double> (t) - t0) / span * n_buckets);
+        return std::min (b, n_buckets - 1);
+    }
+
+public:
+    /**
+     * [t0, t1]: time bounds of the series, threshold: points out (>= 3)
+     */
+    LttbSampler (time_t t0, time_t t1, size_t threshold)
+        : t0 (t0), t1 (std::max (t0, t1)), threshold (std::max<size_t> (threshold, 3)),
+          n_buckets (this->threshold - 2), centroids (n_buckets),
+          best (n_buckets, {-1.0, Data {}}) {}
+
+    /**
+     * Pass 1: ascending columns, any source order
+     */
+    void add_pass1 (const time_t* ts, const data_t* values, size_t n)
+    {
+        for (size_t i = 0; i < n; ++i)
+        {
+            Centroid& c = centroids[bucket_of (ts[i])];
+            ++c.count;
+            c.time_sum += ts[i];
+            c.value_sum += values[i];
+            ends.add (Data {ts[i], values[i]});
+        }
+    }
+
+    /**
+     * Pass 1 over points
+     */
+    void add_pass1 (const Data* points, size_t n)
+    {
+        Columns columns;
+        columns.reserve (n);
+        for (size_t i = 0; i < n; ++i)
+            columns.push_back (points[i]);
+
+        add_pass1 (columns.ts.data (), columns.values.data (), n);
+    }
+
+    /**
+     * Between passes: fix each bucket's neighbour anchors
+     */
+    void finish_pass1 ()
+    {
+        keep_all = ends.count <= threshold;
+
+        prev_anchor.assign (n_buckets, {0.0, 0.0});
+        next_anchor.assign (n_buckets, {0.0, 0.0});
+
+        std::pair<double, double> anchor {double (ends.first.time_ms), ends.first.value};
+        for (size_t b = 0; b < n_buckets; ++b)
+        {
+            prev_anchor[b] = anchor;
+            if (centroids[b].count)
+                anchor = {centroids[b].time_sum / centroids[b].count,
+                          centroids[b].value_sum / centroids[b].count};
+        }
+
+        anchor = {double (ends.last.time_ms), ends.last.value};
+        for (size_t b = n_buckets; b-- > 0;)
+        {
+            next_anchor[b] = anchor;
+            if (centroids[b].count)
+                anchor = {centroids[b].time_sum / centroids[b].count,
+                          centroids[b].value_sum / centroids[b].count};
+        }
+    }
+
+    /**
+     * Pass 2 over points
+     */
+    void add_pass2 (const Data* points, size_t n)
+    {
+        Columns columns;
+        columns.reserve (n);
+        for (size_t i = 0; i < n; ++i)
+            columns.push_back (points[i]);
+
+        add_pass2 (columns.ts.data (), columns.values.data (), n);
+    }
+
+    /**
+     * Pass 2: the same columns again
+     */
+    void add_pass2 (const time_t* ts, const data_t* values, size_t n)
+    {
+        if (keep_all)
+        {
+            for (size_t i = 0; i < n; ++i)
+                all.push_back (Data {ts[i], values[i]});
+            return;
+        }
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            const Data p {ts[i], values[i]};
+            if (p.time_ms == ends.first.time_ms || p.time_ms == ends.last.time_ms)
+                continue;
+
+            size_t b = bucket_of (p.time_ms);
+            auto [ax, ay] = prev_anchor[b];
+            auto [cx, cy] = next_anchor[b];
+
+            double area = std::abs ((ax - cx) * (p.value - ay) -
+                                    (ax - p.time_ms) * (cy - ay));
+            if (area > best[b].first)
+                best[b] = {area, p};
+        }
+    }
+
+    /**
+     * Chosen points, ascending by time
+     */
+    std::vector<Data> result () const
+    {
+        if (ends.count == 0)
+            return {};
+
+        auto by_time = [] (const Data& a, const Data& b) { return a.time_ms < b.time_ms; };
+        if (keep_all)
+        {
+            std::vector<Data> sorted = all;
+            std::stable_sort (sorted.begin (), sorted.end (), by_time);
+            return sorted;
+        }
+
+        std::vector<Data> out {ends.first};
+        for (const auto& [area, point] : best)
+            if (area >= 0)
+                out.push_back (point);
+        out.push_back (ends.last);
+
+        return out;
+    }
+};
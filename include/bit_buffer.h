@@ -1,48 +1,76 @@
 #pragma once
 
 #include <vector>
+#include <cstring>
 #include "types.h"
 
 /**
- * Handles writing bits
+ * Handles writing bits, MSB first
+ * Bits collect in a 64-bit accumulator and leave as whole big-endian words,
+ * so any write of up to 64 bits is a couple of shifts and masks
  */
 class BitWriter
 {
 private:
     std::vector<byte_t> buf;
-    byte_t current_byte = 0;
-    size_t bit_count = 0;
+    uint64_t acc = 0;
+    int acc_bits = 0;
+
+    /**
+     * Append a full accumulator word, big-endian
+     */
+    void emit_word (uint64_t word)
+    {
+        word = __builtin_bswap64 (word);
+        size_t old_size = buf.size ();
+        buf.resize (old_size + sizeof (word));
+        std::memcpy (buf.data () + old_size, &word, sizeof (word));
+    }
 
 public:
+    /**
+     * Reserve room for about n_bytes of output
+     */
+    void reserve (size_t n_bytes)
+    {
+        buf.reserve (n_bytes + sizeof (uint64_t));
+    }
+
     /**
      * Write a single bit
      */
     void write_bit (bool bit)
     {
-        // Little endian
-        if (bit)
-            current_byte |= (1 << (7 - bit_count));
-        
-        ++bit_count;
-        
-        if (bit_count == 8)
-        {
-            buf.push_back (current_byte);
-            current_byte = 0x0;
-            bit_count = 0;
-        }
+        write_bits (bit, 1);
     }
 
     /**
-     * Write many bits
+     * Write the low count bits of value (count <= 64)
      */
     void write_bits (uint64_t value, int count)
     {
-        for (int i = count - 1; i >= 0; --i)
+        if (count <= 0)
+            return;
+
+        if (count < 64)
+            value &= (uint64_t {1} << count) - 1;
+
+        int free_bits = 64 - acc_bits;
+        if (count < free_bits)
         {
-            bool bit = (value >> i) & 1;
-            write_bit (bit);
+            acc = (acc << count) | value;
+            acc_bits += count;
+            return;
         }
+
+        // Fill the word, carry the rest
+        int spill = count - free_bits;
+        uint64_t word = free_bits == 64 ? value
+                                        : (acc << free_bits) | (value >> spill);
+        emit_word (word);
+
+        acc = spill ? value & ((uint64_t {1} << spill) - 1) : 0;
+        acc_bits = spill;
     }
 
     /**
@@ -50,69 +78,141 @@ public:
      */
     void flush ()
     {
-        if (bit_count == 0)
+        if (acc_bits == 0)
             return;
-        
-        buf.push_back (current_byte);
-        
-        current_byte = 0;
-        bit_count = 0;
+
+        // Left-align the tail in whole bytes
+        int n_bytes = (acc_bits + 7) / 8;
+        uint64_t tail = acc << (64 - acc_bits);
+        for (int i = 0; i < n_bytes; ++i)
+            buf.push_back (static_cast<byte_t> (tail >> (56 - 8 * i)));
+
+        acc = 0;
+        acc_bits = 0;
     }
 
     /**
-     * buf getter
+     * buf getter, complete only after flush ()
      */
     const std::vector<byte_t>& get_buffer () const
     {
         return buf;
     }
+
+    /**
+     * Copy of everything written so far, padded as flush () would, the
+     * writer stays open for more bits
+     */
+    std::vector<byte_t> get_bytes () const
+    {
+        std::vector<byte_t> bytes;
+        bytes.reserve (buf.size () + sizeof (acc));
+        bytes = buf;
+
+        uint64_t tail = acc_bits ? acc << (64 - acc_bits) : 0;
+        for (int i = 0; i < (acc_bits + 7) / 8; ++i)
+            bytes.push_back (static_cast<byte_t> (tail >> (56 - 8 * i)));
+
+        return bytes;
+    }
+
+    /**
+     * # bytes get_bytes () would return
+     */
+    size_t size () const
+    {
+        return buf.size () + (acc_bits + 7) / 8;
+    }
+
+    /**
+     * Heap bytes held
+     */
+    size_t capacity () const
+    {
+        return buf.capacity ();
+    }
+
+    /**
+     * Flush and move the buffer out, leaves the writer empty
+     */
+    std::vector<byte_t> release ()
+    {
+        flush ();
+        std::vector<byte_t> out = std::move (buf);
+        buf.clear ();
+
+        return out;
+    }
 };
 
 
 /**
- * Handles reading bits
+ * Handles reading bits from a borrowed byte span (vector or mapped file)
+ * Reads load one unaligned big-endian word and shift out the wanted bits,
+ * bits past the end read as 0
  */
 class BitReader
 {
 private:
-    const std::vector<byte_t>& buf;
-    size_t byte_pos = 0;
-    int bit_pos = 0;
+    const byte_t* data;
+    size_t size;
+    size_t bit_pos = 0;
+
+    /**
+     * 8 bytes starting at byte_idx, big-endian, zero past the end
+     */
+    uint64_t load_word (size_t byte_idx) const
+    {
+        uint64_t word = 0;
+        if (byte_idx + sizeof (word) <= size)
+        {
+            std::memcpy (&word, data + byte_idx, sizeof (word));
+            return __builtin_bswap64 (word);
+        }
+
+        for (size_t i = 0; i < sizeof (word); ++i)
+            word = (word << 8) | (byte_idx + i < size ? data[byte_idx + i] : 0);
+
+        return word;
+    }
 
 public:
     /**
      * Buffer constructor
      */
-    BitReader (const std::vector<byte_t>& buf) : buf (buf) {}
+    BitReader (const std::vector<byte_t>& buf) : data (buf.data ()), size (buf.size ()) {}
+
+    /**
+     * Span constructor, no copy
+     */
+    BitReader (const byte_t* data, size_t size) : data (data), size (size) {}
 
     /**
      * Read bit
      */
     bool read_bit ()
     {
-        if (byte_pos >= buf.size ())
-            return false;
-        
-        bool bit = (buf[byte_pos] >> (7 - bit_pos++)) & 1;
-        
-        if (bit_pos == 8)
-        {
-            bit_pos = 0;
-            ++byte_pos;
-        }
-
-        return bit;
+        return read_bits (1);
     }
 
     /**
-     * Read many bits
+     * Read many bits (count <= 64)
      */
     uint64_t read_bits (size_t count)
     {
-        uint64_t value = 0;
-        for (int i = 0; i < count; ++i)
-            value = (value << 1) | read_bit ();
-        
-        return value;
+        if (count == 0)
+            return 0;
+
+        // One word covers 56 bits at any bit offset
+        if (count > 56)
+        {
+            uint64_t high = read_bits (count - 32);
+            return (high << 32) | read_bits (32);
+        }
+
+        uint64_t word = load_word (bit_pos >> 3) << (bit_pos & 7);
+        bit_pos += count;
+
+        return word >> (64 - count);
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <list>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include "types.h"
+#include "tsdb_config.h"
+
+using namespace config;
+
+/**
+ * Sharded LRU of decoded SSTable chunks (columnar), bounded by a byte budget
+ * A chunk is identified by its table id and file offset (the offset pins
+ * down the series), values are shared so a hit costs no decode or copy
+ * under the shard lock
+ */
+class BlockCache
+{
+public:
+    using block_t = std::shared_ptr<const Columns>;
+
+    /**
+     * Which file of an SSTable id a block comes from, a table and its
+     * rollup share the id
+     */
+    enum class Kind : uint8_t
+    {
+        table,
+        rollup
+    };
+
+    /**
+     * (sstable id, file kind, chunk offset)
+     */
+    struct Key
+    {
+        size_t table_id;
+        uint64_t offset;
+        Kind kind {Kind::table};
+
+        bool operator== (const Key& other) const
+        {
+            return table_id == other.table_id && offset == other.offset && kind == other.kind;
+        }
+    };
+
+    /**
+     * Counter snapshot
+     */
+    struct Stats
+    {
+        size_t hits;
+        size_t misses;
+        size_t evictions;
+        size_t bytes;
+        size_t capacity;
+    };
+
+private:
+    struct KeyHash
+    {
+        size_t operator() (const Key& key) const
+        {
+            return std::hash<uint64_t> {} (key.offset * 0x9E3779B97F4A7C15ull ^ key.table_id ^
+                                           (static_cast<uint64_t> (key.kind) << 63));
+        }
+    };
+
+    using lru_t = std::list<std::pair<Key, block_t>>;
+
+    struct Shard
+    {
+        std::mutex mutex;
+        lru_t lru;  // most recent first
+        std::unordered_map<Key, lru_t::iterator, KeyHash> map;
+        size_t bytes {0};
+    };
+
+    std::array<Shard, block_cache_shards> shards;
+    size_t capacity;
+    std::atomic<size_t> hits {0};
+    std::atomic<size_t> misses {0};
+    std::atomic<size_t> evictions {0};
+
+    /**
+     * Accounted size of a cached block
+     */
+    static size_t block_bytes (const block_t& block)
+    {
+        return block->ts.capacity () * sizeof (time_t) +
+               block->values.capacity () * sizeof (data_t) + sizeof (Columns) + 64;
+    }
+
+    /**
+     * Shard holding key
+     */
+    Shard& shard_for (const Key& key)
+    {
+        return shards[KeyHash {} (key) % shards.size ()];
+    }
+
+public:
+    /**
+     * capacity: byte budget over all shards, 0 disables caching
+     */
+    BlockCache (size_t capacity = block_cache_bytes) : capacity (capacity) {}
+
+    /**
+     * Cached block or null, counts the hit/miss
+     */
+    block_t get (const Key& key)
+    {
+        Shard& shard = shard_for (key);
+        std::lock_guard<std::mutex> lock (shard.mutex);
+
+        auto it = shard.map.find (key);
+        if (it == shard.map.end ())
+        {
+            misses.fetch_add (1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        shard.lru.splice (shard.lru.begin (), shard.lru, it->second);
+        hits.fetch_add (1, std::memory_order_relaxed);
+        return it->second->second;
+    }
+
+    /**
+     * Insert block, evicting least recently used blocks of its shard
+     */
+    void put (const Key& key, block_t block)
+    {
+        size_t shard_capacity = capacity / shards.size ();
+        size_t size = block_bytes (block);
+        if (size > shard_capacity)
+            return;
+
+        Shard& shard = shard_for (key);
+        std::lock_guard<std::mutex> lock (shard.mutex);
+
+        auto it = shard.map.find (key);
+        if (it != shard.map.end ())
+        {
+            shard.bytes -= block_bytes (it->second->second);
+            shard.lru.erase (it->second);
+            shard.map.erase (it);
+        }
+
+        while (shard.bytes + size > shard_capacity && !shard.lru.empty ())
+        {
+            shard.bytes -= block_bytes (shard.lru.back ().second);
+            shard.map.erase (shard.lru.back ().first);
+            shard.lru.pop_back ();
+            evictions.fetch_add (1, std::memory_order_relaxed);
+        }
+
+        shard.lru.emplace_front (key, std::move (block));
+        shard.map[key] = shard.lru.begin ();
+        shard.bytes += size;
+    }
+
+    /**
+     * Counters + current size
+     */
+    Stats get_stats ()
+    {
+        size_t bytes = 0;
+        for (Shard& shard : shards)
+        {
+            std::lock_guard<std::mutex> lock (shard.mutex);
+            bytes += shard.bytes;
+        }
+
+        return Stats {hits.load (), misses.load (), evictions.load (), bytes, capacity};
+    }
+};
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <string_view>
+#include <algorithm>
+#include "types.h"
+#include "tsdb_config.h"
+
+using namespace config;
+
+/**
+ * Bloom filter over series tags
+ * k probes derived from one 64-bit FNV-1a hash (h1 + i * h2), no false negatives
+ * Serialized as: num_hashes u32, bit bytes
+ */
+class BloomFilter
+{
+private:
+    std::vector<byte_t> bits;
+    uint32_t num_hashes {0};
+
+    /**
+     * FNV-1a, 64-bit
+     */
+    static uint64_t hash (std::string_view key)
+    {
+        uint64_t h = 14695981039346656037ull;
+        for (char c : key)
+        {
+            h ^= static_cast<uint8_t> (c);
+            h *= 1099511628211ull;
+        }
+
+        // FNV mixes the low bits poorly, finalize (murmur3 fmix64)
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+
+        return h;
+    }
+
+public:
+    /**
+     * Bits per key giving false positive rate p with optimal k
+     */
+    static double bits_per_key_for (double p)
+    {
+        p = std::clamp (p, 1e-9, 0.5);
+        return -std::log (p) / (std::log (2.0) * std::log (2.0));
+    }
+
+    /**
+     * Configured bits per key, derived from the false positive rate when 0
+     */
+    static double default_bits_per_key ()
+    {
+        return bloom_bits_per_key ? double (bloom_bits_per_key)
+                                  : bits_per_key_for (bloom_false_positive_rate);
+    }
+
+    /**
+     * Empty filter, matches everything
+     */
+    BloomFilter () = default;
+
+    /**
+     * Sized for n_keys
+     */
+    BloomFilter (size_t n_keys, double bits_per_key = default_bits_per_key ())
+    {
+        size_t n_bits = std::max<size_t> (64, std::ceil (n_keys * bits_per_key));
+        bits.assign ((n_bits + 7) / 8, 0);
+
+        // k = ln2 * bits per key
+        num_hashes = static_cast<uint32_t> (std::clamp (std::round (bits_per_key * 0.69),
+                                                        1.0, 30.0));
+    }
+
+    /**
+     * Insert key
+     */
+    void add (std::string_view key)
+    {
+        if (bits.empty ())
+            return;
+
+        uint64_t h = hash (key);
+        uint64_t h1 = h & 0xFFFFFFFF, h2 = h >> 32;
+        size_t n_bits = bits.size () * 8;
+
+        for (uint32_t i = 0; i < num_hashes; ++i)
+        {
+            size_t bit = (h1 + i * h2) % n_bits;
+            bits[bit >> 3] |= byte_t (1 << (bit & 7));
+        }
+    }
+
+    /**
+     * False if key was definitely never added
+     */
+    bool may_contain (std::string_view key) const
+    {
+        if (bits.empty ())
+            return true;
+
+        uint64_t h = hash (key);
+        uint64_t h1 = h & 0xFFFFFFFF, h2 = h >> 32;
+        size_t n_bits = bits.size () * 8;
+
+        for (uint32_t i = 0; i < num_hashes; ++i)
+        {
+            size_t bit = (h1 + i * h2) % n_bits;
+            if (!(bits[bit >> 3] & (1 << (bit & 7))))
+                return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Whether the filter rejects anything
+     */
+    bool empty () const
+    {
+        return bits.empty ();
+    }
+
+    /**
+     * Append the serialized filter to buf
+     */
+    void serialize (std::string& buf) const
+    {
+        buf.append (reinterpret_cast<const char*> (&num_hashes), sizeof (num_hashes));
+        buf.append (reinterpret_cast<const char*> (bits.data ()), bits.size ());
+    }
+
+    /**
+     * Load a serialized filter, false (and empty) if malformed
+     */
+    bool deserialize (const byte_t* data, size_t size)
+    {
+        bits.clear ();
+        num_hashes = 0;
+
+        uint32_t k;
+        if (size < sizeof (k))
+            return false;
+
+        std::memcpy (&k, data, sizeof (k));
+        if (k == 0 || k > 30)
+            return false;
+
+        num_hashes = k;
+        bits.assign (data + sizeof (k), data + size);
+        if (bits.empty ())
+            num_hashes = 0;
+
+        return true;
+    }
+};
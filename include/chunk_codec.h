@@ -0,0 +1,591 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include "types.h"
+#include "bit_buffer.h"
+#include "gorilla.h"
+#include "tsdb_config.h"
+
+using namespace config;
+
+/**
+ * Per-chunk value codecs of SSTable version 6
+ * A chunk is codec u8, then either
+ *   gorilla:  one gorilla::format_v2 stream (timestamps and XORed values
+ *             interleaved)
+ *   or else:  ts_size u32, timestamp stream (first ts i64, then
+ *             gorilla::write_dod per point), byte aligned value stream
+ * Value streams:
+ *   delta_int:  integral values only. first i64, width u7, then per point
+ *               the zigzagged delta to the previous value in width bits
+ *   chimp:      XOR like gorilla with Chimp's flags: '00' same value,
+ *               '01' lead u3 + length u6 + center bits when the XOR has
+ *               over 6 trailing zeros, '10' reuse the previous leading
+ *               zeros, '11' lead u3 then the rest. Leading zeros are
+ *               rounded down to leading_zero_steps
+ *   dictionary: at most 256 distinct values. size - 1 u8, values f64 in
+ *               first-use order, then per point its index in
+ *               ceil (log2 (size)) bits
+ *   rle:        runs of one value: value f64, length u16 each
+ * encode_best tries each codec that applies and keeps the smallest, so
+ * counters, step functions and enum-like series stop paying for XOR
+ */
+namespace codec
+{
+    // Chunk format number, next to gorilla::format_v1 / format_v2
+    static constexpr uint8_t format_blocks {3};
+
+    enum class Codec : uint8_t
+    {
+        gorilla,
+        delta_int,
+        chimp,
+        dictionary,
+        rle
+    };
+
+    static constexpr size_t codec_count {5};
+
+    // Chimp leading zero classes, indexed by the 3-bit lead field
+    static constexpr std::array<uint32_t, 8> leading_zero_steps {0, 8, 12, 16, 18, 20, 22, 24};
+
+    static constexpr size_t max_dictionary {256};
+    static constexpr size_t max_run {0xFFFF};
+
+    /**
+     * Display name of c
+     */
+    inline const char* name (Codec c)
+    {
+        switch (c)
+        {
+            case Codec::gorilla:    return "gorilla";
+            case Codec::delta_int:  return "delta_int";
+            case Codec::chimp:      return "chimp";
+            case Codec::dictionary: return "dictionary";
+            case Codec::rle:        return "rle";
+        }
+
+        return "unknown";
+    }
+
+    /**
+     * Raw bits of val
+     */
+    inline uint64_t to_bits (data_t val)
+    {
+        uint64_t bits;
+        std::memcpy (&bits, &val, sizeof (bits));
+        return bits;
+    }
+
+    /**
+     * Value of raw bits
+     */
+    inline data_t from_bits (uint64_t bits)
+    {
+        data_t val;
+        std::memcpy (&val, &bits, sizeof (val));
+        return val;
+    }
+
+    /**
+     * Map signed to unsigned, small magnitudes to small numbers
+     */
+    inline uint64_t zigzag (int64_t val)
+    {
+        return (static_cast<uint64_t> (val) << 1) ^ static_cast<uint64_t> (val >> 63);
+    }
+
+    /**
+     * Inverse of zigzag
+     */
+    inline int64_t unzigzag (uint64_t val)
+    {
+        return static_cast<int64_t> (val >> 1) ^ -static_cast<int64_t> (val & 1);
+    }
+
+    /**
+     * Bits to tell apart n symbols
+     */
+    inline int index_bits (size_t n)
+    {
+        return n <= 1 ? 0 : 64 - __builtin_clzll (n - 1);
+    }
+
+    /* TIMESTAMPS */
+
+    /**
+     * Timestamp stream of n (> 0) points
+     */
+    inline void write_times (const Data* points, size_t n, BitWriter& out)
+    {
+        out.write_bits (points[0].time_ms, 64);
+
+        uint64_t last_delta = 0;
+        for (size_t i = 1; i < n; ++i)
+        {
+            uint64_t delta = static_cast<uint64_t> (points[i].time_ms) -
+                             static_cast<uint64_t> (points[i - 1].time_ms);
+            gorilla::write_dod (out, static_cast<int64_t> (delta - last_delta));
+            last_delta = delta;
+        }
+    }
+
+    /**
+     * Read n timestamps of a write_times stream into ts
+     */
+    inline void read_times (BitReader& in, size_t n, time_t* ts)
+    {
+        uint64_t last_ts = in.read_bits (64);
+        uint64_t last_delta = 0;
+        ts[0] = static_cast<time_t> (last_ts);
+
+        for (size_t i = 1; i < n; ++i)
+        {
+            last_delta += gorilla::read_dod (in);
+            last_ts += last_delta;
+            ts[i] = static_cast<time_t> (last_ts);
+        }
+    }
+
+    /* DELTA_INT */
+
+    /**
+     * Value as an exact int64, false if it has a fraction, is out of the
+     * exact double range or is -0.0
+     */
+    inline bool as_int (data_t val, int64_t& out)
+    {
+        if (!(std::fabs (val) < 9007199254740992.0) || std::trunc (val) != val ||
+            (val == 0 && std::signbit (val)))
+            return false;
+
+        out = static_cast<int64_t> (val);
+        return true;
+    }
+
+    /**
+     * Delta_int value stream, false unless every value is integral
+     */
+    inline bool write_delta_int (const Data* points, size_t n, BitWriter& out)
+    {
+        std::vector<int64_t> ints (n);
+        for (size_t i = 0; i < n; ++i)
+            if (!as_int (points[i].value, ints[i]))
+                return false;
+
+        uint64_t widest = 0;
+        for (size_t i = 1; i < n; ++i)
+            widest |= zigzag (ints[i] - ints[i - 1]);
+
+        int width = widest ? 64 - __builtin_clzll (widest) : 0;
+        out.write_bits (static_cast<uint64_t> (ints[0]), 64);
+        out.write_bits (width, 7);
+        for (size_t i = 1; i < n; ++i)
+            out.write_bits (zigzag (ints[i] - ints[i - 1]), width);
+
+        return true;
+    }
+
+    /**
+     * Read n values of a delta_int stream
+     */
+    inline void read_delta_int (BitReader& in, size_t n, data_t* values)
+    {
+        int64_t last = static_cast<int64_t> (in.read_bits (64));
+        int width = static_cast<int> (in.read_bits (7));
+        values[0] = static_cast<data_t> (last);
+
+        for (size_t i = 1; i < n; ++i)
+        {
+            last += unzigzag (in.read_bits (width));
+            values[i] = static_cast<data_t> (last);
+        }
+    }
+
+    /* CHIMP */
+
+    /**
+     * Index of the largest leading_zero_steps entry <= zeros
+     */
+    inline uint32_t lead_index (uint32_t zeros)
+    {
+        uint32_t index = 0;
+        while (index + 1 < leading_zero_steps.size () && leading_zero_steps[index + 1] <= zeros)
+            ++index;
+
+        return index;
+    }
+
+    /**
+     * Chimp value stream, applies to any values
+     */
+    inline bool write_chimp (const Data* points, size_t n, BitWriter& out)
+    {
+        uint64_t last = to_bits (points[0].value);
+        out.write_bits (last, 64);
+
+        // No previous leading zeros to reuse
+        uint32_t stored_lead = 64;
+        for (size_t i = 1; i < n; ++i)
+        {
+            uint64_t bits = to_bits (points[i].value);
+            uint64_t xor_val = bits ^ last;
+            last = bits;
+
+            if (xor_val == 0)
+            {
+                out.write_bits (0b00, 2);
+                stored_lead = 64;
+                continue;
+            }
+
+            uint32_t index = lead_index (__builtin_clzll (xor_val));
+            uint32_t lead = leading_zero_steps[index];
+            uint32_t trail = __builtin_ctzll (xor_val);
+
+            if (trail > 6)
+            {
+                uint32_t center = 64 - lead - trail;
+                out.write_bits ((uint64_t {0b01} << 9) | (index << 6) | center, 11);
+                out.write_bits (xor_val >> trail, center);
+                stored_lead = 64;
+            }
+            else if (lead == stored_lead)
+            {
+                out.write_bits (0b10, 2);
+                out.write_bits (xor_val, 64 - lead);
+            }
+            else
+            {
+                out.write_bits ((uint64_t {0b11} << 3) | index, 5);
+                out.write_bits (xor_val, 64 - lead);
+                stored_lead = lead;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Read n values of a chimp stream
+     */
+    inline void read_chimp (BitReader& in, size_t n, data_t* values)
+    {
+        uint64_t last = in.read_bits (64);
+        values[0] = from_bits (last);
+
+        uint32_t stored_lead = 64;
+        for (size_t i = 1; i < n; ++i)
+        {
+            switch (in.read_bits (2))
+            {
+                case 0b00:
+                    stored_lead = 64;
+                    break;
+
+                case 0b01:
+                {
+                    uint32_t lead = leading_zero_steps[in.read_bits (3)];
+                    uint32_t center = static_cast<uint32_t> (in.read_bits (6));
+                    last ^= in.read_bits (center) << (64 - lead - center);
+                    stored_lead = 64;
+                    break;
+                }
+
+                case 0b10:
+                    last ^= in.read_bits (64 - stored_lead);
+                    break;
+
+                default:
+                    stored_lead = leading_zero_steps[in.read_bits (3)];
+                    last ^= in.read_bits (64 - stored_lead);
+                    break;
+            }
+
+            values[i] = from_bits (last);
+        }
+    }
+
+    /* DICTIONARY */
+
+    /**
+     * Dictionary value stream, false past max_dictionary distinct values
+     */
+    inline bool write_dictionary (const Data* points, size_t n, BitWriter& out)
+    {
+        std::vector<uint64_t> dictionary;
+        std::unordered_map<uint64_t, uint32_t> index;
+        std::vector<uint32_t> ids (n);
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint64_t bits = to_bits (points[i].value);
+            auto [it, added] = index.emplace (bits, static_cast<uint32_t> (dictionary.size ()));
+            if (added)
+            {
+                if (dictionary.size () == max_dictionary)
+                    return false;
+                dictionary.push_back (bits);
+            }
+            ids[i] = it->second;
+        }
+
+        out.write_bits (dictionary.size () - 1, 8);
+        for (uint64_t bits : dictionary)
+            out.write_bits (bits, 64);
+
+        int width = index_bits (dictionary.size ());
+        for (uint32_t id : ids)
+            out.write_bits (id, width);
+
+        return true;
+    }
+
+    /**
+     * Read n values of a dictionary stream
+     */
+    inline void read_dictionary (BitReader& in, size_t n, data_t* values)
+    {
+        std::vector<data_t> dictionary (in.read_bits (8) + 1);
+        for (data_t& val : dictionary)
+            val = from_bits (in.read_bits (64));
+
+        int width = index_bits (dictionary.size ());
+        for (size_t i = 0; i < n; ++i)
+        {
+            size_t id = in.read_bits (width);
+            values[i] = id < dictionary.size () ? dictionary[id] : 0;
+        }
+    }
+
+    /* RLE */
+
+    /**
+     * Run-length value stream, false when runs are too short to pay off
+     */
+    inline bool write_rle (const Data* points, size_t n, BitWriter& out)
+    {
+        // Not worth it past ~1 run per 4 points, skip the encode
+        size_t runs = 1;
+        for (size_t i = 1; i < n; ++i)
+            runs += to_bits (points[i].value) != to_bits (points[i - 1].value);
+        if (runs > n / 4 + 1)
+            return false;
+
+        for (size_t first = 0; first < n;)
+        {
+            uint64_t bits = to_bits (points[first].value);
+            size_t last = first + 1;
+            while (last < n && last - first < max_run && to_bits (points[last].value) == bits)
+                ++last;
+
+            out.write_bits (bits, 64);
+            out.write_bits (last - first, 16);
+            first = last;
+        }
+
+        return true;
+    }
+
+    /**
+     * Read n values of a run-length stream
+     */
+    inline void read_rle (BitReader& in, size_t n, data_t* values)
+    {
+        for (size_t i = 0; i < n;)
+        {
+            data_t val = from_bits (in.read_bits (64));
+            size_t run = std::max<size_t> (in.read_bits (16), 1);
+            for (size_t end = std::min (i + run, n); i < end; ++i)
+                values[i] = val;
+        }
+    }
+
+    /* CHUNKS */
+
+    /**
+     * Value stream of points with c, false if c doesn't apply
+     */
+    inline bool write_values (Codec c, const Data* points, size_t n, BitWriter& out)
+    {
+        switch (c)
+        {
+            case Codec::delta_int:  return write_delta_int (points, n, out);
+            case Codec::chimp:      return write_chimp (points, n, out);
+            case Codec::dictionary: return write_dictionary (points, n, out);
+            case Codec::rle:        return write_rle (points, n, out);
+            default:                return false;
+        }
+    }
+
+    /**
+     * Chunk of n (> 0) time-sorted points with c, empty if c doesn't apply
+     */
+    inline std::vector<byte_t> encode (Codec c, const Data* points, size_t n)
+    {
+        std::vector<byte_t> chunk {static_cast<byte_t> (c)};
+
+        if (c == Codec::gorilla)
+        {
+            GorillaEncoder encoder (n);
+            for (size_t i = 0; i < n; ++i)
+                encoder.append (points[i]);
+
+            std::vector<byte_t> stream = encoder.finish ();
+            chunk.insert (chunk.end (), stream.begin (), stream.end ());
+            return chunk;
+        }
+
+        BitWriter values;
+        if (!write_values (c, points, n, values))
+            return {};
+
+        BitWriter times;
+        write_times (points, n, times);
+        std::vector<byte_t> ts = times.release ();
+        std::vector<byte_t> vals = values.release ();
+
+        uint32_t ts_size = static_cast<uint32_t> (ts.size ());
+        chunk.resize (1 + sizeof (ts_size));
+        std::memcpy (chunk.data () + 1, &ts_size, sizeof (ts_size));
+        chunk.insert (chunk.end (), ts.begin (), ts.end ());
+        chunk.insert (chunk.end (), vals.begin (), vals.end ());
+
+        return chunk;
+    }
+
+    /**
+     * Smallest chunk of n (> 0) time-sorted points over every codec
+     * gorilla_stream: the points as a format_v2 stream when already
+     * encoded, saves encoding it again
+     */
+    inline std::vector<byte_t> encode_best (const Data* points, size_t n,
+                                            const byte_t* gorilla_stream = nullptr,
+                                            size_t gorilla_size = 0)
+    {
+        std::vector<byte_t> best;
+        if (gorilla_stream)
+        {
+            best.reserve (gorilla_size + 1);
+            best.push_back (static_cast<byte_t> (Codec::gorilla));
+            best.insert (best.end (), gorilla_stream, gorilla_stream + gorilla_size);
+        }
+        else
+            best = encode (Codec::gorilla, points, n);
+
+        // Timestamps are shared by every other codec, encode them once
+        BitWriter times;
+        write_times (points, n, times);
+        std::vector<byte_t> ts = times.release ();
+
+        Codec best_codec = Codec::gorilla;
+        size_t best_size = best.size ();
+        std::vector<byte_t> best_values;
+        for (size_t c = 1; c < codec_count; ++c)
+        {
+            BitWriter values;
+            if (!write_values (static_cast<Codec> (c), points, n, values) ||
+                1 + sizeof (uint32_t) + ts.size () + values.size () >= best_size)
+                continue;
+
+            best_codec = static_cast<Codec> (c);
+            best_values = values.release ();
+            best_size = 1 + sizeof (uint32_t) + ts.size () + best_values.size ();
+        }
+
+        if (best_codec == Codec::gorilla)
+            return best;
+
+        uint32_t ts_size = static_cast<uint32_t> (ts.size ());
+        std::vector<byte_t> chunk (1 + sizeof (ts_size));
+        chunk[0] = static_cast<byte_t> (best_codec);
+        std::memcpy (chunk.data () + 1, &ts_size, sizeof (ts_size));
+        chunk.insert (chunk.end (), ts.begin (), ts.end ());
+        chunk.insert (chunk.end (), best_values.begin (), best_values.end ());
+
+        return chunk;
+    }
+
+    /**
+     * Codec of a chunk
+     */
+    inline Codec codec_of (const byte_t* chunk, size_t size)
+    {
+        return size ? static_cast<Codec> (chunk[0]) : Codec::gorilla;
+    }
+
+    /**
+     * Decode a chunk of count points written in format (gorilla::format_v1,
+     * format_v2 or format_blocks) into columns, false if malformed
+     */
+    inline bool decode_columns (uint8_t format, const byte_t* chunk, size_t size,
+                                size_t count, Columns& out)
+    {
+        out.ts.resize (count);
+        out.values.resize (count);
+        if (count == 0)
+            return true;
+
+        if (format != format_blocks)
+        {
+            out = Gorilla (format).decode_columns (chunk, size, count);
+            return true;
+        }
+
+        if (size == 0 || chunk[0] >= codec_count)
+            return false;
+
+        Codec c = static_cast<Codec> (chunk[0]);
+        if (c == Codec::gorilla)
+        {
+            out = Gorilla (gorilla::format_v2).decode_columns (chunk + 1, size - 1, count);
+            return true;
+        }
+
+        uint32_t ts_size;
+        if (size < 1 + sizeof (ts_size))
+            return false;
+        std::memcpy (&ts_size, chunk + 1, sizeof (ts_size));
+
+        size_t ts_pos = 1 + sizeof (ts_size);
+        if (ts_size > size - ts_pos)
+            return false;
+
+        BitReader times (chunk + ts_pos, ts_size);
+        read_times (times, count, out.ts.data ());
+
+        BitReader values (chunk + ts_pos + ts_size, size - ts_pos - ts_size);
+        switch (c)
+        {
+            case Codec::delta_int:  read_delta_int (values, count, out.values.data ()); break;
+            case Codec::chimp:      read_chimp (values, count, out.values.data ()); break;
+            case Codec::dictionary: read_dictionary (values, count, out.values.data ()); break;
+            default:                read_rle (values, count, out.values.data ()); break;
+        }
+
+        return true;
+    }
+
+    /**
+     * Decode a chunk into points, see decode_columns
+     */
+    inline std::vector<Data> decode (uint8_t format, const byte_t* chunk, size_t size,
+                                     size_t count)
+    {
+        Columns columns;
+        if (!decode_columns (format, chunk, size, count, columns))
+            return {};
+
+        std::vector<Data> points (count);
+        for (size_t i = 0; i < count; ++i)
+            points[i] = columns.at (i);
+
+        return points;
+    }
+}
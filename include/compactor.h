@@ -0,0 +1,290 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+#include <limits>
+#include "types.h"
+#include "sstable.h"
+#include "rollup.h"
+#include "tsdb_config.h"
+
+using namespace config;
+
+/**
+ * Caps average throughput at bytes_per_sec by sleeping the caller
+ */
+class RateLimiter
+{
+private:
+    size_t bytes_per_sec;
+    size_t total {0};
+    std::chrono::steady_clock::time_point start {std::chrono::steady_clock::now ()};
+
+public:
+    /**
+     * 0 = unlimited
+     */
+    RateLimiter (size_t bytes_per_sec) : bytes_per_sec (bytes_per_sec) {}
+
+    /**
+     * Start a new accounting window
+     */
+    void reset ()
+    {
+        total = 0;
+        start = std::chrono::steady_clock::now ();
+    }
+
+    /**
+     * Account for bytes, sleep until they fit the budget
+     */
+    void acquire (size_t bytes)
+    {
+        if (bytes_per_sec == 0)
+            return;
+
+        total += bytes;
+        auto due = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>
+                   (std::chrono::duration<double> (double (total) / bytes_per_sec));
+
+        if (due > std::chrono::steady_clock::now ())
+            std::this_thread::sleep_until (due);
+    }
+};
+
+/**
+ * Merges flushed (level 0) SSTables into level 1 files, one per time
+ * partition, so reads touch few files and each series is stored as long
+ * contiguous chunks
+ * Level 1 partitions touched by the level 0 inputs are rewritten with them,
+ * duplicate timestamps keep the most recently written value and rollups are
+ * regenerated from the merged series
+ */
+class Compactor
+{
+private:
+    SSTableSet& sstables;
+    std::atomic<size_t>& next_id;
+    size_t trigger_files;
+    time_t partition_ms;
+    RateLimiter limiter;
+    size_t compaction_count {0};
+
+    /**
+     * Partition holding time t (floor division)
+     */
+    time_t partition_of (time_t t) const
+    {
+        return t >= 0 ? t / partition_ms : -((-t - 1) / partition_ms) - 1;
+    }
+
+public:
+    /**
+     * Sort by time, keep the last point of each equal-timestamp run
+     * Input is ordered oldest source first so last = newest
+     */
+    static void merge_dedup (std::vector<Data>& points)
+    {
+        auto by_time = [] (const Data& a, const Data& b) { return a.time_ms < b.time_ms; };
+        if (!std::is_sorted (points.begin (), points.end (), by_time))
+            std::stable_sort (points.begin (), points.end (), by_time);
+
+        size_t out = 0;
+        for (size_t i = 0; i < points.size (); ++i)
+        {
+            if (i + 1 < points.size () && points[i + 1].time_ms == points[i].time_ms)
+                continue;
+            points[out++] = points[i];
+        }
+        points.resize (out);
+    }
+
+    /**
+     * sstables: set to compact, next_id: shared SSTable id counter
+     */
+    Compactor (SSTableSet& sstables, std::atomic<size_t>& next_id,
+               size_t trigger_files = compaction_trigger_files,
+               time_t partition_ms = compaction_partition_ms,
+               size_t bytes_per_sec = compaction_bytes_per_sec)
+        : sstables (sstables), next_id (next_id),
+          trigger_files (std::max<size_t> (trigger_files, 1)),
+          partition_ms (std::max<time_t> (partition_ms, 1)),
+          limiter (bytes_per_sec) {}
+
+    /**
+     * compaction_count getter
+     */
+    size_t get_compaction_count () const
+    {
+        return compaction_count;
+    }
+
+    /**
+     * Compact if enough level 0 tables have piled up
+     * Returns whether a compaction ran and succeeded
+     */
+    bool maybe_compact ()
+    {
+        std::vector<SSTableSet::Entry> entries = sstables.entries ();
+        size_t level0 = std::count_if (entries.begin (), entries.end (),
+                                       [] (const SSTableSet::Entry& e) { return e.level == 0; });
+
+        if (level0 < trigger_files)
+            return false;
+
+        return compact (entries);
+    }
+
+    /**
+     * Merge every level 0 table of entries with the level 1 partitions
+     * they overlap, then swap the outputs in
+     * Returns false if an output could not be written, the inputs and the
+     * MANIFEST are then left untouched
+     */
+    bool compact (const std::vector<SSTableSet::Entry>& entries)
+    {
+        // Partitions touched by level 0 data, files of the original layout
+        // have no time bounds and may touch any of them
+        std::set<time_t> partitions;
+        bool unbounded = false;
+        for (const SSTableSet::Entry& entry : entries)
+        {
+            const SSTableReader& table = *entry.table;
+            if (entry.level != 0 || !table.overlaps (TimeRange {}))
+                continue;
+
+            if (table.get_min_ts () == std::numeric_limits<time_t>::min () ||
+                table.get_max_ts () == std::numeric_limits<time_t>::max ())
+            {
+                unbounded = true;
+                continue;
+            }
+
+            for (time_t p = partition_of (table.get_min_ts ());
+                 p <= partition_of (table.get_max_ts ()); ++p)
+                partitions.insert (p);
+        }
+
+        // Oldest data first: level 1 (compacted earlier), then level 0 by id
+        std::vector<std::shared_ptr<const SSTableReader>> inputs;
+        for (const SSTableSet::Entry& entry : entries)
+            if (entry.level == 1 && entry.table->overlaps (TimeRange {}) &&
+                (unbounded || partitions.count (partition_of (entry.table->get_min_ts ()))))
+                inputs.push_back (entry.table);
+
+        for (const SSTableSet::Entry& entry : entries)
+            if (entry.level == 0)
+                inputs.push_back (entry.table);
+
+        std::set<tag_t> tags;
+        for (const auto& table : inputs)
+            for (const auto& [tag, index_entry] : table->get_index ())
+                tags.insert (tag);
+
+        if (debug)
+            std::cout << "Compacting " << inputs.size () << " SSTables" << std::endl;
+
+        // One output (+ its rollups) per partition, opened when its first
+        // series arrives
+        struct Output
+        {
+            size_t id;
+            std::unique_ptr<SSTableWriter> writer;
+            std::unique_ptr<RollupWriter> rollups;
+        };
+        std::map<time_t, Output> outputs;
+        limiter.reset ();
+
+        for (const tag_t& tag : tags)
+        {
+            std::vector<Data> merged;
+            for (const auto& table : inputs)
+            {
+                std::vector<Data> points = table->read (tag);
+                merged.insert (merged.end (), points.begin (), points.end ());
+            }
+            merge_dedup (merged);
+
+            // Split at partition boundaries
+            for (size_t first = 0; first < merged.size ();)
+            {
+                time_t p = partition_of (merged[first].time_ms);
+                size_t last = first;
+                while (last < merged.size () && partition_of (merged[last].time_ms) == p)
+                    ++last;
+
+                Output& output = outputs[p];
+                if (!output.writer)
+                {
+                    output.id = next_id.fetch_add (1);
+                    output.writer = std::make_unique<SSTableWriter> (sstables.path_for (output.id));
+                    output.rollups = std::make_unique<RollupWriter>
+                                     (sstables.rollup_path_for (output.id));
+                }
+
+                std::vector<Data> slice (merged.begin () + first, merged.begin () + last);
+                limiter.acquire (output.writer->add (tag, slice) + output.rollups->add (tag, slice));
+                first = last;
+            }
+        }
+
+        // Every output must be durable before any input goes
+        bool written = true;
+        for (auto& [p, output] : outputs)
+            written = output.rollups->finish () && output.writer->finish () && written;
+
+        std::error_code ec;
+        auto drop_outputs = [&] ()
+        {
+            std::cerr << "Compaction failed, keeping its " << inputs.size () << " inputs" << std::endl;
+            for (auto& [p, output] : outputs)
+            {
+                std::filesystem::remove (sstables.path_for (output.id), ec);
+                std::filesystem::remove (sstables.rollup_path_for (output.id), ec);
+            }
+        };
+
+        if (!written)
+        {
+            drop_outputs ();
+            return false;
+        }
+
+        std::vector<SSTableSet::Entry> added;
+        for (auto& [p, output] : outputs)
+        {
+            added.push_back (SSTableSet::Entry {std::make_shared<const SSTableReader>
+                                                (sstables.path_for (output.id), output.id),
+                                                1, nullptr});
+        }
+
+        std::set<size_t> removed;
+        for (const auto& table : inputs)
+            removed.insert (table->get_id ());
+
+        // Manifest swap is the commit point, inputs stay mapped by open readers
+        if (!sstables.replace (removed, added))
+        {
+            drop_outputs ();
+            return false;
+        }
+
+        for (const auto& table : inputs)
+        {
+            std::filesystem::remove (table->get_path (), ec);
+            std::filesystem::remove (sstables.rollup_path_for (table->get_id ()), ec);
+        }
+
+        ++compaction_count;
+        return true;
+    }
+};
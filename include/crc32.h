@@ -0,0 +1,42 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * CRC-32 (IEEE, reflected), table driven
+ * Streaming: crc32 (b, n, crc32 (a, m)) == crc32 of a then b
+ */
+namespace crc
+{
+    inline const std::array<uint32_t, 256>& table ()
+    {
+        static const std::array<uint32_t, 256> t = []
+        {
+            std::array<uint32_t, 256> out {};
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k)
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                out[i] = c;
+            }
+            return out;
+        } ();
+
+        return t;
+    }
+
+    inline uint32_t crc32 (const void* data, size_t len, uint32_t prev = 0)
+    {
+        const std::array<uint32_t, 256>& t = table ();
+        const uint8_t* p = static_cast<const uint8_t*> (data);
+        uint32_t c = ~prev;
+
+        for (size_t i = 0; i < len; ++i)
+            c = t[(c ^ p[i]) & 0xFF] ^ (c >> 8);
+
+        return ~c;
+    }
+}
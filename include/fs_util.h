@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <filesystem>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * fsync a file and its parent directory so it survives a crash
+ */
+inline bool fsync_path (const std::string& path)
+{
+    int fd = ::open (path.c_str (), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << "Could not open " << path << " for fsync" << std::endl;
+        return false;
+    }
+
+    bool ok = ::fsync (fd) == 0;
+    ::close (fd);
+
+    // Directory entry
+    std::string dir = std::filesystem::path (path).parent_path ().string ();
+    int dir_fd = ::open (dir.empty () ? "." : dir.c_str (), O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0)
+    {
+        ok = ::fsync (dir_fd) == 0 && ok;
+        ::close (dir_fd);
+    }
+
+    if (!ok)
+        std::cerr << "fsync failed for " << path << std::endl;
+
+    return ok;
+}
@@ -1,42 +1,132 @@
 #pragma once
 #include <vector>
+#include <algorithm>
 #include "types.h"
 #include <cstring>
 #include "bit_buffer.h"
 
 /**
- * Handles compression
- * https://www.vldb.org/pvldb/vol8/p1816-teller.pdf 
+ * Stream layout shared by GorillaEncoder and GorillaDecoder
+ * https://www.vldb.org/pvldb/vol8/p1816-teller.pdf
+ *
+ * First point: ts i64, value f64 verbatim. Every later timestamp is a
+ * delta of delta (dod), values are XORed against the previous one
+ *
+ * format_v2 dod classes, signed two's complement, the first delta being a
+ * dod against 0:
+ *   '0' = 0, '10' 7 bits, '110' 9 bits, '1110' 12 bits, '11110' 32 bits,
+ *   '11111' 64 bits
+ * format_v1 (SSTable version 4 and older): the first delta in 14 unsigned
+ * bits, then '0', '10' dod + 63 in 7 bits or '11' 32 bits. Gaps over
+ * 16 s or dods beyond 32 bits don't survive it
  */
-class Gorilla
-{   
-private:
-    // Timestamp vars
-    size_t delta_bits {14};
-    size_t max_dod_bits {7};
-    int64_t max_dod {64};
-    int64_t min_dod {-63};
+namespace gorilla
+{
+    static constexpr uint8_t format_v1 {1};
+    static constexpr uint8_t format_v2 {2};
 
-    // Value vars
-    uint64_t last_val_bits = 0;
-    uint32_t last_leading_zeros = 0xFFFFFFFF;
-    uint32_t last_meaningful_len = 0;
+    // Written by default
+    static constexpr uint8_t format {format_v2};
+
+    // format_v1 timestamp vars
+    static constexpr size_t v1_delta_bits {14};
+    static constexpr size_t v1_dod_bits {7};
+    static constexpr int64_t v1_max_dod {64};
+    static constexpr int64_t v1_min_dod {-63};
+
+    // No XOR window yet
+    static constexpr uint32_t no_window {0xFFFFFFFF};
+
+    /**
+     * Whether val fits in bits as two's complement
+     */
+    inline bool fits (int64_t val, int bits)
+    {
+        return val >= -(int64_t {1} << (bits - 1)) && val < (int64_t {1} << (bits - 1));
+    }
+
+    /**
+     * Low bits of raw as a signed value
+     */
+    inline int64_t sign_extend (uint64_t raw, int bits)
+    {
+        return bits == 64 ? static_cast<int64_t> (raw)
+                          : static_cast<int64_t> (raw << (64 - bits)) >> (64 - bits);
+    }
 
-public:
     /**
-     * Reset the gorilla :D
+     * Write a format_v2 delta of delta
      */
-    void reset ()
+    inline void write_dod (BitWriter& out, int64_t dod)
     {
-        last_val_bits = 0;
-        last_leading_zeros = 0xFFFFFFFF;
-        last_meaningful_len = 0;
+        uint64_t bits = static_cast<uint64_t> (dod);
+
+        // Control bits and payload in one write where they fit
+        if (dod == 0)
+            out.write_bit (0);
+        else if (fits (dod, 7))
+            out.write_bits ((uint64_t {0b10} << 7) | (bits & 0x7F), 9);
+        else if (fits (dod, 9))
+            out.write_bits ((uint64_t {0b110} << 9) | (bits & 0x1FF), 12);
+        else if (fits (dod, 12))
+            out.write_bits ((uint64_t {0b1110} << 12) | (bits & 0xFFF), 16);
+        else if (fits (dod, 32))
+            out.write_bits ((uint64_t {0b11110} << 32) | (bits & 0xFFFFFFFF), 37);
+        else
+        {
+            out.write_bits (0b11111, 5);
+            out.write_bits (bits, 64);
+        }
+    }
+
+    /**
+     * Read a format_v2 delta of delta
+     */
+    inline int64_t read_dod (BitReader& in)
+    {
+        // Control bit 1
+        if (!in.read_bit ())
+            return 0;
+
+        // Class by the number of further 1 bits, see write_dod
+        int bits = 64;
+        if (!in.read_bit ())
+            bits = 7;
+        else if (!in.read_bit ())
+            bits = 9;
+        else if (!in.read_bit ())
+            bits = 12;
+        else if (!in.read_bit ())
+            bits = 32;
+
+        return sign_extend (in.read_bits (bits), bits);
     }
+}
+
+/**
+ * Appends points to a gorilla stream one at a time
+ * The stream can be read back at any point (get_bytes) while it keeps
+ * growing, so storage can encode as data arrives
+ */
+class GorillaEncoder
+{
+private:
+    BitWriter out;
+    uint8_t format {gorilla::format};
+    size_t count {0};
+    time_t first_ts {0};
+    time_t last_ts {0};
+    uint64_t last_delta {0};
+
+    // Value vars
+    uint64_t last_val_bits = 0;
+    uint32_t last_leading_zeros = gorilla::no_window;
+    uint32_t last_meaningful_len = 0;
 
     /**
      * Write floating point values, compressed with xor
      */
-    void write_value (data_t value, BitWriter& out)
+    void write_value (data_t value)
     {
         uint64_t val_bits;
         std::memcpy (&val_bits, &value, sizeof (data_t));
@@ -47,14 +137,15 @@ public:
         else
         {
             out.write_bit (1);
-            uint32_t leading_zeros = __builtin_clzll (xor_val);
+            // 5 bits hold at most 31, the window just starts earlier
+            uint32_t leading_zeros = std::min (__builtin_clzll (xor_val), 31);
             uint32_t trailing_zeros = __builtin_ctzll (xor_val);
             uint32_t meaningful_len = 64 - leading_zeros - trailing_zeros;
 
             // If meaningful len is same as last, shortcut
             if (leading_zeros >= last_leading_zeros &&
                 trailing_zeros >= (64 - last_leading_zeros - last_meaningful_len) &&
-                last_leading_zeros != 0xFFFFFFFF)
+                last_leading_zeros != gorilla::no_window)
             {
                 out.write_bit (0);
                 uint32_t last_trailing_zeros = 64 - last_leading_zeros
@@ -65,6 +156,7 @@ public:
             {
                 out.write_bit (1);
                 out.write_bits (leading_zeros, 5);
+                // 64 is written as 0, which is otherwise impossible
                 out.write_bits (meaningful_len, 6);
                 out.write_bits (xor_val >> trailing_zeros, meaningful_len);
 
@@ -77,99 +169,208 @@ public:
     }
 
     /**
-     * Encode w/ timestamp delta of delta compression
+     * Write a format_v1 timestamp
      */
-    void encode (const std::vector<Data>& points, BitWriter& out)
+    void write_v1 (int64_t delta)
     {
-        if (points.empty ())
+        // Second point, plain delta
+        if (count == 1)
+        {
+            out.write_bits (static_cast<uint64_t> (delta), gorilla::v1_delta_bits);
             return;
+        }
 
-        reset ();
-
-        // First point, write verbose
-        out.write_bits (points[0].time_ms, 64);
-        uint64_t first_val_bits;
-        std::memcpy (&first_val_bits, &points[0].value, sizeof (data_t));
-        out.write_bits (first_val_bits, 64);
-        last_val_bits = first_val_bits;
+        int64_t dod = delta - static_cast<int64_t> (last_delta);
 
-        if (points.size () < 2)
-            return;
-        
-        // Write second point
-        int64_t last_delta = points[1].time_ms - points[0].time_ms;
-        out.write_bits (static_cast<uint64_t> (last_delta), delta_bits);
-        write_value (points[1].value, out);
-
-        // Write rest
-        for (size_t i = 2; i < points.size (); ++i)
+        if (dod == 0)
+            out.write_bit (0);
+        else if (dod >= gorilla::v1_min_dod && dod <= gorilla::v1_max_dod)
+        {
+            out.write_bits (0b10, 2);
+            out.write_bits (static_cast<uint64_t> (dod + 63), gorilla::v1_dod_bits);
+        }
+        else
         {
-            int64_t delta = points[i].time_ms - points[ i -1].time_ms;
-            int64_t dod = delta - last_delta;
+            out.write_bits (0b11, 2);
+            out.write_bits (static_cast<uint64_t> (dod), 32);
+        }
+    }
 
-            if (dod == 0)
-                out.write_bit (0);
-            else if (dod >= min_dod && dod <= max_dod)
-            {
-                out.write_bits (0b10, 2);
-                out.write_bits (static_cast<uint64_t> (dod + 63), max_dod_bits);
-            }
-            else
-            {
-                out.write_bits (0b11, 2);
-                out.write_bits (static_cast<uint64_t> (dod), 32);
-            }
+public:
+    /**
+     * expected_points: reserve room for about that many points
+     * format: stream format, see the gorilla namespace
+     */
+    GorillaEncoder (size_t expected_points = 0, uint8_t format = gorilla::format)
+        : format (format)
+    {
+        // ~1-2 bytes/point on regular series, avoid regrowth
+        if (expected_points)
+            out.reserve (expected_points * 2 + 16);
+    }
+
+    /**
+     * Continue writing into out (e.g. after other fields), see release ()
+     */
+    GorillaEncoder (BitWriter&& out, size_t expected_points, uint8_t format = gorilla::format)
+        : GorillaEncoder (expected_points, format)
+    {
+        this->out = std::move (out);
+        if (expected_points)
+            this->out.reserve (this->out.size () + expected_points * 2 + 16);
+    }
 
-            write_value (points[i].value, out);
-            last_delta = delta;
+    /**
+     * Encode the next point w/ timestamp delta of delta compression
+     */
+    void append (const Data& point)
+    {
+        // First point, write verbose
+        if (count == 0)
+        {
+            out.write_bits (point.time_ms, 64);
+            std::memcpy (&last_val_bits, &point.value, sizeof (data_t));
+            out.write_bits (last_val_bits, 64);
+            first_ts = last_ts = point.time_ms;
+            ++count;
+            return;
         }
+
+        // Wrapping arithmetic, any pair of timestamps round-trips
+        uint64_t delta = static_cast<uint64_t> (point.time_ms) - static_cast<uint64_t> (last_ts);
+
+        if (format == gorilla::format_v1)
+            write_v1 (static_cast<int64_t> (delta));
+        else
+            gorilla::write_dod (out, static_cast<int64_t> (delta - last_delta));
+
+        write_value (point.value);
+        last_delta = delta;
+        last_ts = point.time_ms;
+        ++count;
     }
 
     /**
-     * Decode
+     * # points appended
      */
-    std::vector<Data> decode (const std::vector<byte_t>& compressed_data,
-                              size_t num_points)
+    size_t size () const
     {
-        if (num_points == 0)
-            return {};
-        
-        BitReader reader (compressed_data);
-        std::vector<Data> points;
+        return count;
+    }
 
-        // Recover first full data point
-        time_t last_ts = static_cast<size_t> (reader.read_bits (sizeof (size_t) * 8));
-        uint64_t last_val_bits = reader.read_bits (64);
+    /**
+     * Time of the first / last appended point
+     */
+    time_t first_time () const
+    {
+        return first_ts;
+    }
 
-        data_t last_val;
-        std::memcpy (&last_val, &last_val_bits, sizeof (data_t));
-        points.push_back (Data {last_ts, last_val});
+    time_t last_time () const
+    {
+        return last_ts;
+    }
 
-        if (num_points == 1)
-            return points;
-        
-        // Recover second
-        int64_t last_delta = static_cast<int64_t> (reader.read_bits (delta_bits));
+    /**
+     * Stream format written
+     */
+    uint8_t get_format () const
+    {
+        return format;
+    }
+
+    /**
+     * Encoded bytes so far, size of get_bytes ()
+     */
+    size_t byte_size () const
+    {
+        return out.size ();
+    }
+
+    /**
+     * Heap bytes held
+     */
+    size_t capacity () const
+    {
+        return out.capacity ();
+    }
+
+    /**
+     * Copy of the stream so far, decodable on its own, encoder stays open
+     */
+    std::vector<byte_t> get_bytes () const
+    {
+        return out.get_bytes ();
+    }
+
+    /**
+     * Close the stream and return it, the encoder starts a new one
+     */
+    std::vector<byte_t> finish ()
+    {
+        std::vector<byte_t> bytes = out.release ();
+        *this = GorillaEncoder (0, format);
+
+        return bytes;
+    }
+
+    /**
+     * Close the stream and hand back the writer (unflushed)
+     */
+    BitWriter release ()
+    {
+        BitWriter writer = std::move (out);
+        *this = GorillaEncoder (0, format);
 
-        last_leading_zeros = 0xFFFFFFFF;
-        last_meaningful_len = 0;
+        return writer;
+    }
+};
+
+/**
+ * Lazily decodes a gorilla stream one point at a time from a borrowed byte
+ * span, so readers can stop at the end of their range without
+ * materializing the series
+ */
+class GorillaDecoder
+{
+private:
+    BitReader reader;
+    size_t count;
+    uint8_t format;
+    size_t pos {0};
+    uint64_t last_ts {0};
+    uint64_t last_delta {0};
 
-        for (size_t i = 1; i < num_points; ++i)
+    // Value vars
+    uint64_t last_val_bits = 0;
+    uint32_t last_leading_zeros = gorilla::no_window;
+    uint32_t last_meaningful_len = 0;
+
+    // Point read ahead by seek_to_time
+    bool peeked {false};
+    Data peek;
+
+    /**
+     * Decode the point at pos, false once count points were read
+     */
+    bool decode_next (Data& point)
+    {
+        if (pos == count)
+            return false;
+
+        if (pos == 0)
+        {
+            // Recover first full data point
+            last_ts = reader.read_bits (64);
+            last_val_bits = reader.read_bits (64);
+        }
+        else
         {
             /* TIMESTAMP DECODING */
-            // Control bit 1
-            if (i > 1 && reader.read_bit ())
-            {
-                int64_t dod = 0;
-                // '10', 7 bit DOD
-                if (reader.read_bit () == 0)
-                    dod = static_cast<int64_t> (reader.read_bits (7)) - 63;
-                // '11', 32 bit DOd
-                else
-                    dod = static_cast<int64_t> (reader.read_bits (32));
-                
-                last_delta += dod;
-            }
+            if (format == gorilla::format_v1)
+                read_v1 ();
+            else
+                last_delta += gorilla::read_dod (reader);
 
             last_ts += last_delta;
 
@@ -182,6 +383,8 @@ public:
                 {
                     last_leading_zeros = static_cast<uint32_t> (reader.read_bits (5));
                     last_meaningful_len = static_cast<uint32_t> (reader.read_bits (6));
+                    if (last_meaningful_len == 0)
+                        last_meaningful_len = 64;
                 }
 
                 uint64_t bits = reader.read_bits (last_meaningful_len);
@@ -189,11 +392,199 @@ public:
                                                - last_meaningful_len);
                 last_val_bits ^= xor_val;
             }
+        }
+
+        point.time_ms = static_cast<time_t> (last_ts);
+        std::memcpy (&point.value, &last_val_bits, sizeof (data_t));
+        ++pos;
+
+        return true;
+    }
+
+    /**
+     * Read a format_v1 timestamp into last_delta
+     */
+    void read_v1 ()
+    {
+        // Recover second
+        if (pos == 1)
+        {
+            last_delta = reader.read_bits (gorilla::v1_delta_bits);
+            return;
+        }
+
+        // Control bit 1
+        if (reader.read_bit ())
+        {
+            int64_t dod = 0;
+            // '10', 7 bit DOD
+            if (reader.read_bit () == 0)
+                dod = static_cast<int64_t> (reader.read_bits (gorilla::v1_dod_bits)) - 63;
+            // '11', 32 bit DOD, written two's complement
+            else
+                dod = gorilla::sign_extend (reader.read_bits (32), 32);
+
+            last_delta += dod;
+        }
+    }
+
+public:
+    /**
+     * Decode count points from a byte span (e.g. a mapped SSTable), no copy
+     * format: stream format, see the gorilla namespace
+     */
+    GorillaDecoder (const byte_t* data, size_t size, size_t count,
+                    uint8_t format = gorilla::format)
+        : reader (data, size), count (count), format (format) {}
+
+    /**
+     * Buffer constructor, buf must outlive the decoder
+     */
+    GorillaDecoder (const std::vector<byte_t>& buf, size_t count,
+                    uint8_t format = gorilla::format)
+        : GorillaDecoder (buf.data (), buf.size (), count, format) {}
 
-            std::memcpy (&last_val, &last_val_bits, sizeof (data_t));
-            points.push_back (Data {last_ts, last_val});
+    /**
+     * Next point into point, false at the end of the stream
+     */
+    bool next (Data& point)
+    {
+        if (peeked)
+        {
+            point = peek;
+            peeked = false;
+            return true;
         }
 
+        return decode_next (point);
+    }
+
+    /**
+     * Skip to the first point at or after time_ms (next () returns it),
+     * false if there is none. Points before it are still decoded, the
+     * stream has no skip index
+     */
+    bool seek_to_time (time_t time_ms)
+    {
+        if (peeked && peek.time_ms >= time_ms)
+            return true;
+
+        while (decode_next (peek))
+        {
+            if (peek.time_ms >= time_ms)
+                return peeked = true;
+        }
+
+        return peeked = false;
+    }
+
+    /**
+     * Emit (time_ms, value) for every point not yet returned, the tight
+     * loop for whole-chunk decodes
+     */
+    template <typename Emit>
+    void drain (Emit&& emit)
+    {
+        if (peeked)
+        {
+            peeked = false;
+            emit (peek.time_ms, peek.value);
+        }
+
+        Data point;
+        while (decode_next (point))
+            emit (point.time_ms, point.value);
+    }
+
+    /**
+     * # points not yet returned
+     */
+    size_t remaining () const
+    {
+        return count - pos + peeked;
+    }
+};
+
+/**
+ * Handles compression of whole series, see GorillaEncoder / GorillaDecoder
+ */
+class Gorilla
+{
+private:
+    uint8_t format;
+
+public:
+    /**
+     * format: stream format read and written, see the gorilla namespace
+     */
+    Gorilla (uint8_t format = gorilla::format) : format (format) {}
+
+    /**
+     * Encode w/ timestamp delta of delta compression
+     */
+    void encode (const std::vector<Data>& points, BitWriter& out)
+    {
+        if (points.empty ())
+            return;
+
+        GorillaEncoder encoder (std::move (out), points.size (), format);
+        for (const Data& point : points)
+            encoder.append (point);
+
+        out = encoder.release ();
+    }
+
+    /**
+     * Decode
+     */
+    std::vector<Data> decode (const std::vector<byte_t>& compressed_data,
+                              size_t num_points)
+    {
+        return decode (compressed_data.data (), compressed_data.size (), num_points);
+    }
+
+    /**
+     * Decode a byte span, emit (time_ms, value) per point in order
+     */
+    template <typename Emit>
+    void decode_each (const byte_t* compressed_data, size_t size,
+                      size_t num_points, Emit&& emit)
+    {
+        GorillaDecoder (compressed_data, size, num_points, format).drain (emit);
+    }
+
+    /**
+     * Decode straight from a byte span (e.g. a mapped SSTable), no copy
+     */
+    std::vector<Data> decode (const byte_t* compressed_data, size_t size,
+                              size_t num_points)
+    {
+        std::vector<Data> points;
+        points.reserve (num_points);
+        decode_each (compressed_data, size, num_points, [&] (time_t ts, data_t val)
+                     { points.push_back (Data {ts, val}); });
+
         return points;
     }
-};
\ No newline at end of file
+
+    /**
+     * Decode a byte span into columns
+     */
+    Columns decode_columns (const byte_t* compressed_data, size_t size,
+                            size_t num_points)
+    {
+        Columns columns;
+        columns.ts.resize (num_points);
+        columns.values.resize (num_points);
+
+        size_t i = 0;
+        decode_each (compressed_data, size, num_points, [&] (time_t ts, data_t val)
+                     {
+                         columns.ts[i] = ts;
+                         columns.values[i] = val;
+                         ++i;
+                     });
+
+        return columns;
+    }
+};
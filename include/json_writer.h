@@ -0,0 +1,120 @@
+#pragma once
+
+#include <string>
+#include <cmath>
+#include <charconv>
+#include <string_view>
+#include "types.h"
+
+/**
+ * Appends compact JSON to a reusable buffer
+ * Numbers go through std::to_chars (shortest round-trip form for doubles),
+ * non-finite values become null since JSON has no NaN/Infinity
+ */
+class JsonWriter
+{
+private:
+    std::string buf;
+
+    /**
+     * to_chars value onto the end of buf
+     */
+    template <typename T>
+    void append_number (T value)
+    {
+        char tmp[32];
+        auto [end, ec] = std::to_chars (tmp, tmp + sizeof (tmp), value);
+        buf.append (tmp, ec == std::errc {} ? end - tmp : 0);
+    }
+
+public:
+    /**
+     * Reserve room for n_bytes
+     */
+    void reserve (size_t n_bytes)
+    {
+        buf.reserve (n_bytes);
+    }
+
+    /**
+     * Append pre-formatted JSON (punctuation, keys)
+     */
+    void raw (std::string_view text)
+    {
+        buf.append (text);
+    }
+
+    /**
+     * Append an integer
+     */
+    void number (int64_t value)
+    {
+        append_number (value);
+    }
+
+    /**
+     * Append a double, null if not finite
+     */
+    void number (double value)
+    {
+        if (std::isfinite (value))
+            append_number (value);
+        else
+            buf.append ("null");
+    }
+
+    /**
+     * Append a string, escaping quotes, backslashes and control characters
+     */
+    void string (std::string_view text)
+    {
+        static const char hex[] = "0123456789abcdef";
+
+        buf.push_back ('"');
+        for (char c : text)
+        {
+            if (c == '"' || c == '\\')
+            {
+                buf.push_back ('\\');
+                buf.push_back (c);
+            }
+            else if (static_cast<unsigned char> (c) < 0x20)
+            {
+                buf.append ("\\u00");
+                buf.push_back (hex[(c >> 4) & 0xF]);
+                buf.push_back (hex[c & 0xF]);
+            }
+            else
+                buf.push_back (c);
+        }
+        buf.push_back ('"');
+    }
+
+    /**
+     * Append {"ts":<time_ms>,"val":<value>}
+     */
+    void point (const Data& data)
+    {
+        buf.append ("{\"ts\":");
+        number (static_cast<int64_t> (data.time_ms));
+        buf.append (",\"val\":");
+        number (data.value);
+        buf.push_back ('}');
+    }
+
+    /**
+     * buf getter
+     */
+    const std::string& get_buffer () const
+    {
+        return buf;
+    }
+
+    /**
+     * Empty the buffer, keeping its capacity
+     */
+    void clear ()
+    {
+        buf.clear ();
+    }
+};
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <charconv>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "types.h"
+#include "series.h"
+#include "tsdb_config.h"
+
+/**
+ * Error for a single rejected line of a /write body
+ */
+struct ParseError
+{
+    size_t line;
+    std::string reason;
+};
+
+/**
+ * Result of parsing a full /write body
+ */
+struct ParseResult
+{
+    batch_t points;
+    std::vector<ParseError> errors;
+};
+
+/**
+ * Parse one "tag,timestamp,value" line into out, tag may be a label set
+ * (see labels)
+ * Returns empty string on success, else the rejection reason
+ */
+inline std::string parse_line (std::string_view line, Point& out)
+{
+    size_t first = line.find (',');
+    if (first == std::string_view::npos)
+        return "expected tag,timestamp,value";
+
+    size_t second = line.find (',', first + 1);
+    if (second == std::string_view::npos ||
+        line.find (',', second + 1) != std::string_view::npos)
+        return "expected tag,timestamp,value";
+
+    std::string_view tag = line.substr (0, first);
+    std::string_view ts = line.substr (first + 1, second - first - 1);
+    std::string_view val = line.substr (second + 1);
+
+    if (tag.empty ())
+        return "empty tag";
+
+    if (tag.size () > config::max_tag_bytes)
+        return "tag too long";
+
+    // Timestamp, must consume whole field
+    time_t time_ms = 0;
+    auto [ts_end, ts_err] = std::from_chars (ts.data (), ts.data () + ts.size (),
+                                             time_ms);
+    if (ts_err != std::errc () || ts_end != ts.data () + ts.size ())
+        return "bad timestamp";
+
+    // Value, must consume whole field
+    data_t value = 0;
+    auto [val_end, val_err] = std::from_chars (val.data (), val.data () + val.size (),
+                                               value);
+    if (val_err != std::errc () || val_end != val.data () + val.size ())
+        return "bad value";
+
+    // Label sets in any order name the same series
+    if (!labels::canonicalize (tag, out.tag))
+        return "bad labels, expected name;key=value;...";
+
+    out.data = Data {time_ms, value};
+    return {};
+}
+
+/**
+ * Parse a newline-delimited body in one pass
+ * Blank lines are skipped, line numbers are 1-based
+ */
+inline ParseResult parse_batch (std::string_view body)
+{
+    ParseResult result;
+    size_t line_no = 0;
+    size_t pos = 0;
+
+    while (pos < body.size ())
+    {
+        size_t end = body.find ('\n', pos);
+        if (end == std::string_view::npos)
+            end = body.size ();
+
+        std::string_view line = body.substr (pos, end - pos);
+        pos = end + 1;
+        ++line_no;
+
+        if (!line.empty () && line.back () == '\r')
+            line.remove_suffix (1);
+
+        if (line.empty ())
+            continue;
+
+        Point point;
+        std::string reason = parse_line (line, point);
+
+        if (reason.empty ())
+            result.points.push_back (std::move (point));
+        else
+            result.errors.push_back (ParseError {line_no, std::move (reason)});
+    }
+
+    return result;
+}
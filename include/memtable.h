@@ -1,43 +1,453 @@
 #pragma once
 
 #include <map>
+#include <algorithm>
+#include <array>
+#include <functional>
 #include <vector>
+#include <atomic>
+#include <limits>
+#include <sstream>
 #include <set>
 #include <string>
 #include <shared_mutex>
 #include <iostream>
 #include <mutex>
 #include <fstream>
+#include <filesystem>
+#include <future>
+#include <thread>
+#include <memory>
+#include <condition_variable>
 #include "types.h"
 #include "bit_buffer.h"
 #include "gorilla.h"
 #include "tsdb_config.h"
+#include "fs_util.h"
+#include "sstable.h"
+#include "rollup.h"
 
 using namespace config;
 
 /**
  * Thread-safe memory storage
+ * Series are striped by tag hash over independently locked shards.
+ * In compressed mode (see config::MemTableMode) a series is a run of sealed
+ * gorilla chunks of sstable_chunk_points, the open chunk being appended to
+ * and a raw tail of the newest points, which moves into the open chunk
+ * every memtable_tail_points. Chunks go into the SSTable as they are
  */
 class MemTable
 {
+public:
+    /**
+     * Encoded gorilla stream of count points in [min_ts, max_ts]
+     */
+    struct Chunk
+    {
+        std::vector<byte_t> bytes;
+        size_t count {0};
+        time_t min_ts {0};
+        time_t max_ts {0};
+    };
+
+    /**
+     * One series in time order: sealed chunks, open chunk, raw tail
+     * Raw mode keeps everything in the tail
+     */
+    struct Series
+    {
+        std::vector<Chunk> sealed;
+        GorillaEncoder open;
+        std::vector<Data> tail;
+
+        /**
+         * # points
+         */
+        size_t size () const
+        {
+            size_t n = open.size () + tail.size ();
+            for (const Chunk& chunk : sealed)
+                n += chunk.count;
+            return n;
+        }
+
+        /**
+         * Whether the series holds no point
+         */
+        bool empty () const
+        {
+            return tail.empty () && open.size () == 0 && sealed.empty ();
+        }
+    };
+
 private:
-    table_t table;
-    mutable std::shared_mutex mutex;
+    /**
+     * One lock stripe of the table
+     */
+    struct Shard
+    {
+        std::map<tag_t, Series> table;
+        mutable std::shared_mutex mutex;
+    };
+
+    std::array<Shard, memtable_shards> shards;
     std::atomic<size_t> total_count {0};
+    std::atomic<size_t> total_bytes {0};
+    MemTableMode mode;
+
+    /**
+     * Shard index owning tag
+     */
+    static size_t shard_index (const tag_t& tag)
+    {
+        return std::hash<tag_t> {} (tag) % memtable_shards;
+    }
+
+    Shard& shard_for (const tag_t& tag)
+    {
+        return shards[shard_index (tag)];
+    }
+
+    const Shard& shard_for (const tag_t& tag) const
+    {
+        return shards[shard_index (tag)];
+    }
+
+    /**
+     * Append keeping the series time-sorted, late points are placed in order
+     */
+    static void append_sorted (std::vector<Data>& series, const Data& point)
+    {
+        if (series.empty () || series.back ().time_ms <= point.time_ms)
+        {
+            series.push_back (point);
+            return;
+        }
+
+        auto pos = std::upper_bound (series.begin (), series.end (), point.time_ms,
+                                     [] (time_t t, const Data& d) { return t < d.time_ms; });
+        series.insert (pos, point);
+    }
+
+    /**
+     * Index range [first, last) of series inside range
+     */
+    static std::pair<size_t, size_t> find_range (const std::vector<Data>& series,
+                                                 const TimeRange& range)
+    {
+        auto first = std::lower_bound (series.begin (), series.end (), range.start,
+                                       [] (const Data& d, time_t t) { return d.time_ms < t; });
+        auto last = std::upper_bound (first, series.end (), range.end,
+                                      [] (time_t t, const Data& d) { return t < d.time_ms; });
+
+        return {first - series.begin (), last - series.begin ()};
+    }
+
+    /**
+     * Accounted size of a chunk
+     */
+    static size_t chunk_bytes (const Chunk& chunk)
+    {
+        return chunk.bytes.capacity () + sizeof (Chunk);
+    }
+
+    /**
+     * Encode a sorted run of n points
+     */
+    static Chunk encode_chunk (const Data* points, size_t n)
+    {
+        GorillaEncoder encoder (n);
+        for (size_t i = 0; i < n; ++i)
+            encoder.append (points[i]);
+
+        return seal (encoder);
+    }
+
+    /**
+     * Close encoder into a chunk, leaves it empty
+     */
+    static Chunk seal (GorillaEncoder& encoder)
+    {
+        Chunk chunk;
+        chunk.count = encoder.size ();
+        chunk.min_ts = encoder.first_time ();
+        chunk.max_ts = encoder.last_time ();
+        chunk.bytes = encoder.finish ();
+        chunk.bytes.shrink_to_fit ();
+
+        return chunk;
+    }
+
+    /**
+     * Snapshot of the open chunk, stays open
+     */
+    static Chunk open_chunk (const Series& series)
+    {
+        Chunk chunk;
+        chunk.count = series.open.size ();
+        chunk.min_ts = series.open.first_time ();
+        chunk.max_ts = series.open.last_time ();
+        if (chunk.count)
+            chunk.bytes = series.open.get_bytes ();
+
+        return chunk;
+    }
+
+    /**
+     * Points of a chunk
+     */
+    static std::vector<Data> decode_chunk (const Chunk& chunk)
+    {
+        if (chunk.count == 0)
+            return {};
+
+        return Gorilla ().decode (chunk.bytes.data (), chunk.bytes.size (), chunk.count);
+    }
+
+    /**
+     * Points of a chunk inside range, decoding stops past range.end
+     */
+    static std::vector<Data> decode_range (const Chunk& chunk, const TimeRange& range)
+    {
+        std::vector<Data> points;
+        if (chunk.count == 0 || !range.overlaps (chunk.min_ts, chunk.max_ts))
+            return points;
+
+        GorillaDecoder decoder (chunk.bytes, chunk.count);
+        if (!decoder.seek_to_time (range.start))
+            return points;
+
+        points.reserve (decoder.remaining ());
+        Data point;
+        while (decoder.next (point) && point.time_ms <= range.end)
+            points.push_back (point);
+
+        return points;
+    }
+
+    /**
+     * Append sorted points to the open chunk, sealing it every
+     * sstable_chunk_points, returns the change in accounted bytes
+     */
+    static long append_open (Series& series, const Data* points, size_t n)
+    {
+        long delta = -static_cast<long> (series.open.capacity ());
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            series.open.append (points[i]);
+            if (series.open.size () >= sstable_chunk_points)
+            {
+                series.sealed.push_back (seal (series.open));
+                delta += chunk_bytes (series.sealed.back ());
+            }
+        }
+
+        return delta + series.open.capacity ();
+    }
+
+    /**
+     * Add one point to series, returns the change in accounted bytes
+     */
+    long add_point (Series& series, const Data& point) const
+    {
+        time_t encoded_max = series.open.size () ? series.open.last_time ()
+                           : series.sealed.empty () ? std::numeric_limits<time_t>::min ()
+                           : series.sealed.back ().max_ts;
+
+        // Usual case, newer than everything encoded
+        if (point.time_ms >= encoded_max)
+        {
+            append_sorted (series.tail, point);
+            long delta = sizeof (Data);
+
+            if (mode == MemTableMode::compressed && series.tail.size () >= memtable_tail_points)
+            {
+                delta += append_open (series, series.tail.data (), series.tail.size ());
+                delta -= series.tail.size () * sizeof (Data);
+                series.tail.clear ();
+            }
+
+            return delta;
+        }
+
+        // Late point into the open chunk, rebuild it
+        if (series.open.size () &&
+            (series.sealed.empty () || point.time_ms >= series.sealed.back ().max_ts))
+        {
+            std::vector<Data> points = decode_chunk (open_chunk (series));
+            append_sorted (points, point);
+
+            long delta = -static_cast<long> (series.open.capacity ());
+            series.open = GorillaEncoder ();
+            return delta + append_open (series, points.data (), points.size ());
+        }
+
+        // Late point into a sealed chunk, rewrite the one it falls into
+        auto it = std::upper_bound (series.sealed.begin (), series.sealed.end (),
+                                    point.time_ms, [] (time_t t, const Chunk& c)
+                                    { return t < c.max_ts; });
+
+        std::vector<Data> points = decode_chunk (*it);
+        append_sorted (points, point);
+
+        long delta = -static_cast<long> (chunk_bytes (*it));
+        *it = encode_chunk (points.data (), points.size ());
+
+        return delta + chunk_bytes (*it);
+    }
+
+    /**
+     * Call fn (points, n) on the ascending spans of series inside range
+     * Only chunks overlapping range are decoded, each up to range.end
+     */
+    template <typename Fn>
+    static void visit_series (const Series& series, const TimeRange& range, Fn&& fn)
+    {
+        auto visit_chunk = [&] (const Chunk& chunk)
+        {
+            std::vector<Data> points = decode_range (chunk, range);
+            if (!points.empty ())
+                fn (points.data (), points.size ());
+        };
+
+        for (const Chunk& chunk : series.sealed)
+            visit_chunk (chunk);
+
+        if (series.open.size () &&
+            range.overlaps (series.open.first_time (), series.open.last_time ()))
+            visit_chunk (open_chunk (series));
+
+        auto [first, last] = find_range (series.tail, range);
+        if (last > first)
+            fn (series.tail.data () + first, last - first);
+    }
+
+    /**
+     * Every point of series
+     */
+    static std::vector<Data> materialize (const Series& series)
+    {
+        std::vector<Data> points;
+        points.reserve (series.size ());
+        visit_series (series, TimeRange {}, [&] (const Data* p, size_t n)
+                      { points.insert (points.end (), p, p + n); });
+
+        return points;
+    }
 
 public:
+    /**
+     * mode: raw points or compressed chunks, see config::MemTableMode
+     */
+    MemTable (MemTableMode mode = memtable_mode) : mode (mode) {}
+
     /**
      * Insert data into the MemTable
      */
     void insert (const tag_t& tag, time_t time_ms, data_t val)
     {
-        // Single writer
-        std::unique_lock lock (mutex);
+        Shard& shard = shard_for (tag);
+
+        // Single writer per shard
+        std::unique_lock lock (shard.mutex);
 
-        table[tag].push_back (Data {time_ms, val});
+        total_bytes += add_point (shard.table[tag], Data {time_ms, val});
         ++total_count;
     }
 
+    /**
+     * Insert a whole batch, one lock acquisition per touched shard
+     */
+    void insert_batch (const batch_t& batch)
+    {
+        std::array<std::vector<const Point*>, memtable_shards> by_shard;
+        for (const Point& point : batch)
+            by_shard[shard_index (point.tag)].push_back (&point);
+
+        for (size_t i = 0; i < memtable_shards; ++i)
+        {
+            if (by_shard[i].empty ())
+                continue;
+
+            // Single writer per shard
+            std::unique_lock lock (shards[i].mutex);
+
+            long bytes = 0;
+            Series* series = nullptr;
+            const tag_t* last_tag = nullptr;
+            for (const Point* point : by_shard[i])
+            {
+                // Batches are usually runs of one series, skip the lookup
+                if (!series || point->tag != *last_tag)
+                {
+                    series = &shards[i].table[point->tag];
+                    last_tag = &point->tag;
+                }
+                bytes += add_point (*series, point->data);
+            }
+
+            total_bytes += bytes;
+            total_count += by_shard[i].size ();
+        }
+    }
+
+    /**
+     * Bulk insert whole series (e.g. WAL recovery), one lock per shard
+     * Series are appended after any points already held for the tag
+     */
+    void insert_table (table_t&& d_table)
+    {
+        std::array<std::vector<table_t::node_type>, memtable_shards> by_shard;
+        while (!d_table.empty ())
+        {
+            table_t::node_type node = d_table.extract (d_table.begin ());
+            by_shard[shard_index (node.key ())].push_back (std::move (node));
+        }
+
+        auto by_time = [] (const Data& a, const Data& b) { return a.time_ms < b.time_ms; };
+
+        for (size_t i = 0; i < memtable_shards; ++i)
+        {
+            if (by_shard[i].empty ())
+                continue;
+
+            std::unique_lock lock (shards[i].mutex);
+
+            for (table_t::node_type& node : by_shard[i])
+            {
+                std::vector<Data>& points = node.mapped ();
+                Series& series = shards[i].table[node.key ()];
+                size_t count = points.size ();
+
+                if (!series.empty ())
+                {
+                    long bytes = 0;
+                    for (const Data& point : points)
+                        bytes += add_point (series, point);
+                    total_bytes += bytes;
+                    total_count += count;
+                    continue;
+                }
+
+                if (!std::is_sorted (points.begin (), points.end (), by_time))
+                    std::stable_sort (points.begin (), points.end (), by_time);
+
+                // Fresh series, encode the whole run at once
+                if (mode == MemTableMode::compressed)
+                    total_bytes += append_open (series, points.data (), count);
+                else
+                {
+                    series.tail = std::move (points);
+                    total_bytes += count * sizeof (Data);
+                }
+
+                total_count += count;
+            }
+        }
+    }
+
     /**
      * Get total number of data points in the MemTable
      */
@@ -46,95 +456,368 @@ public:
         return total_count.load ();
     }
 
+    /**
+     * Memory held by points, encoded chunks count their compressed size
+     */
+    size_t get_bytes () const
+    {
+        return total_bytes.load ();
+    }
+
+    /**
+     * mode getter
+     */
+    MemTableMode get_mode () const
+    {
+        return mode;
+    }
+
     /**
      * Get number of datapoints for tag
      */
     size_t get_count (const std::string& tag) const
     {
+        const Shard& shard = shard_for (tag);
+
         // Multi reader
-        std::shared_lock lock (mutex);
+        std::shared_lock lock (shard.mutex);
+
+        auto it = shard.table.find (tag);
+        if (it != shard.table.end ())
+            return it->second.size ();
 
-        if (table.find (tag) != table.end ())
-            return table.at (tag).size ();
-        
         return 0;
     }
 
     /**
      * Move MemTable into a snapshot, clear MemTable
+     * All shards are locked together so the snapshot is a consistent cut
      */
     table_t extract ()
     {
-        // Single writer
-        std::unique_lock lock (mutex);
+        std::array<std::unique_lock<std::shared_mutex>, memtable_shards> locks;
+        for (size_t i = 0; i < memtable_shards; ++i)
+            locks[i] = std::unique_lock (shards[i].mutex);
 
-        table_t snapshot = std::move (table);
-        table.clear ();
+        table_t snapshot;
+        for (Shard& shard : shards)
+        {
+            for (auto& [tag, series] : shard.table)
+                snapshot.emplace (tag, materialize (series));
+            shard.table.clear ();
+        }
         total_count.store (0);
+        total_bytes.store (0);
 
         return snapshot;
     }
-    
+
     /**
-     * Get data corresponding to tag
+     * Get data corresponding to tag, empty if tag is unknown
      */
     std::vector<Data> get_data (const std::string& tag) const
     {
+        const Shard& shard = shard_for (tag);
+
         // Multi reader
-        std::shared_lock lock (mutex);
+        std::shared_lock lock (shard.mutex);
+
+        auto it = shard.table.find (tag);
+        if (it == shard.table.end ())
+            return {};
 
-        std::vector<Data> result {table.at (tag)};
-        return result;
+        return materialize (it->second);
     }
 
     /**
-     * Flush table to disk (Sorted String Table), timestamp sorted
-     * Not thread-safe, pass in extracted MemTable!
+     * Get points of tag inside range, only the window is copied (and only
+     * the chunks overlapping it decoded) under the lock
+     * limit: max points (0 = all), taken from the newest end if descending
+     * Result is always ascending by time
      */
-    void flush (const table_t& d_table, id_t batch_id) const
+    std::vector<Data> get_range (const std::string& tag, const TimeRange& range,
+                                 size_t limit = 0, bool descending = false) const
     {
-        Gorilla gorilla;
-        std::string path = get_sstable_path (std::to_string (batch_id));
-        std::ofstream out (path, std::ios::binary);
+        const Shard& shard = shard_for (tag);
 
-        for (const auto& [tag, data] : d_table)
+        // Multi reader
+        std::shared_lock lock (shard.mutex);
+
+        auto it = shard.table.find (tag);
+        if (it == shard.table.end ())
+            return {};
+
+        const Series& series = it->second;
+        std::vector<Data> points;
+
+        if (limit == 0 || !descending)
         {
-            if (data.empty ())
-                continue;
-            
-            BitWriter writer;
-            gorilla.encode (data, writer);
-            writer.flush ();
-
-            // Write tag
-            size_t tag_len = tag.size ();
-            out.write (reinterpret_cast<const char*>(&tag_len), sizeof (tag_len));
-            out.write (tag.data (), tag_len);
-
-            // Write num points
-            size_t num_pts = data.size ();
-            out.write (reinterpret_cast<const char*> (&num_pts), sizeof (num_pts));
-
-            // Write size
-            const std::vector<byte_t>& compressed_buf = writer.get_buffer ();
-            size_t compressed_bytes = compressed_buf.size ();
-            out.write (reinterpret_cast<const char*> (&compressed_bytes), sizeof (compressed_bytes));
-
-            // Write gorilla
-            out.write (reinterpret_cast<const char*> (compressed_buf.data ()), compressed_bytes);
-
-            size_t raw_size = num_pts * sizeof (Data);
-            double ratio = (static_cast<double> (compressed_bytes) / raw_size) * 100.0;
-            
+            // Oldest first, stop once limit points are in
+            auto take = [&] (const Data* p, size_t n)
+            {
+                if (limit == 0 || points.size () < limit)
+                    points.insert (points.end (), p, p + (limit ? std::min (n, limit - points.size ())
+                                                                : n));
+            };
+
+            visit_series (series, range, take);
+            return points;
+        }
+
+        // Newest first: tail, open chunk, then sealed chunks backwards until
+        // limit points are in, each part only copies the newest points still
+        // missing
+        std::vector<std::vector<Data>> parts;
+        size_t total = 0;
+        auto take = [&] (const Data* p, size_t n)
+        {
+            size_t keep = std::min (n, limit - total);
+            parts.emplace_back (p + n - keep, p + n);
+            total += keep;
+        };
+
+        auto [first, last] = find_range (series.tail, range);
+        take (series.tail.data () + first, last - first);
+
+        if (total < limit)
+        {
+            std::vector<Data> decoded = decode_range (open_chunk (series), range);
+            take (decoded.data (), decoded.size ());
+        }
+
+        for (size_t c = series.sealed.size (); c-- > 0 && total < limit;)
+        {
+            std::vector<Data> decoded = decode_range (series.sealed[c], range);
+            take (decoded.data (), decoded.size ());
+        }
+
+        points.reserve (total);
+        for (size_t p = parts.size (); p-- > 0;)
+            points.insert (points.end (), parts[p].begin (), parts[p].end ());
+
+        return points;
+    }
+
+    /**
+     * Call fn (points, n) on the ascending spans of tag inside range, under
+     * the shard's read lock, so fn must not touch this table
+     */
+    template <typename Fn>
+    void visit_range (const std::string& tag, const TimeRange& range, Fn&& fn) const
+    {
+        const Shard& shard = shard_for (tag);
+        std::shared_lock lock (shard.mutex);
+
+        auto it = shard.table.find (tag);
+        if (it == shard.table.end ())
+            return;
+
+        visit_series (it->second, range, fn);
+    }
+
+    /**
+     * First and last timestamp of tag, false if the table has no such series
+     */
+    bool get_bounds (const std::string& tag, time_t& first, time_t& last) const
+    {
+        const Shard& shard = shard_for (tag);
+        std::shared_lock lock (shard.mutex);
+
+        auto it = shard.table.find (tag);
+        if (it == shard.table.end () || it->second.empty ())
+            return false;
+
+        const Series& series = it->second;
+        first = !series.sealed.empty () ? series.sealed.front ().min_ts
+                : series.open.size () ? series.open.first_time ()
+                : series.tail.front ().time_ms;
+        last = !series.tail.empty () ? series.tail.back ().time_ms
+               : series.open.size () ? series.open.last_time ()
+               : series.sealed.back ().max_ts;
+        return true;
+    }
+
+    /**
+     * One series encoded for write_sstable
+     */
+    struct FlushBlock
+    {
+        sstable::Block table;
+        sstable::Block rollups;
+        size_t compressed_bytes {0};
+        size_t raw_bytes {0};
+    };
+
+    /**
+     * Encode one series into its SSTable and rollup blocks
+     * Sealed and open chunks are handed over already encoded, only the
+     * tail gets encoded from points
+     */
+    static void encode_series (const tag_t& tag, const Series& data, bool rollups,
+                               FlushBlock& block)
+    {
+        for (const Chunk& chunk : data.sealed)
+            block.compressed_bytes += block.table.add_encoded (tag, chunk.bytes.data (),
+                                                               chunk.bytes.size (), chunk.count,
+                                                               chunk.min_ts, chunk.max_ts);
+
+        if (data.open.size ())
+        {
+            Chunk open = open_chunk (data);
+            block.compressed_bytes += block.table.add_encoded (tag, open.bytes.data (),
+                                                               open.bytes.size (), open.count,
+                                                               open.min_ts, open.max_ts);
+        }
+
+        block.compressed_bytes += block.table.add (tag, data.tail);
+        block.raw_bytes = data.size () * sizeof (Data);
+
+        if (rollups)
+            RollupWriter::encode (tag, materialize (data), block.rollups);
+    }
+
+    /**
+     * Write tag-sorted series to disk (Sorted String Table) and fsync it
+     * Workers encode series into their own blocks while this thread appends
+     * finished blocks in tag order, one sequential write each. Both files
+     * are renamed into place at the end, rollups first: the SSTable's
+     * presence implies its rollup is complete. Returns false if either
+     * write failed, neither file is left behind then
+     */
+    static bool write_sstable (const std::map<tag_t, const Series*>& series,
+                               const std::string& path, const std::string& rollup_path = "")
+    {
+        std::vector<std::pair<const tag_t*, const Series*>> todo;
+        for (const auto& [tag, series_ptr] : series)
+            if (!series_ptr->empty ())
+                todo.emplace_back (&tag, series_ptr);
+
+        std::vector<FlushBlock> blocks (todo.size ());
+        std::vector<bool> ready (todo.size (), false);
+        std::mutex ready_mutex;
+        std::condition_variable ready_cv;
+        std::atomic<size_t> next {0};
+        std::atomic<bool> failed {false};
+
+        // A throwing encode (e.g. bad_alloc) fails the flush, not the thread
+        auto encode = [&] (size_t i)
+        {
+            try
+            {
+                encode_series (*todo[i].first, *todo[i].second, !rollup_path.empty (),
+                               blocks[i]);
+            }
+            catch (const std::exception& e)
+            {
+                std::cerr << "Could not encode series " << *todo[i].first
+                          << " for " << path << ": " << e.what () << std::endl;
+                failed.store (true);
+            }
+        };
+
+        size_t workers = std::min<size_t> (std::max (1u, std::thread::hardware_concurrency ()),
+                                           todo.size () / memtable_parallel_flush_series);
+
+        // Each worker pulls the next unclaimed series
+        std::vector<std::future<void>> tasks;
+        if (workers > 1)
+            for (size_t w = 0; w < workers; ++w)
+                tasks.push_back (std::async (std::launch::async, [&] ()
+                {
+                    for (size_t i = next++; i < todo.size (); i = next++)
+                    {
+                        encode (i);
+
+                        // Slot is ready even if it failed, the writer checks failed
+                        std::lock_guard<std::mutex> guard (ready_mutex);
+                        ready[i] = true;
+                        ready_cv.notify_one ();
+                    }
+                }));
+
+        SSTableWriter writer (path);
+        std::unique_ptr<RollupWriter> rollups;
+        if (!rollup_path.empty ())
+            rollups = std::make_unique<RollupWriter> (rollup_path);
+
+        for (size_t i = 0; i < todo.size (); ++i)
+        {
+            if (workers > 1)
+            {
+                std::unique_lock lock (ready_mutex);
+                ready_cv.wait (lock, [&] { return ready[i] || failed.load (); });
+            }
+            else
+                encode (i);
+
+            // Stop handing out series, the unfinished files are removed
+            if (failed.load ())
+            {
+                next.store (todo.size ());
+                break;
+            }
+
+            FlushBlock block = std::move (blocks[i]);
+            writer.append (block.table);
+            if (rollups)
+                rollups->append (block.rollups);
+
+            double ratio = (static_cast<double> (block.compressed_bytes) / block.raw_bytes) * 100.0;
             if (debug)
-                std::cout << "[Flush] Tag: " << tag <<
+                std::cout << "[Flush] Tag: " << *todo[i].first <<
                              " Ratio: " << ratio << "%" << std::endl;
         }
 
+        for (auto& task : tasks)
+            task.get ();
+
         if (debug)
             std::cout << std::endl;
-            
-        out.close ();
+
+        if (failed.load ())
+            return false;
+
+        if (rollups && !rollups->finish ())
+            return false;
+
+        if (!writer.finish ())
+        {
+            std::error_code ec;
+            if (rollups)
+                std::filesystem::remove (rollup_path, ec);
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Flush own contents to disk, for a frozen MemTable that takes no more
+     * inserts. Contents stay readable during and after the flush
+     * Returns false if the SSTable could not be written, retry later
+     */
+    bool flush (id_t batch_id) const
+    {
+        std::string path = get_sstable_path (std::to_string (batch_id));
+        return flush_to (path, rollup::path_for (path));
+    }
+
+    /**
+     * Flush own contents to an SSTable at path, see flush (id_t)
+     * rollup_path: where to write its rollups, empty for none
+     */
+    bool flush_to (const std::string& path, const std::string& rollup_path = "") const
+    {
+        std::array<std::shared_lock<std::shared_mutex>, memtable_shards> locks;
+        for (size_t i = 0; i < memtable_shards; ++i)
+            locks[i] = std::shared_lock (shards[i].mutex);
+
+        std::map<tag_t, const Series*> series;
+        for (const Shard& shard : shards)
+            for (const auto& [tag, data] : shard.table)
+                series.emplace (tag, &data);
+
+        return write_sstable (series, path, rollup_path);
     }
 
     /**
@@ -142,13 +825,16 @@ public:
      */
     const std::set<std::string> get_tags () const
     {
-        // Multi reader
-        std::shared_lock lock (mutex);
-
         std::set<std::string> tags;
-        for (const auto& [tag, data] : table)
-            if (!data.empty ())
-                tags.insert (tag);
+        for (const Shard& shard : shards)
+        {
+            // Multi reader
+            std::shared_lock lock (shard.mutex);
+
+            for (const auto& [tag, data] : shard.table)
+                if (!data.empty ())
+                    tags.insert (tag);
+        }
 
         return tags;
     }
@@ -158,17 +844,23 @@ public:
      */
     void print (std::ostream& out = std::cout) const
     {
-        std::stringstream ss;
-        std::shared_lock lock (mutex);
+        std::map<std::string, size_t> counts;
+        for (const Shard& shard : shards)
+        {
+            std::shared_lock lock (shard.mutex);
+
+            for (const auto& [tag, data] : shard.table)
+                counts[tag] = data.size ();
+        }
 
-        for (const auto& [tag, data] : table)
+        for (const auto& [tag, count] : counts)
         {
-            out << "tag:" << tag 
-                << " | Count: " << data.size ()
+            out << "tag:" << tag
+                << " | Count: " << count
                 << std::endl;
         }
 
-        float estimated_kb = get_total_count () * sizeof (Data) >> 10;
+        float estimated_kb = get_bytes () >> 10;
         out << "Estimated KB: " << estimated_kb << std::endl;
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "types.h"
+
+/**
+ * Read-only memory mapping of a whole immutable file
+ * The mapping outlives unlink, so a file can be deleted while mapped
+ */
+class MappedFile
+{
+private:
+    const byte_t* data {nullptr};
+    size_t size {0};
+
+public:
+    /**
+     * Map path, empty mapping on failure
+     */
+    MappedFile (const std::string& path)
+    {
+        int fd = ::open (path.c_str (), O_RDONLY);
+        if (fd < 0)
+        {
+            std::cerr << "Could not open " << path << " for mmap" << std::endl;
+            return;
+        }
+
+        struct stat st;
+        if (::fstat (fd, &st) == 0 && st.st_size > 0)
+        {
+            void* addr = ::mmap (nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr != MAP_FAILED)
+            {
+                data = static_cast<const byte_t*> (addr);
+                size = static_cast<size_t> (st.st_size);
+            }
+            else
+            {
+                std::cerr << "mmap failed for " << path << std::endl;
+                perror ("Reason");
+            }
+        }
+
+        // Mapping keeps its own reference
+        ::close (fd);
+    }
+
+    MappedFile (const MappedFile&) = delete;
+    MappedFile& operator= (const MappedFile&) = delete;
+
+    /**
+     * data getter
+     */
+    const byte_t* get_data () const
+    {
+        return data;
+    }
+
+    /**
+     * size getter
+     */
+    size_t get_size () const
+    {
+        return size;
+    }
+
+    /**
+     * Destructor, unmap
+     */
+    ~MappedFile ()
+    {
+        if (data)
+            ::munmap (const_cast<byte_t*> (data), size);
+    }
+};
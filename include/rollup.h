@@ -0,0 +1,138 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <filesystem>
+#include "types.h"
+#include "aggregate.h"
+#include "sstable.h"
+#include "tsdb_config.h"
+
+using namespace config;
+
+/**
+ * Pre-aggregated rollups, written next to an SSTable as rollup_<id>.db
+ * For each series and resolution in rollup_resolutions_ms the side file
+ * holds four series "<tag>|<resolution ms>|<stat>" (stat: min, max, sum,
+ * count), one point per epoch-aligned non-empty bucket at its start time
+ */
+namespace rollup
+{
+    static constexpr const char* stats[] = {"min", "max", "sum", "count"};
+
+    /**
+     * Name of one rollup series
+     */
+    inline std::string series_name (const tag_t& tag, time_t resolution, const char* stat)
+    {
+        return tag + "|" + std::to_string (resolution) + "|" + stat;
+    }
+
+    /**
+     * Side file of the SSTable at path: sstable_<id>.db -> rollup_<id>.db
+     */
+    inline std::string path_for (const std::string& sstable_path)
+    {
+        std::filesystem::path path (sstable_path);
+        std::string name = path.filename ().string ();
+        if (name.rfind ("sstable_", 0) == 0)
+            name = name.substr (8);
+
+        return (path.parent_path () / ("rollup_" + name)).string ();
+    }
+
+    /**
+     * Coarsest resolution that can answer buckets of step aligned to origin
+     * over range exactly, 0 if none. Partial buckets at the range edges
+     * would over-count, so the ends must be aligned too
+     */
+    inline time_t pick_resolution (time_t step, time_t origin, const TimeRange& range)
+    {
+        time_t best = 0;
+        for (time_t res : rollup_resolutions_ms)
+        {
+            bool start_ok = range.start == TimeRange {}.start || range.start % res == 0;
+            bool end_ok = range.end == TimeRange {}.end || (range.end + 1) % res == 0;
+
+            if (step % res == 0 && origin % res == 0 && start_ok && end_ok)
+                best = std::max (best, res);
+        }
+
+        return best;
+    }
+}
+
+/**
+ * Writes the rollups of time-sorted series to a side SSTable
+ */
+class RollupWriter
+{
+private:
+    SSTableWriter writer;
+
+public:
+    /**
+     * Open path for writing, truncates
+     */
+    RollupWriter (const std::string& path) : writer (path) {}
+
+    /**
+     * Aggregate one time-sorted series at every resolution into block,
+     * returns bytes. Needs no writer, flush workers call it in parallel
+     */
+    static size_t encode (const tag_t& tag, const std::vector<Data>& data, sstable::Block& block)
+    {
+        if (data.empty ())
+            return 0;
+
+        size_t total = 0;
+        for (time_t res : rollup_resolutions_ms)
+        {
+            BucketAggregator buckets (0, res, data.size ());
+            buckets.add (data.data (), data.size ());
+
+            std::vector<Data> columns[4];
+            for (const auto& [idx, bucket] : buckets.get_buckets ())
+            {
+                time_t start = buckets.bucket_start (idx);
+                columns[0].push_back (Data {start, bucket.min});
+                columns[1].push_back (Data {start, bucket.max});
+                columns[2].push_back (Data {start, bucket.sum});
+                columns[3].push_back (Data {start, static_cast<data_t> (bucket.count)});
+            }
+
+            for (int s = 0; s < 4; ++s)
+                total += block.add (rollup::series_name (tag, res, rollup::stats[s]), columns[s]);
+        }
+
+        return total;
+    }
+
+    /**
+     * Aggregate one time-sorted series at every resolution, returns bytes
+     */
+    size_t add (const tag_t& tag, const std::vector<Data>& data)
+    {
+        sstable::Block block;
+        size_t total = encode (tag, data, block);
+        writer.append (block);
+
+        return total;
+    }
+
+    /**
+     * Append a block built by encode ()
+     */
+    void append (const sstable::Block& block)
+    {
+        writer.append (block);
+    }
+
+    /**
+     * Write index + footer, close, fsync and rename into place
+     */
+    bool finish ()
+    {
+        return writer.finish ();
+    }
+};
@@ -0,0 +1,490 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <charconv>
+#include <iostream>
+#include <iterator>
+#include <filesystem>
+#include <algorithm>
+#include <shared_mutex>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
+#include "types.h"
+#include "fs_util.h"
+#include "tsdb_config.h"
+
+using namespace config;
+
+/**
+ * Series keys made of key=value labels
+ * A key is an optional bare name followed by ';'-separated labels, e.g.
+ * "cpu;host=a;site=b" or "site=b;type=temp". The canonical form puts the
+ * name first and the labels sorted by key, so one label set maps to one
+ * series whatever order it was written in. A plain tag is a name alone
+ */
+namespace labels
+{
+    using label_t = std::pair<std::string, std::string>;
+
+    // Postings key of a series name
+    static constexpr std::string_view name_label {"__name__"};
+
+    /**
+     * Split key into labels (a name becomes __name__), false if malformed:
+     * empty label, key or value, or a key given twice
+     */
+    inline bool parse (std::string_view key, std::vector<label_t>& out)
+    {
+        out.clear ();
+        if (key.empty ())
+            return false;
+
+        for (size_t pos = 0, i = 0; pos <= key.size (); ++i)
+        {
+            size_t end = std::min (key.find (';', pos), key.size ());
+            std::string_view part = key.substr (pos, end - pos);
+            pos = end + 1;
+
+            size_t eq = part.find ('=');
+            if (eq == std::string_view::npos)
+            {
+                // Only the first part may be a bare name
+                if (i > 0 || part.empty ())
+                    return false;
+
+                out.emplace_back (name_label, part);
+                continue;
+            }
+
+            if (eq == 0 || eq + 1 == part.size () || part.find ('=', eq + 1) != std::string_view::npos)
+                return false;
+
+            out.emplace_back (part.substr (0, eq), part.substr (eq + 1));
+        }
+
+        std::sort (out.begin (), out.end ());
+        for (size_t i = 1; i < out.size (); ++i)
+            if (out[i].first == out[i - 1].first)
+                return false;
+
+        return true;
+    }
+
+    /**
+     * Canonical key of a label set (sorted, as parse leaves it)
+     */
+    inline std::string format (const std::vector<label_t>& set)
+    {
+        std::string key;
+        for (const label_t& label : set)
+            if (label.first == name_label)
+                key = label.second;
+
+        for (const label_t& label : set)
+        {
+            if (label.first == name_label)
+                continue;
+
+            if (!key.empty ())
+                key += ';';
+            key += label.first;
+            key += '=';
+            key += label.second;
+        }
+
+        return key;
+    }
+
+    /**
+     * Rewrite key into canonical form, false if malformed
+     */
+    inline bool canonicalize (std::string_view key, std::string& out)
+    {
+        // Plain tags are already canonical
+        if (key.find_first_of (";=") == std::string_view::npos)
+        {
+            out.assign (key);
+            return !key.empty ();
+        }
+
+        std::vector<label_t> set;
+        if (!parse (key, set))
+            return false;
+
+        out = format (set);
+        return true;
+    }
+}
+
+/**
+ * Interned series keys plus an inverted index of their labels
+ * Every canonical key gets a dense id (1, 2, ...) on first write, and each
+ * "key=value" label maps to the ascending ids carrying it, so label
+ * queries are postings intersections. Ids are what the WAL stores per point
+ *
+ * Persisted as the SERIES file, appended and fdatasync'ed before an id is
+ * handed out: "TSDB-SERIES 1" then one "id key" line per series. Series
+ * are never dropped, so an id is stable for the life of the database
+ */
+class SeriesRegistry
+{
+private:
+    std::string path;
+    int fd {-1};
+
+    mutable std::shared_mutex mutex;
+    std::unordered_map<tag_t, series_id_t> ids;
+    std::vector<tag_t> keys;  // keys[id - 1]
+    std::unordered_map<std::string, std::vector<series_id_t>> postings;
+
+    /**
+     * Register key under the next id and index its labels, caller holds mutex
+     */
+    series_id_t insert (const tag_t& key)
+    {
+        series_id_t id = static_cast<series_id_t> (keys.size () + 1);
+        keys.push_back (key);
+        ids.emplace (key, id);
+
+        std::vector<labels::label_t> set;
+        if (!labels::parse (key, set))
+            set = {{std::string (labels::name_label), key}};
+
+        // Ids only grow, postings stay sorted by appending
+        for (const labels::label_t& label : set)
+            postings[label.first + "=" + label.second].push_back (id);
+
+        return id;
+    }
+
+    /**
+     * Append lines to the file and make them durable, caller holds mutex
+     * On failure the file is cut back to where it was, so a torn line
+     * can't hide the series after it on the next open
+     */
+    bool append (const std::string& lines)
+    {
+        if (fd < 0)
+            return path.empty ();
+
+        off_t start = ::lseek (fd, 0, SEEK_END);
+        if (start < 0)
+        {
+            perror ("Series registry seek");
+            return false;
+        }
+
+        auto rollback = [&] ()
+        {
+            if (::ftruncate (fd, start) != 0 || ::lseek (fd, start, SEEK_SET) < 0)
+                perror ("Series registry truncate");
+        };
+
+        size_t written = 0;
+        while (written < lines.size ())
+        {
+            ssize_t n = ::write (fd, lines.data () + written, lines.size () - written);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                std::cerr << "Series registry write failed at " << path << std::endl;
+                perror ("Reason");
+                rollback ();
+                return false;
+            }
+            written += static_cast<size_t> (n);
+        }
+
+        if (::fdatasync (fd) != 0)
+        {
+            std::cerr << "Series registry fsync failed at " << path << std::endl;
+            perror ("Reason");
+            rollback ();
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Ids in both ascending lists, binary searching the longer one from
+     * the last hit
+     */
+    static std::vector<series_id_t> intersect (const std::vector<series_id_t>& small,
+                                               const std::vector<series_id_t>& large)
+    {
+        std::vector<series_id_t> out;
+        auto it = large.begin ();
+        for (series_id_t id : small)
+        {
+            it = std::lower_bound (it, large.end (), id);
+            if (it == large.end ())
+                break;
+            if (*it == id)
+                out.push_back (id);
+        }
+
+        return out;
+    }
+
+public:
+    /**
+     * In-memory registry, open () attaches a file
+     */
+    SeriesRegistry () = default;
+
+    SeriesRegistry (const SeriesRegistry&) = delete;
+    SeriesRegistry& operator= (const SeriesRegistry&) = delete;
+
+    /**
+     * Load path (created if missing) and keep it open for appends
+     * A torn last line from a crash is cut off
+     */
+    bool open (const std::string& path = series_registry_path)
+    {
+        std::unique_lock lock (mutex);
+        this->path = path;
+        ids.clear ();
+        keys.clear ();
+        postings.clear ();
+
+        std::filesystem::create_directories (std::filesystem::path (path).parent_path ());
+
+        std::string buf;
+        {
+            std::ifstream in (path, std::ios::binary);
+            buf.assign (std::istreambuf_iterator<char> (in), std::istreambuf_iterator<char> ());
+        }
+
+        static const std::string header = "TSDB-SERIES 1\n";
+        size_t valid = 0;
+        if (buf.compare (0, header.size (), header) == 0)
+        {
+            valid = header.size ();
+            for (size_t pos = valid, end; (end = buf.find ('\n', pos)) != std::string::npos;
+                 pos = end + 1)
+            {
+                std::string_view line (buf.data () + pos, end - pos);
+                size_t space = line.find (' ');
+                series_id_t id = 0;
+                if (space == std::string_view::npos ||
+                    std::from_chars (line.data (), line.data () + space, id).ec != std::errc () ||
+                    id != keys.size () + 1 || space + 1 == line.size ())
+                    break;
+
+                insert (tag_t (line.substr (space + 1)));
+                valid = end + 1;
+            }
+        }
+        else if (!buf.empty ())
+        {
+            std::cerr << "Bad series registry header in " << path << std::endl;
+            return false;
+        }
+
+        fd = ::open (path.c_str (), O_WRONLY | O_CREAT, 0644);
+        if (fd < 0)
+        {
+            std::cerr << "Could not open series registry at " << path << std::endl;
+            perror ("Reason");
+            return false;
+        }
+
+        // Drop a torn tail, write the header of a new file
+        if (::ftruncate (fd, valid) != 0 || ::lseek (fd, 0, SEEK_END) < 0)
+        {
+            perror ("Series registry truncate");
+            return false;
+        }
+
+        if (valid == 0 && !append (header))
+            return false;
+
+        fsync_path (path);
+        return true;
+    }
+
+    /**
+     * Id of canonical key, registered (and persisted) if new, 0 on I/O error
+     */
+    series_id_t intern (const tag_t& key)
+    {
+        {
+            std::shared_lock lock (mutex);
+            auto it = ids.find (key);
+            if (it != ids.end ())
+                return it->second;
+        }
+
+        std::unique_lock lock (mutex);
+        auto it = ids.find (key);
+        if (it != ids.end ())
+            return it->second;
+
+        if (!append (std::to_string (keys.size () + 1) + " " + key + "\n"))
+            return 0;
+
+        return insert (key);
+    }
+
+    /**
+     * Set the series id of every point, new series are persisted with one
+     * write + fsync. Returns false (points of new series keep id 0) if
+     * that fails, the batch must not be written then
+     */
+    bool intern_batch (batch_t& batch)
+    {
+        std::vector<Point*> unknown;
+        {
+            std::shared_lock lock (mutex);
+            const Point* prev = nullptr;
+            for (Point& point : batch)
+            {
+                // Batches are usually runs of one series
+                if (prev && prev->tag == point.tag)
+                {
+                    point.series = prev->series;
+                    if (!point.series)
+                        unknown.push_back (&point);
+                    continue;
+                }
+
+                auto it = ids.find (point.tag);
+                point.series = it == ids.end () ? 0 : it->second;
+                if (!point.series)
+                    unknown.push_back (&point);
+                prev = &point;
+            }
+        }
+
+        if (unknown.empty ())
+            return true;
+
+        std::unique_lock lock (mutex);
+        std::string lines;
+        std::vector<tag_t> fresh;
+        std::unordered_set<std::string_view> seen;
+        for (Point* point : unknown)
+        {
+            if (ids.count (point->tag) || !seen.insert (point->tag).second)
+                continue;
+
+            lines += std::to_string (keys.size () + fresh.size () + 1) + " " + point->tag + "\n";
+            fresh.push_back (point->tag);
+        }
+
+        if (!lines.empty () && !append (lines))
+            return false;
+
+        for (const tag_t& key : fresh)
+            insert (key);
+
+        for (Point* point : unknown)
+            point->series = ids.at (point->tag);
+
+        return true;
+    }
+
+    /**
+     * Id of key, 0 if never written
+     */
+    series_id_t find (const tag_t& key) const
+    {
+        std::shared_lock lock (mutex);
+        auto it = ids.find (key);
+        return it == ids.end () ? 0 : it->second;
+    }
+
+    /**
+     * Key of id, empty if unknown
+     */
+    tag_t key_of (series_id_t id) const
+    {
+        std::shared_lock lock (mutex);
+        return id >= 1 && id <= keys.size () ? keys[id - 1] : tag_t ();
+    }
+
+    /**
+     * Every key, by id
+     */
+    std::vector<tag_t> get_keys () const
+    {
+        std::shared_lock lock (mutex);
+        return keys;
+    }
+
+    /**
+     * # series
+     */
+    size_t size () const
+    {
+        std::shared_lock lock (mutex);
+        return keys.size ();
+    }
+
+    /**
+     * Ascending ids of the series carrying every matcher label (AND)
+     * Lists are intersected shortest first, so cost follows the most
+     * selective label
+     */
+    std::vector<series_id_t> select (const std::vector<labels::label_t>& matchers) const
+    {
+        if (matchers.empty ())
+            return {};
+
+        std::shared_lock lock (mutex);
+        std::vector<const std::vector<series_id_t>*> lists;
+        for (const labels::label_t& label : matchers)
+        {
+            auto it = postings.find (label.first + "=" + label.second);
+            if (it == postings.end ())
+                return {};
+            lists.push_back (&it->second);
+        }
+
+        std::sort (lists.begin (), lists.end (),
+                   [] (const auto* a, const auto* b) { return a->size () < b->size (); });
+
+        std::vector<series_id_t> result = *lists.front ();
+        for (size_t i = 1; i < lists.size () && !result.empty (); ++i)
+            result = intersect (result, *lists[i]);
+
+        return result;
+    }
+
+    /**
+     * Keys of the series matching a label query like "site=a;type=temp"
+     * (a bare first part matches the name), false if malformed
+     */
+    bool select_keys (std::string_view query, std::vector<tag_t>& out) const
+    {
+        std::vector<labels::label_t> matchers;
+        if (!labels::parse (query, matchers))
+            return false;
+
+        std::vector<series_id_t> found = select (matchers);
+
+        std::shared_lock lock (mutex);
+        out.clear ();
+        for (series_id_t id : found)
+            out.push_back (keys[id - 1]);
+
+        return true;
+    }
+
+    /**
+     * Destructor, closes the file
+     */
+    ~SeriesRegistry ()
+    {
+        if (fd >= 0)
+            ::close (fd);
+    }
+};
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <cstddef>
+#include <algorithm>
+#include "types.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TSDB_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+/**
+ * Aggregation kernels over value/timestamp columns
+ * AVX2 and SSE (4.2 for the 64-bit timestamp compares) versions are picked
+ * at runtime by CPU support, scalar everywhere else. Sums are accumulated
+ * in several lanes so results may differ from a sequential sum in the last
+ * bits
+ */
+namespace simd
+{
+    /**
+     * Instruction sets, best last
+     */
+    enum class Isa
+    {
+        scalar,
+        sse,
+        avx2
+    };
+
+    /**
+     * count/sum/min/max of a run of values
+     */
+    struct Summary
+    {
+        size_t count {0};
+        double sum {0};
+        double min {std::numeric_limits<double>::infinity ()};
+        double max {-std::numeric_limits<double>::infinity ()};
+    };
+
+    /**
+     * Best Isa this CPU runs
+     */
+    inline Isa best_isa ()
+    {
+#ifdef TSDB_SIMD_X86
+        static const Isa isa = __builtin_cpu_supports ("avx2")   ? Isa::avx2
+                             : __builtin_cpu_supports ("sse4.2") ? Isa::sse
+                                                                 : Isa::scalar;
+        return isa;
+#else
+        return Isa::scalar;
+#endif
+    }
+
+    /**
+     * Isa -> name
+     */
+    inline const char* isa_name (Isa isa)
+    {
+        switch (isa)
+        {
+            case Isa::scalar: return "scalar";
+            case Isa::sse:    return "sse4.2";
+            case Isa::avx2:   return "avx2";
+        }
+
+        return "";
+    }
+
+    namespace scalar
+    {
+        inline Summary summarize (const data_t* values, size_t n)
+        {
+            Summary out;
+            out.count = n;
+            for (size_t i = 0; i < n; ++i)
+            {
+                out.sum += values[i];
+                out.min = std::min (out.min, values[i]);
+                out.max = std::max (out.max, values[i]);
+            }
+
+            return out;
+        }
+
+        inline Summary summarize_range (const time_t* ts, const data_t* values, size_t n,
+                                        time_t lo, time_t hi)
+        {
+            Summary out;
+            for (size_t i = 0; i < n; ++i)
+            {
+                if (ts[i] < lo || ts[i] > hi)
+                    continue;
+
+                ++out.count;
+                out.sum += values[i];
+                out.min = std::min (out.min, values[i]);
+                out.max = std::max (out.max, values[i]);
+            }
+
+            return out;
+        }
+    }
+
+#ifdef TSDB_SIMD_X86
+    namespace sse
+    {
+        __attribute__ ((target ("sse4.2")))
+        inline Summary summarize (const data_t* values, size_t n)
+        {
+            __m128d sum0 = _mm_setzero_pd (), sum1 = _mm_setzero_pd ();
+            __m128d min0 = _mm_set1_pd (std::numeric_limits<double>::infinity ());
+            __m128d max0 = _mm_set1_pd (-std::numeric_limits<double>::infinity ());
+            __m128d min1 = min0, max1 = max0;
+
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4)
+            {
+                __m128d a = _mm_loadu_pd (values + i);
+                __m128d b = _mm_loadu_pd (values + i + 2);
+                sum0 = _mm_add_pd (sum0, a);
+                sum1 = _mm_add_pd (sum1, b);
+                min0 = _mm_min_pd (min0, a);
+                min1 = _mm_min_pd (min1, b);
+                max0 = _mm_max_pd (max0, a);
+                max1 = _mm_max_pd (max1, b);
+            }
+
+            alignas (16) double s[2], lo[2], hi[2];
+            _mm_store_pd (s, _mm_add_pd (sum0, sum1));
+            _mm_store_pd (lo, _mm_min_pd (min0, min1));
+            _mm_store_pd (hi, _mm_max_pd (max0, max1));
+
+            Summary tail = scalar::summarize (values + i, n - i);
+            tail.count = n;
+            tail.sum += s[0] + s[1];
+            tail.min = std::min ({tail.min, lo[0], lo[1]});
+            tail.max = std::max ({tail.max, hi[0], hi[1]});
+
+            return tail;
+        }
+
+        __attribute__ ((target ("sse4.2")))
+        inline Summary summarize_range (const time_t* ts, const data_t* values, size_t n,
+                                        time_t lo, time_t hi)
+        {
+            const __m128i lo_1 = _mm_set1_epi64x (lo - 1);
+            const __m128i hi_1 = _mm_set1_epi64x (hi);
+            const __m128d inf = _mm_set1_pd (std::numeric_limits<double>::infinity ());
+            const __m128d ninf = _mm_set1_pd (-std::numeric_limits<double>::infinity ());
+            __m128d sum = _mm_setzero_pd (), mn = inf, mx = ninf;
+            size_t count = 0;
+
+            size_t i = 0;
+            for (; i + 2 <= n; i += 2)
+            {
+                __m128i t = _mm_loadu_si128 (reinterpret_cast<const __m128i*> (ts + i));
+
+                // lo <= t <= hi  as  t > lo - 1 && !(t > hi)
+                __m128i in = _mm_andnot_si128 (_mm_cmpgt_epi64 (t, hi_1),
+                                               _mm_cmpgt_epi64 (t, lo_1));
+                __m128d mask = _mm_castsi128_pd (in);
+                __m128d v = _mm_loadu_pd (values + i);
+
+                sum = _mm_add_pd (sum, _mm_and_pd (mask, v));
+                mn = _mm_min_pd (mn, _mm_blendv_pd (inf, v, mask));
+                mx = _mm_max_pd (mx, _mm_blendv_pd (ninf, v, mask));
+                count += __builtin_popcount (_mm_movemask_pd (mask));
+            }
+
+            alignas (16) double s[2], l[2], h[2];
+            _mm_store_pd (s, sum);
+            _mm_store_pd (l, mn);
+            _mm_store_pd (h, mx);
+
+            Summary tail = scalar::summarize_range (ts + i, values + i, n - i, lo, hi);
+            tail.count += count;
+            tail.sum += s[0] + s[1];
+            tail.min = std::min ({tail.min, l[0], l[1]});
+            tail.max = std::max ({tail.max, h[0], h[1]});
+
+            return tail;
+        }
+    }
+
+    namespace avx2
+    {
+        __attribute__ ((target ("avx2")))
+        inline Summary summarize (const data_t* values, size_t n)
+        {
+            __m256d sum0 = _mm256_setzero_pd (), sum1 = _mm256_setzero_pd ();
+            __m256d min0 = _mm256_set1_pd (std::numeric_limits<double>::infinity ());
+            __m256d max0 = _mm256_set1_pd (-std::numeric_limits<double>::infinity ());
+            __m256d min1 = min0, max1 = max0;
+
+            size_t i = 0;
+            for (; i + 8 <= n; i += 8)
+            {
+                __m256d a = _mm256_loadu_pd (values + i);
+                __m256d b = _mm256_loadu_pd (values + i + 4);
+                sum0 = _mm256_add_pd (sum0, a);
+                sum1 = _mm256_add_pd (sum1, b);
+                min0 = _mm256_min_pd (min0, a);
+                min1 = _mm256_min_pd (min1, b);
+                max0 = _mm256_max_pd (max0, a);
+                max1 = _mm256_max_pd (max1, b);
+            }
+
+            alignas (32) double s[4], lo[4], hi[4];
+            _mm256_store_pd (s, _mm256_add_pd (sum0, sum1));
+            _mm256_store_pd (lo, _mm256_min_pd (min0, min1));
+            _mm256_store_pd (hi, _mm256_max_pd (max0, max1));
+
+            Summary tail = scalar::summarize (values + i, n - i);
+            tail.count = n;
+            tail.sum += (s[0] + s[1]) + (s[2] + s[3]);
+            tail.min = std::min ({tail.min, lo[0], lo[1], lo[2], lo[3]});
+            tail.max = std::max ({tail.max, hi[0], hi[1], hi[2], hi[3]});
+
+            return tail;
+        }
+
+        __attribute__ ((target ("avx2")))
+        inline Summary summarize_range (const time_t* ts, const data_t* values, size_t n,
+                                        time_t lo, time_t hi)
+        {
+            const __m256i lo_1 = _mm256_set1_epi64x (lo - 1);
+            const __m256i hi_1 = _mm256_set1_epi64x (hi);
+            const __m256d inf = _mm256_set1_pd (std::numeric_limits<double>::infinity ());
+            const __m256d ninf = _mm256_set1_pd (-std::numeric_limits<double>::infinity ());
+            __m256d sum = _mm256_setzero_pd (), mn = inf, mx = ninf;
+            size_t count = 0;
+
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4)
+            {
+                __m256i t = _mm256_loadu_si256 (reinterpret_cast<const __m256i*> (ts + i));
+
+                // lo <= t <= hi  as  t > lo - 1 && !(t > hi)
+                __m256i in = _mm256_andnot_si256 (_mm256_cmpgt_epi64 (t, hi_1),
+                                                  _mm256_cmpgt_epi64 (t, lo_1));
+                __m256d mask = _mm256_castsi256_pd (in);
+                __m256d v = _mm256_loadu_pd (values + i);
+
+                sum = _mm256_add_pd (sum, _mm256_and_pd (mask, v));
+                mn = _mm256_min_pd (mn, _mm256_blendv_pd (inf, v, mask));
+                mx = _mm256_max_pd (mx, _mm256_blendv_pd (ninf, v, mask));
+                count += __builtin_popcount (_mm256_movemask_pd (mask));
+            }
+
+            alignas (32) double s[4], l[4], h[4];
+            _mm256_store_pd (s, sum);
+            _mm256_store_pd (l, mn);
+            _mm256_store_pd (h, mx);
+
+            Summary tail = scalar::summarize_range (ts + i, values + i, n - i, lo, hi);
+            tail.count += count;
+            tail.sum += (s[0] + s[1]) + (s[2] + s[3]);
+            tail.min = std::min ({tail.min, l[0], l[1], l[2], l[3]});
+            tail.max = std::max ({tail.max, h[0], h[1], h[2], h[3]});
+
+            return tail;
+        }
+    }
+#endif
+
+    /**
+     * count/sum/min/max of values[0, n)
+     */
+    inline Summary summarize (const data_t* values, size_t n, Isa isa = best_isa ())
+    {
+#ifdef TSDB_SIMD_X86
+        if (isa == Isa::avx2)
+            return avx2::summarize (values, n);
+        if (isa == Isa::sse)
+            return sse::summarize (values, n);
+#endif
+        (void) isa;
+        return scalar::summarize (values, n);
+    }
+
+    /**
+     * count/sum/min/max of the values whose timestamp is in [lo, hi],
+     * ts need not be sorted (a timestamp of exactly time_t min never matches)
+     */
+    inline Summary summarize_range (const time_t* ts, const data_t* values, size_t n,
+                                    time_t lo, time_t hi, Isa isa = best_isa ())
+    {
+        lo = std::max (lo, std::numeric_limits<time_t>::min () + 1);
+
+#ifdef TSDB_SIMD_X86
+        if (isa == Isa::avx2)
+            return avx2::summarize_range (ts, values, n, lo, hi);
+        if (isa == Isa::sse)
+            return sse::summarize_range (ts, values, n, lo, hi);
+#endif
+        (void) isa;
+        return scalar::summarize_range (ts, values, n, lo, hi);
+    }
+}
@@ -0,0 +1,1133 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <shared_mutex>
+#include <mutex>
+#include <filesystem>
+#include <regex>
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <thread>
+#include "types.h"
+#include "bit_buffer.h"
+#include "gorilla.h"
+#include "chunk_codec.h"
+#include "bloom_filter.h"
+#include "block_cache.h"
+#include "fs_util.h"
+#include "mmap_file.h"
+#include "tsdb_config.h"
+
+using namespace config;
+
+/**
+ * SSTable layout
+ * [data chunks][index block][bloom block][footer]
+ * Chunk:       independently decodable block of up to sstable_chunk_points
+ *              points of one series, codec u8 + payload (see chunk_codec.h)
+ * Index block: count u64, per series (tag order):
+ *              shared u16, suffix_len u16, suffix, chunk_count u64,
+ *              per chunk (time order):
+ *              offset u64, size u64, count u64, min_ts i64, max_ts i64
+ *              The tag is the first shared bytes of the previous tag plus
+ *              suffix (label keys share long prefixes)
+ * Bloom block: filter over the tags, see BloomFilter
+ * Footer:      bloom_offset u64, bloom_size u64, min_ts i64, max_ts i64,
+ *              index_offset u64, index_size u64, version u32, magic u32
+ *
+ * Version 5 chunks are bare gorilla::format_v2 streams, version 4 and
+ * older ones gorilla::format_v1 streams.
+ * Version 3 index entries start with the whole tag as tag_len u64, tag.
+ * Version 2 footers stop at index_offset (no bloom block or time bounds).
+ * Version 1 files hold one chunk per series with no chunk_count.
+ * Files without the footer magic are the original layout of
+ * [tag_len][tag][num_pts][comp_size][gorilla] blocks and get indexed by a scan
+ */
+namespace sstable
+{
+    static constexpr uint32_t magic         {0x54535354}; // "TSST"
+    static constexpr uint32_t version       {6};
+
+    // Trailing index_offset..magic, shared by every version
+    static constexpr size_t footer_size     {24};
+
+    // Bloom + time bounds ahead of it, version 3+
+    static constexpr size_t footer_ext_size {32};
+
+    /**
+     * Where one chunk lives in the file, and its time bounds
+     */
+    struct ChunkEntry
+    {
+        uint64_t offset {0};
+        uint64_t size {0};
+        uint64_t count {0};
+        time_t min_ts {std::numeric_limits<time_t>::min ()};
+        time_t max_ts {std::numeric_limits<time_t>::max ()};
+    };
+
+    /**
+     * One series: totals plus its chunks in time order
+     */
+    struct IndexEntry
+    {
+        uint64_t count {0};
+        time_t min_ts {std::numeric_limits<time_t>::max ()};
+        time_t max_ts {std::numeric_limits<time_t>::min ()};
+        std::vector<ChunkEntry> chunks;
+
+        /**
+         * Append the next chunk in time order and widen the totals
+         */
+        void add_chunk (const ChunkEntry& chunk)
+        {
+            chunks.push_back (chunk);
+            count += chunk.count;
+            min_ts = std::min (min_ts, chunk.min_ts);
+            max_ts = std::max (max_ts, chunk.max_ts);
+        }
+    };
+
+    using index_t = std::map<tag_t, IndexEntry>;
+
+    template <typename T>
+    void put (std::string& buf, const T& val)
+    {
+        buf.append (reinterpret_cast<const char*> (&val), sizeof (T));
+    }
+
+    /**
+     * Read val at pos of a mapped span and advance, false if out of bounds
+     */
+    template <typename T>
+    bool get (const byte_t* data, size_t size, size_t& pos, T& val)
+    {
+        if (size < sizeof (T) || pos > size - sizeof (T))
+            return false;
+
+        std::memcpy (&val, data + pos, sizeof (T));
+        pos += sizeof (T);
+        return true;
+    }
+
+    /**
+     * Read one chunk entry, bounded by the start of the index
+     */
+    inline bool get_chunk (const byte_t* data, size_t size, size_t& pos,
+                           uint64_t data_end, ChunkEntry& chunk)
+    {
+        return get (data, size, pos, chunk.offset) &&
+               get (data, size, pos, chunk.size) &&
+               get (data, size, pos, chunk.count) &&
+               get (data, size, pos, chunk.min_ts) &&
+               get (data, size, pos, chunk.max_ts) &&
+               chunk.offset + chunk.size <= data_end;
+    }
+
+    /**
+     * Keep the points of an ascending series inside range
+     */
+    inline void trim (std::vector<Data>& points, const TimeRange& range)
+    {
+        auto first = std::lower_bound (points.begin (), points.end (), range.start,
+                                       [] (const Data& d, time_t t) { return d.time_ms < t; });
+        auto last = std::upper_bound (first, points.end (), range.end,
+                                      [] (time_t t, const Data& d) { return t < d.time_ms; });
+        points.erase (last, points.end ());
+        points.erase (points.begin (), first);
+    }
+
+    /**
+     * Encoded chunks of one or more series, offsets relative to the block
+     * Built off the writer (e.g. on flush workers) and appended whole with
+     * SSTableWriter::append
+     */
+    class Block
+    {
+    private:
+        std::vector<byte_t> bytes;
+        std::vector<std::pair<tag_t, ChunkEntry>> chunks;
+        size_t chunk_points;
+
+        /**
+         * Append one encoded chunk, returns its size
+         */
+        size_t add_chunk (const tag_t& tag, const std::vector<byte_t>& chunk,
+                          size_t count, time_t min_ts, time_t max_ts)
+        {
+            chunks.emplace_back (tag, ChunkEntry {bytes.size (), chunk.size (), count, min_ts, max_ts});
+            bytes.insert (bytes.end (), chunk.begin (), chunk.end ());
+
+            return chunk.size ();
+        }
+
+    public:
+        /**
+         * chunk_points: points per chunk of add ()
+         */
+        Block (size_t chunk_points = sstable_chunk_points)
+            : chunk_points (std::max<size_t> (chunk_points, 1)) {}
+
+        /**
+         * Encode and append one time-sorted series, returns compressed bytes
+         */
+        size_t add (const tag_t& tag, const std::vector<Data>& data)
+        {
+            size_t total = 0;
+            for (size_t first = 0; first < data.size (); first += chunk_points)
+            {
+                size_t n = std::min (chunk_points, data.size () - first);
+                const Data* chunk = data.data () + first;
+
+                // Each chunk restarts the stream with a verbatim first point
+                total += add_chunk (tag, sstable_choose_codec ? codec::encode_best (chunk, n)
+                                                              : codec::encode (codec::Codec::gorilla,
+                                                                               chunk, n),
+                                    n, chunk[0].time_ms, chunk[n - 1].time_ms);
+            }
+
+            return total;
+        }
+
+        /**
+         * Append one already encoded gorilla stream (gorilla::format) of
+         * tag, chunks of a tag must come in time order. Kept as is unless
+         * another codec is smaller on its first sstable_codec_probe_points
+         * (sstable_choose_codec), then the smallest over the whole chunk.
+         * Returns the chunk size
+         */
+        size_t add_encoded (const tag_t& tag, const byte_t* data, size_t size,
+                            size_t count, time_t min_ts, time_t max_ts)
+        {
+            if (count == 0)
+                return 0;
+
+            std::vector<byte_t> chunk;
+            bool reencode = false;
+            std::vector<Data> points;
+            GorillaDecoder decoder (data, size, count);
+            if (sstable_choose_codec)
+            {
+                size_t probe = std::min (count, std::max<size_t> (sstable_codec_probe_points, 1));
+                points.reserve (probe);
+
+                Data point;
+                while (points.size () < probe && decoder.next (point))
+                    points.push_back (point);
+
+                std::vector<byte_t> sample = codec::encode_best (points.data (), points.size ());
+                reencode = points.size () == count ||
+                           codec::codec_of (sample.data (), sample.size ()) != codec::Codec::gorilla;
+            }
+
+            if (reencode)
+            {
+                Data point;
+                points.reserve (count);
+                while (decoder.next (point))
+                    points.push_back (point);
+
+                chunk = codec::encode_best (points.data (), points.size (), data, size);
+            }
+            else
+            {
+                chunk.reserve (size + 1);
+                chunk.push_back (static_cast<byte_t> (codec::Codec::gorilla));
+                chunk.insert (chunk.end (), data, data + size);
+            }
+
+            return add_chunk (tag, chunk, count, min_ts, max_ts);
+        }
+
+        /**
+         * Encoded bytes held
+         */
+        size_t size () const
+        {
+            return bytes.size ();
+        }
+
+        /**
+         * bytes getter
+         */
+        const std::vector<byte_t>& get_bytes () const
+        {
+            return bytes;
+        }
+
+        /**
+         * Chunks in append order, offsets relative to the block
+         */
+        const std::vector<std::pair<tag_t, ChunkEntry>>& get_chunks () const
+        {
+            return chunks;
+        }
+    };
+}
+
+/**
+ * Writes series in tag order as fixed-size chunks, then the index and footer
+ * The file is built as path.tmp and renamed over path by finish (), so path
+ * only ever holds a complete SSTable
+ */
+class SSTableWriter
+{
+private:
+    std::string path;
+    std::string tmp_path;
+    std::ofstream out;
+    uint64_t offset {0};
+    size_t chunk_points;
+    sstable::index_t index;
+    bool finished {false};
+
+public:
+    /**
+     * Open path.tmp for writing, truncates
+     */
+    SSTableWriter (const std::string& path, size_t chunk_points = sstable_chunk_points)
+        : path (path), tmp_path (path + ".tmp"), out (tmp_path, std::ios::binary | std::ios::trunc),
+          chunk_points (std::max<size_t> (chunk_points, 1))
+    {
+        if (!out.is_open ())
+            std::cerr << "Could not open SSTable at " << tmp_path << std::endl;
+    }
+
+    /**
+     * Drop path.tmp of a write that never finished
+     */
+    ~SSTableWriter ()
+    {
+        if (finished)
+            return;
+
+        out.close ();
+        std::error_code ec;
+        std::filesystem::remove (tmp_path, ec);
+    }
+
+    /**
+     * Encode and append one time-sorted series, returns compressed bytes
+     */
+    size_t add (const tag_t& tag, const std::vector<Data>& data)
+    {
+        if (data.empty ())
+            return 0;
+
+        sstable::Block block (chunk_points);
+        size_t total = block.add (tag, data);
+        append (block);
+
+        return total;
+    }
+
+    /**
+     * Append one already encoded gorilla stream of tag, see
+     * sstable::Block::add_encoded
+     */
+    size_t add_encoded (const tag_t& tag, const byte_t* data, size_t size,
+                        size_t count, time_t min_ts, time_t max_ts)
+    {
+        sstable::Block block (chunk_points);
+        size_t total = block.add_encoded (tag, data, size, count, min_ts, max_ts);
+        append (block);
+
+        return total;
+    }
+
+    /**
+     * Append an encoded block in one write, chunks of a tag must come in
+     * time order across blocks
+     */
+    void append (const sstable::Block& block)
+    {
+        out.write (reinterpret_cast<const char*> (block.get_bytes ().data ()), block.size ());
+        for (const auto& [tag, chunk] : block.get_chunks ())
+        {
+            sstable::ChunkEntry entry = chunk;
+            entry.offset += offset;
+            index[tag].add_chunk (entry);
+        }
+
+        offset += block.size ();
+    }
+
+    /**
+     * Write index + footer, close, fsync and rename into place
+     * Returns false if any step failed, path is then left as it was
+     */
+    bool finish ()
+    {
+        std::string block;
+        sstable::put (block, static_cast<uint64_t> (index.size ()));
+        const tag_t* prev = nullptr;
+        for (const auto& [tag, entry] : index)
+        {
+            // Tags are capped at max_tag_bytes by the line protocol
+            size_t shared = 0;
+            if (prev)
+                shared = std::mismatch (prev->begin (), prev->end (),
+                                        tag.begin (), tag.end ()).first - prev->begin ();
+            shared = std::min<size_t> (shared, UINT16_MAX);
+            size_t suffix_len = std::min<size_t> (tag.size () - shared, UINT16_MAX);
+            prev = &tag;
+
+            sstable::put (block, static_cast<uint16_t> (shared));
+            sstable::put (block, static_cast<uint16_t> (suffix_len));
+            block.append (tag, shared, suffix_len);
+            sstable::put (block, static_cast<uint64_t> (entry.chunks.size ()));
+
+            for (const sstable::ChunkEntry& chunk : entry.chunks)
+            {
+                sstable::put (block, chunk.offset);
+                sstable::put (block, chunk.size);
+                sstable::put (block, chunk.count);
+                sstable::put (block, chunk.min_ts);
+                sstable::put (block, chunk.max_ts);
+            }
+        }
+
+        uint64_t index_size = block.size ();
+
+        BloomFilter bloom (index.size ());
+        time_t min_ts = std::numeric_limits<time_t>::max ();
+        time_t max_ts = std::numeric_limits<time_t>::min ();
+        for (const auto& [tag, entry] : index)
+        {
+            bloom.add (tag);
+            min_ts = std::min (min_ts, entry.min_ts);
+            max_ts = std::max (max_ts, entry.max_ts);
+        }
+
+        uint64_t bloom_offset = offset + index_size;
+        bloom.serialize (block);
+        uint64_t bloom_size = block.size () - index_size;
+
+        sstable::put (block, bloom_offset);
+        sstable::put (block, bloom_size);
+        sstable::put (block, min_ts);
+        sstable::put (block, max_ts);
+        sstable::put (block, offset);
+        sstable::put (block, index_size);
+        sstable::put (block, sstable::version);
+        sstable::put (block, sstable::magic);
+
+        out.write (block.data (), block.size ());
+        out.close ();
+        if (out.fail () || !fsync_path (tmp_path))
+        {
+            std::cerr << "Could not write SSTable at " << tmp_path << std::endl;
+            return false;
+        }
+
+        std::error_code ec;
+        std::filesystem::rename (tmp_path, path, ec);
+        if (ec)
+        {
+            std::cerr << "Could not rename " << tmp_path << " to " << path << ": "
+                      << ec.message () << std::endl;
+            return false;
+        }
+
+        // Renamed but maybe not durable, take it back
+        if (!fsync_path (path))
+        {
+            std::filesystem::remove (path, ec);
+            return false;
+        }
+
+        finished = true;
+        return true;
+    }
+};
+
+/**
+ * Read side of one immutable SSTable
+ * The file stays mapped for the reader's lifetime. Opening reads only the
+ * footer and Bloom filter, the index is parsed on the first lookup the
+ * filter lets through, queries decode straight out of the mapping
+ */
+class SSTableReader
+{
+private:
+    std::string path;
+    size_t id;
+    BlockCache::Kind kind;
+    MappedFile file;
+    BloomFilter bloom;
+    time_t min_ts {std::numeric_limits<time_t>::max ()};
+    time_t max_ts {std::numeric_limits<time_t>::min ()};
+
+    // Footer fields, valid when has_footer
+    bool has_footer {false};
+    uint64_t index_offset {0};
+    uint32_t file_version {0};
+
+    // Parsed on demand
+    mutable sstable::index_t index;
+    mutable std::once_flag index_once;
+
+    /**
+     * Parse the footer (and bloom block + time bounds from version 3),
+     * false if the file has no footer
+     */
+    bool load_footer ()
+    {
+        const byte_t* data = file.get_data ();
+        size_t size = file.get_size ();
+        if (size < sstable::footer_size)
+            return false;
+
+        size_t pos = size - sstable::footer_size;
+        uint64_t index_size;
+        uint32_t file_magic;
+        if (!sstable::get (data, size, pos, index_offset) ||
+            !sstable::get (data, size, pos, index_size) ||
+            !sstable::get (data, size, pos, file_version) ||
+            !sstable::get (data, size, pos, file_magic))
+            return false;
+
+        if (file_magic != sstable::magic || file_version < 1 ||
+            file_version > sstable::version)
+            return false;
+
+        if (file_version < 3)
+            return true;
+
+        if (size < sstable::footer_size + sstable::footer_ext_size)
+            return false;
+
+        pos = size - sstable::footer_size - sstable::footer_ext_size;
+        uint64_t bloom_offset, bloom_size;
+        if (!sstable::get (data, size, pos, bloom_offset) ||
+            !sstable::get (data, size, pos, bloom_size) ||
+            !sstable::get (data, size, pos, min_ts) ||
+            !sstable::get (data, size, pos, max_ts) ||
+            bloom_offset + bloom_size > size)
+            return false;
+
+        // A bad filter only costs skipping, it matches everything
+        if (!bloom.deserialize (data + bloom_offset, bloom_size))
+            std::cerr << "Bad Bloom filter in " << path << std::endl;
+
+        return true;
+    }
+
+    /**
+     * Parse the index block, false if malformed
+     */
+    bool parse_index () const
+    {
+        const byte_t* data = file.get_data ();
+        size_t size = file.get_size ();
+
+        size_t pos = index_offset;
+        uint64_t count;
+        if (!sstable::get (data, size, pos, count))
+            return false;
+
+        tag_t prev;
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            tag_t tag;
+            if (file_version >= 4)
+            {
+                uint16_t shared, suffix_len;
+                if (!sstable::get (data, size, pos, shared) ||
+                    !sstable::get (data, size, pos, suffix_len) ||
+                    shared > prev.size () || pos + suffix_len > size)
+                    return false;
+
+                tag.assign (prev, 0, shared);
+                tag.append (reinterpret_cast<const char*> (data + pos), suffix_len);
+                pos += suffix_len;
+                prev = tag;
+            }
+            else
+            {
+                uint64_t tag_len;
+                if (!sstable::get (data, size, pos, tag_len) || tag_len > 1024 ||
+                    pos + tag_len > size)
+                    return false;
+
+                tag.assign (reinterpret_cast<const char*> (data + pos), tag_len);
+                pos += tag_len;
+            }
+
+            // Version 1 has exactly one chunk per series
+            uint64_t chunk_count = 1;
+            if (file_version >= 2 && !sstable::get (data, size, pos, chunk_count))
+                return false;
+
+            sstable::IndexEntry entry;
+            for (uint64_t c = 0; c < chunk_count; ++c)
+            {
+                sstable::ChunkEntry chunk;
+                if (!sstable::get_chunk (data, size, pos, index_offset, chunk))
+                    return false;
+
+                entry.add_chunk (chunk);
+            }
+
+            index.emplace (std::move (tag), std::move (entry));
+        }
+
+        return true;
+    }
+
+    /**
+     * Build index by walking original-layout blocks, time bounds unknown
+     */
+    void scan_legacy () const
+    {
+        const byte_t* data = file.get_data ();
+        size_t size = file.get_size ();
+        size_t pos = 0;
+
+        while (pos < size)
+        {
+            size_t tag_len, num_pts, comp_size;
+            if (!sstable::get (data, size, pos, tag_len) || tag_len > 1024 ||
+                pos + tag_len > size)
+                break;
+
+            tag_t tag (reinterpret_cast<const char*> (data + pos), tag_len);
+            pos += tag_len;
+            if (!sstable::get (data, size, pos, num_pts) ||
+                !sstable::get (data, size, pos, comp_size) || pos + comp_size > size)
+                break;
+
+            sstable::IndexEntry entry;
+            sstable::ChunkEntry chunk;
+            chunk.offset = pos;
+            chunk.size = comp_size;
+            chunk.count = num_pts;
+            entry.add_chunk (chunk);
+            index.emplace (std::move (tag), std::move (entry));
+
+            pos += comp_size;
+        }
+    }
+
+    /**
+     * Parse the index once, falling back to a legacy scan
+     */
+    const sstable::index_t& ensure_index () const
+    {
+        std::call_once (index_once, [this] ()
+        {
+            if (!has_footer || !parse_index ())
+            {
+                index.clear ();
+                scan_legacy ();
+            }
+        });
+
+        return index;
+    }
+
+public:
+    /**
+     * Map path and load its footer + Bloom filter
+     * Files older than version 3 carry neither, their index is loaded now
+     * for the time bounds
+     * kind: keeps a rollup's cached chunks apart from its table's
+     */
+    SSTableReader (const std::string& path, size_t id,
+                   BlockCache::Kind kind = BlockCache::Kind::table)
+        : path (path), id (id), kind (kind), file (path)
+    {
+        has_footer = load_footer ();
+        if (has_footer && file_version >= 3)
+            return;
+
+        for (const auto& [tag, entry] : ensure_index ())
+        {
+            min_ts = std::min (min_ts, entry.min_ts);
+            max_ts = std::max (max_ts, entry.max_ts);
+        }
+    }
+
+    /**
+     * id getter
+     */
+    size_t get_id () const
+    {
+        return id;
+    }
+
+    /**
+     * path getter
+     */
+    const std::string& get_path () const
+    {
+        return path;
+    }
+
+    /**
+     * index getter
+     */
+    const sstable::index_t& get_index () const
+    {
+        return ensure_index ();
+    }
+
+    /**
+     * False if the file definitely has no series tag
+     */
+    bool may_contain (const tag_t& tag) const
+    {
+        return bloom.may_contain (tag);
+    }
+
+    /**
+     * Earliest timestamp in the file
+     */
+    time_t get_min_ts () const
+    {
+        return min_ts;
+    }
+
+    /**
+     * Latest timestamp in the file
+     */
+    time_t get_max_ts () const
+    {
+        return max_ts;
+    }
+
+    /**
+     * Whether any series in the file can fall inside range
+     */
+    bool overlaps (const TimeRange& range) const
+    {
+        return min_ts <= max_ts && range.overlaps (min_ts, max_ts);
+    }
+
+    /**
+     * Chunks of tag overlapping range, in time order
+     */
+    std::vector<const sstable::ChunkEntry*> find_chunks (const tag_t& tag,
+                                                         const TimeRange& range) const
+    {
+        if (!may_contain (tag))
+            return {};
+
+        const sstable::index_t& index = ensure_index ();
+        auto it = index.find (tag);
+        if (it == index.end () || !range.overlaps (it->second.min_ts, it->second.max_ts))
+            return {};
+
+        // Chunks are time ordered, skip straight to the first one ending in range
+        const std::vector<sstable::ChunkEntry>& chunks = it->second.chunks;
+        auto first = std::lower_bound (chunks.begin (), chunks.end (), range.start,
+                                       [] (const sstable::ChunkEntry& c, time_t t)
+                                       { return c.max_ts < t; });
+
+        std::vector<const sstable::ChunkEntry*> result;
+        for (auto chunk = first; chunk != chunks.end () && chunk->min_ts <= range.end; ++chunk)
+            result.push_back (&*chunk);
+
+        return result;
+    }
+
+    /**
+     * Chunk format of this file, codec::format_blocks or the gorilla
+     * stream format of older files
+     */
+    uint8_t codec () const
+    {
+        if (!has_footer || file_version < 5)
+            return gorilla::format_v1;
+
+        return file_version == 5 ? gorilla::format_v2 : codec::format_blocks;
+    }
+
+    /**
+     * Compressed bytes of one chunk, valid while this reader lives
+     */
+    const byte_t* chunk_bytes (const sstable::ChunkEntry& chunk) const
+    {
+        return file.get_data () + chunk.offset;
+    }
+
+    /**
+     * Decode one chunk into columns straight from the mapping
+     */
+    Columns decode_chunk_columns (const sstable::ChunkEntry& chunk) const
+    {
+        Columns columns;
+        if (!codec::decode_columns (codec (), file.get_data () + chunk.offset, chunk.size,
+                                    chunk.count, columns))
+            std::cerr << "Bad chunk at " << chunk.offset << " in " << path << std::endl;
+
+        return columns;
+    }
+
+    /**
+     * Decode one chunk into columns, through cache when given
+     */
+    BlockCache::block_t load_chunk (const sstable::ChunkEntry& chunk, BlockCache* cache) const
+    {
+        if (!cache)
+            return std::make_shared<const Columns> (decode_chunk_columns (chunk));
+
+        BlockCache::Key key {id, chunk.offset, kind};
+        BlockCache::block_t block = cache->get (key);
+        if (!block)
+        {
+            block = std::make_shared<const Columns> (decode_chunk_columns (chunk));
+            cache->put (key, block);
+        }
+
+        return block;
+    }
+
+    /**
+     * Call fn (ts, values, n) on the columns of tag inside range one chunk
+     * at a time, ascending, without assembling the series
+     */
+    template <typename Fn>
+    void visit (const tag_t& tag, const TimeRange& range, BlockCache* cache, Fn&& fn) const
+    {
+        for (const sstable::ChunkEntry* chunk : find_chunks (tag, range))
+        {
+            BlockCache::block_t block = load_chunk (*chunk, cache);
+            const time_t* ts = block->ts.data ();
+            const time_t* first = std::lower_bound (ts, ts + block->size (), range.start);
+            const time_t* last = std::upper_bound (first, ts + block->size (), range.end);
+
+            if (last > first)
+                fn (first, block->values.data () + (first - ts), size_t (last - first));
+        }
+    }
+
+    /**
+     * Points of tag inside range, ascending by time
+     * Only overlapping chunks are decoded, in parallel when there are many
+     * cache: decoded chunk cache, null to bypass (e.g. compaction)
+     */
+    std::vector<Data> read (const tag_t& tag, const TimeRange& range = {},
+                            BlockCache* cache = nullptr) const
+    {
+        std::vector<const sstable::ChunkEntry*> chunks = find_chunks (tag, range);
+        if (chunks.empty ())
+            return {};
+
+        std::vector<BlockCache::block_t> decoded (chunks.size ());
+        size_t workers = std::min<size_t> (std::thread::hardware_concurrency (),
+                                           chunks.size () / sstable_parallel_decode_chunks);
+
+        if (workers > 1)
+        {
+            std::vector<std::future<void>> tasks;
+            for (size_t w = 0; w < workers; ++w)
+                tasks.push_back (std::async (std::launch::async, [&, w] ()
+                {
+                    for (size_t i = w; i < chunks.size (); i += workers)
+                        decoded[i] = load_chunk (*chunks[i], cache);
+                }));
+
+            for (auto& task : tasks)
+                task.get ();
+        }
+        else
+        {
+            for (size_t i = 0; i < chunks.size (); ++i)
+                decoded[i] = load_chunk (*chunks[i], cache);
+        }
+
+        size_t total = 0;
+        for (const BlockCache::block_t& part : decoded)
+            total += part->size ();
+
+        std::vector<Data> points;
+        points.reserve (total);
+        for (const BlockCache::block_t& part : decoded)
+            for (size_t i = 0; i < part->size (); ++i)
+                points.push_back (part->at (i));
+
+        sstable::trim (points, range);
+        return points;
+    }
+};
+
+/**
+ * Live SSTables ordered by id (oldest first), readers shared with queries
+ * The MANIFEST file in dir is the authority on which files are live and at
+ * which level (0 = flushed, 1 = compacted time partition); it is rewritten
+ * atomically (tmp + fsync + rename) on every change
+ */
+class SSTableSet
+{
+public:
+    /**
+     * Live table, its level and its rollup side file (null if none)
+     */
+    struct Entry
+    {
+        std::shared_ptr<const SSTableReader> table;
+        int level {0};
+        std::shared_ptr<const SSTableReader> rollup;
+    };
+
+private:
+    std::string dir {sstable_dir};
+    std::vector<Entry> tables;
+    mutable std::shared_mutex mutex;
+
+    // Serializes manifest writers (flush, compaction)
+    std::mutex manifest_mutex;
+
+    /**
+     * Path of the manifest
+     */
+    std::string manifest_path () const
+    {
+        return dir + "MANIFEST";
+    }
+
+    /**
+     * Persist entries as the live set, caller holds manifest_mutex
+     * Returns false if it failed, the old MANIFEST is then left in place
+     */
+    bool write_manifest (const std::vector<Entry>& entries) const
+    {
+        std::string tmp = manifest_path () + ".tmp";
+        std::error_code ec;
+        {
+            std::ofstream out (tmp, std::ios::trunc);
+            out << "TSDB-MANIFEST 1\n";
+            for (const Entry& entry : entries)
+                out << entry.table->get_id () << " " << entry.level << "\n";
+
+            out.close ();
+            if (out.fail ())
+            {
+                std::cerr << "Could not write " << tmp << std::endl;
+                std::filesystem::remove (tmp, ec);
+                return false;
+            }
+        }
+
+        if (!fsync_path (tmp))
+        {
+            std::filesystem::remove (tmp, ec);
+            return false;
+        }
+
+        std::filesystem::rename (tmp, manifest_path (), ec);
+        if (ec)
+        {
+            std::cerr << "Could not rename " << tmp << ": " << ec.message () << std::endl;
+            std::filesystem::remove (tmp, ec);
+            return false;
+        }
+
+        return fsync_path (manifest_path ());
+    }
+
+    /**
+     * Open the rollup_<id>.db next to entry's table if there is one
+     */
+    void attach_rollup (Entry& entry) const
+    {
+        size_t id = entry.table->get_id ();
+        if (!entry.rollup && std::filesystem::exists (rollup_path_for (id)))
+            entry.rollup = std::make_shared<const SSTableReader> (rollup_path_for (id), id,
+                                                                  BlockCache::Kind::rollup);
+    }
+
+    /**
+     * Sort by id, oldest first
+     */
+    static void sort_entries (std::vector<Entry>& entries)
+    {
+        std::sort (entries.begin (), entries.end (),
+                   [] (const Entry& a, const Entry& b)
+                   { return a.table->get_id () < b.table->get_id (); });
+    }
+
+public:
+    /**
+     * Path of table id in this set's directory
+     */
+    std::string path_for (size_t id) const
+    {
+        return dir + "sstable_" + std::to_string (id) + ".db";
+    }
+
+    /**
+     * Path of table id's rollups, see rollup::path_for
+     */
+    std::string rollup_path_for (size_t id) const
+    {
+        return dir + "rollup_" + std::to_string (id) + ".db";
+    }
+
+    /**
+     * Open the live tables of dir
+     * With a manifest, files it doesn't list are leftovers of an interrupted
+     * flush/compaction and are deleted. Without one, every file is level 0
+     */
+    void load_dir (const std::string& dir = sstable_dir)
+    {
+        std::lock_guard<std::mutex> guard (manifest_mutex);
+        this->dir = dir;
+        std::filesystem::create_directories (dir);
+
+        std::map<size_t, int> listed;
+        bool has_manifest = false;
+        {
+            std::ifstream in (manifest_path ());
+            std::string header;
+            if (in && std::getline (in, header) && header == "TSDB-MANIFEST 1")
+            {
+                has_manifest = true;
+                size_t id;
+                int level;
+                while (in >> id >> level)
+                    listed[id] = level;
+            }
+        }
+
+        std::regex re ("sstable_(\\d+)\\.db");
+        std::regex rollup_re ("rollup_(\\d+)\\.db");
+        std::regex tmp_re ("(sstable|rollup)_\\d+\\.db\\.tmp");
+        std::smatch match;
+        std::vector<Entry> loaded;
+        std::vector<std::pair<size_t, std::filesystem::path>> rollup_files;
+
+        for (const auto& entry : std::filesystem::directory_iterator (dir))
+        {
+            std::string filename = entry.path ().filename ().string ();
+
+            // Writes cut short by a crash, never renamed into place
+            if (std::regex_match (filename, tmp_re))
+            {
+                std::filesystem::remove (entry.path ());
+                continue;
+            }
+
+            if (std::regex_match (filename, match, rollup_re))
+                rollup_files.push_back ({std::stoull (match[1]), entry.path ()});
+
+            if (!std::regex_match (filename, match, re))
+                continue;
+
+            size_t id = std::stoull (match[1]);
+            auto it = listed.find (id);
+
+            if (has_manifest && it == listed.end ())
+            {
+                if (debug)
+                    std::cout << "Removing unlisted SSTable " << filename << std::endl;
+                std::filesystem::remove (entry.path ());
+                continue;
+            }
+
+            int level = it == listed.end () ? 0 : it->second;
+            loaded.push_back (Entry {std::make_shared<const SSTableReader>
+                                     (entry.path ().string (), id), level, nullptr});
+        }
+
+        // Rollups of tables that are gone
+        std::set<size_t> live;
+        for (Entry& entry : loaded)
+        {
+            attach_rollup (entry);
+            live.insert (entry.table->get_id ());
+        }
+
+        for (const auto& [id, path] : rollup_files)
+            if (live.count (id) == 0)
+                std::filesystem::remove (path);
+
+        sort_entries (loaded);
+        write_manifest (loaded);
+
+        std::unique_lock lock (mutex);
+        tables = std::move (loaded);
+    }
+
+    /**
+     * Add a freshly written table
+     * Returns false if the MANIFEST could not be written, the set is then
+     * unchanged
+     */
+    bool add (std::shared_ptr<const SSTableReader> table, int level = 0)
+    {
+        std::lock_guard<std::mutex> guard (manifest_mutex);
+
+        std::vector<Entry> next = entries ();
+        next.push_back (Entry {std::move (table), level, nullptr});
+        attach_rollup (next.back ());
+        sort_entries (next);
+        if (!write_manifest (next))
+            return false;
+
+        std::unique_lock lock (mutex);
+        tables = std::move (next);
+        return true;
+    }
+
+    /**
+     * Atomically swap removed ids for added tables (e.g. compaction)
+     * Removed files are not deleted here, open readers keep them mapped
+     * Returns false if the MANIFEST could not be written, the set is then
+     * unchanged
+     */
+    bool replace (const std::set<size_t>& removed, const std::vector<Entry>& added)
+    {
+        std::lock_guard<std::mutex> guard (manifest_mutex);
+
+        std::vector<Entry> next;
+        for (const Entry& entry : entries ())
+            if (removed.count (entry.table->get_id ()) == 0)
+                next.push_back (entry);
+
+        for (Entry entry : added)
+        {
+            attach_rollup (entry);
+            next.push_back (std::move (entry));
+        }
+        sort_entries (next);
+        if (!write_manifest (next))
+            return false;
+
+        std::unique_lock lock (mutex);
+        tables = std::move (next);
+        return true;
+    }
+
+    /**
+     * Current tables with levels
+     */
+    std::vector<Entry> entries () const
+    {
+        std::shared_lock lock (mutex);
+        return tables;
+    }
+
+    /**
+     * Current tables, stays valid while the caller holds it
+     */
+    std::vector<std::shared_ptr<const SSTableReader>> snapshot () const
+    {
+        std::shared_lock lock (mutex);
+
+        std::vector<std::shared_ptr<const SSTableReader>> result;
+        result.reserve (tables.size ());
+        for (const Entry& entry : tables)
+            result.push_back (entry.table);
+
+        return result;
+    }
+};
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <set>
+#include <regex>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <shared_mutex>
+#include <string_view>
+#include "types.h"
+#include "fs_util.h"
+#include "tsdb_config.h"
+
+using namespace config;
+
+/**
+ * Every series tag the database holds, flushed or in memory, kept sorted
+ * so prefix and glob lookups walk only the matching range
+ * Persisted as the TAGS file next to the MANIFEST ("TSDB-TAGS 1" then one
+ * tag per line), so startup doesn't have to parse every SSTable index.
+ * Tags are never dropped (compaction keeps every series)
+ */
+class TagIndex
+{
+private:
+    std::set<tag_t, std::less<>> tags;
+    mutable std::shared_mutex mutex;
+    bool dirty {false};
+    std::mutex save_mutex;
+
+    /**
+     * Literal part of pattern before its first wildcard
+     */
+    static std::string_view literal_prefix (std::string_view pattern)
+    {
+        return pattern.substr (0, std::min (pattern.find_first_of ("*?"), pattern.size ()));
+    }
+
+public:
+    /**
+     * Whether text matches glob pattern, '*' any run, '?' any one char
+     */
+    static bool glob_match (std::string_view pattern, std::string_view text)
+    {
+        // Greedy with backtracking to the last '*'
+        size_t p = 0, t = 0;
+        size_t star = std::string_view::npos, star_t = 0;
+
+        while (t < text.size ())
+        {
+            if (p < pattern.size () && (pattern[p] == '?' || pattern[p] == text[t]))
+            {
+                ++p;
+                ++t;
+            }
+            else if (p < pattern.size () && pattern[p] == '*')
+            {
+                star = p++;
+                star_t = t;
+            }
+            else if (star != std::string_view::npos)
+            {
+                p = star + 1;
+                t = ++star_t;
+            }
+            else
+                return false;
+        }
+
+        while (p < pattern.size () && pattern[p] == '*')
+            ++p;
+
+        return p == pattern.size ();
+    }
+
+    /**
+     * Register tag, cheap when already known
+     */
+    void add (const tag_t& tag)
+    {
+        {
+            std::shared_lock lock (mutex);
+            if (tags.count (tag))
+                return;
+        }
+
+        std::unique_lock lock (mutex);
+        dirty |= tags.insert (tag).second;
+    }
+
+    /**
+     * Register the tags of a batch, runs of one tag are checked once
+     */
+    void add_batch (const batch_t& batch)
+    {
+        std::vector<const tag_t*> unknown;
+        {
+            std::shared_lock lock (mutex);
+            const tag_t* prev = nullptr;
+            for (const Point& point : batch)
+            {
+                if (prev && *prev == point.tag)
+                    continue;
+
+                prev = &point.tag;
+                if (!tags.count (point.tag))
+                    unknown.push_back (&point.tag);
+            }
+        }
+
+        if (unknown.empty ())
+            return;
+
+        std::unique_lock lock (mutex);
+        for (const tag_t* tag : unknown)
+            dirty |= tags.insert (*tag).second;
+    }
+
+    /**
+     * Register every tag of a container of tags
+     */
+    template <typename Tags>
+    void add_all (const Tags& more)
+    {
+        std::unique_lock lock (mutex);
+        for (const auto& tag : more)
+            dirty |= tags.insert (tag).second;
+    }
+
+    /**
+     * Whether tag is known
+     */
+    bool contains (std::string_view tag) const
+    {
+        std::shared_lock lock (mutex);
+        return tags.find (tag) != tags.end ();
+    }
+
+    /**
+     * # tags
+     */
+    size_t size () const
+    {
+        std::shared_lock lock (mutex);
+        return tags.size ();
+    }
+
+    /**
+     * Sorted tags matching glob pattern (no wildcard = exact tag, "" = all),
+     * at most limit (0 = all)
+     */
+    std::vector<tag_t> match (std::string_view pattern, size_t limit = 0) const
+    {
+        if (pattern.empty ())
+            return match_prefix ("", limit);
+
+        std::string_view prefix = literal_prefix (pattern);
+        bool exact = prefix.size () == pattern.size ();
+
+        std::vector<tag_t> result;
+        std::shared_lock lock (mutex);
+
+        for (auto it = tags.lower_bound (prefix);
+             it != tags.end () && std::string_view (*it).substr (0, prefix.size ()) == prefix;
+             ++it)
+        {
+            if (exact ? *it != pattern : !glob_match (pattern, *it))
+                continue;
+
+            result.push_back (*it);
+            if (result.size () == limit || exact)
+                break;
+        }
+
+        return result;
+    }
+
+    /**
+     * Sorted tags starting with prefix, at most limit (0 = all)
+     */
+    std::vector<tag_t> match_prefix (std::string_view prefix, size_t limit = 0) const
+    {
+        std::vector<tag_t> result;
+        std::shared_lock lock (mutex);
+
+        for (auto it = tags.lower_bound (prefix);
+             it != tags.end () && std::string_view (*it).substr (0, prefix.size ()) == prefix;
+             ++it)
+        {
+            result.push_back (*it);
+            if (result.size () == limit)
+                break;
+        }
+
+        return result;
+    }
+
+    /**
+     * Sorted tags fully matching re, at most limit (0 = all), scans every tag
+     */
+    std::vector<tag_t> match_regex (const std::regex& re, size_t limit = 0) const
+    {
+        std::vector<tag_t> result;
+        std::shared_lock lock (mutex);
+
+        for (const tag_t& tag : tags)
+        {
+            if (!std::regex_match (tag, re))
+                continue;
+
+            result.push_back (tag);
+            if (result.size () == limit)
+                break;
+        }
+
+        return result;
+    }
+
+    /**
+     * Load the TAGS file, false if missing or malformed (index left empty)
+     */
+    bool load (const std::string& path)
+    {
+        std::ifstream in (path);
+        std::string line;
+        if (!in || !std::getline (in, line) || line != "TSDB-TAGS 1")
+            return false;
+
+        std::set<tag_t, std::less<>> loaded;
+        while (std::getline (in, line))
+            if (!line.empty ())
+                loaded.insert (line);
+
+        std::unique_lock lock (mutex);
+        tags = std::move (loaded);
+        dirty = false;
+        return true;
+    }
+
+    /**
+     * Rewrite the TAGS file if tags were added since the last save
+     * (tmp + fsync + rename, a crash leaves the old file)
+     */
+    bool save (const std::string& path)
+    {
+        std::lock_guard<std::mutex> guard (save_mutex);
+
+        std::vector<tag_t> snapshot;
+        {
+            std::unique_lock lock (mutex);
+            if (!dirty)
+                return true;
+
+            snapshot.assign (tags.begin (), tags.end ());
+            dirty = false;
+        }
+
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream out (tmp, std::ios::trunc);
+            out << "TSDB-TAGS 1\n";
+            for (const tag_t& tag : snapshot)
+                out << tag << "\n";
+
+            if (!out)
+            {
+                std::cerr << "Could not write " << tmp << std::endl;
+                std::unique_lock lock (mutex);
+                dirty = true;
+                return false;
+            }
+        }
+
+        fsync_path (tmp);
+        std::filesystem::rename (tmp, path);
+        fsync_path (path);
+
+        return true;
+    }
+};
@@ -1,9 +1,21 @@
 #pragma once
 
 #include <fstream>
+#include <algorithm>
 #include <string>
 #include <mutex>
+#include <thread>
+#include <future>
+#include <condition_variable>
+#include <chrono>
+#include <atomic>
+#include <filesystem>
+#include <regex>
+#include <fcntl.h>
+#include <unistd.h>
 #include "memtable.h"
+#include "series.h"
+#include "crc32.h"
 #include "types.h"
 #include "tsdb_config.h"
 
@@ -11,120 +23,658 @@ using namespace config;
 
 /**
  * Write ahead log for memtable persistence
+ * Writers enqueue records, a commit thread writes + fsyncs them in groups
+ * (see config::WalSync for the durability modes)
+ * The log is a directory of wal_<id>.wal segments. A segment rolls over
+ * once it passes wal_segment_bytes, rotate () starts a new one on demand
+ *
+ * Segment: [magic u32][version u32][segment id u64] then records
+ * Record:  [crc u32][payload len u32][seq u64][payload]
+ *          crc covers payload then seq, payload is one submitted batch
+ * Point:   [series id u32] (+ [tag_len u32][tag] when the id is 0, i.e. the
+ *          point was not interned) [time_ms i64][value f64]
+ *          Version 1 points are [tag_len u64][tag][time_ms][value]
  */
 class WAL
 {
+public:
+    static constexpr uint32_t magic          {0x4C415754}; // "TWAL"
+    static constexpr uint32_t version        {2};
+    static constexpr size_t segment_header   {16};
+    static constexpr size_t record_header    {16};
+
 private:
+    std::string dir;
     std::string path;
-    std::ofstream file;
+    uint64_t segment_id {0};
+    size_t segment_size {0};
+    size_t max_segment_bytes;
+    int fd {-1};
+    WalSync mode;
+    std::chrono::milliseconds window;
+
+    // Serializes file I/O (commit thread, rotate, per-write mode)
     std::mutex write_lock;
 
-public:
+    // Shared group buffer
+    std::mutex queue_lock;
+    std::condition_variable commit_cv;
+    std::condition_variable done_cv;
+    std::string pending;
+    uint64_t enqueued_seq {0};
+    uint64_t committed_seq {0};
+    std::atomic<size_t> commit_count {0};
+
+    // First seq of a group that failed to reach disk, 0 = none. Sticky:
+    // after a failed fdatasync the page cache can't be trusted, so every
+    // later record fails too until a restart replays the log
+    std::atomic<uint64_t> failed_seq {0};
+
+    bool stopping {false};
+    std::thread commit_thread;
+
+    /**
+     * Write whole buffer to the open segment, no fsync, caller holds write_lock
+     */
+    bool write_all (const char* data, size_t len)
+    {
+        size_t written = 0;
+        while (written < len)
+        {
+            ssize_t n = ::write (fd, data + written, len - written);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+
+                std::cerr << "WAL write failed at " << path << std::endl;
+                perror ("Reason");
+                return false;
+            }
+            written += static_cast<size_t> (n);
+        }
+
+        segment_size += len;
+        return true;
+    }
+
+    /**
+     * Write whole buffer and make it durable, caller holds write_lock
+     * Returns false if it may not be on disk
+     */
+    bool write_durable (const std::string& buf)
+    {
+        if (buf.empty ())
+            return true;
+
+        if (fd < 0 || failed_seq.load () || !write_all (buf.data (), buf.size ()))
+            return false;
+
+        if (::fdatasync (fd) != 0)
+        {
+            std::cerr << "WAL fsync failed at " << path << std::endl;
+            perror ("Reason");
+            return false;
+        }
+
+        ++commit_count;
+
+        // Roll over, groups never straddle segments
+        if (segment_size >= max_segment_bytes)
+            open_segment (segment_id + 1);
+
+        return true;
+    }
+
+    /**
+     * Mark seqs from first on as lost, caller holds queue_lock
+     */
+    void fail_from (uint64_t first)
+    {
+        uint64_t none = 0;
+        failed_seq.compare_exchange_strong (none, first);
+    }
+
+    /**
+     * Commit loop, drains the group buffer
+     * write_lock is taken before the swap so rotate () never splits a group
+     */
+    void run_commits ()
+    {
+        while (true)
+        {
+            {
+                std::unique_lock lock (queue_lock);
+                commit_cv.wait (lock, [this] { return stopping || !pending.empty (); });
+
+                if (pending.empty () && stopping)
+                    return;
+
+                // Let more writers join the group
+                if (window.count () > 0 && !stopping)
+                    commit_cv.wait_for (lock, window, [this] { return stopping; });
+            }
+
+            std::lock_guard<std::mutex> io (write_lock);
+            commit_pending ();
+        }
+    }
+
+    /**
+     * Write out the group buffer, caller holds write_lock
+     */
+    void commit_pending ()
+    {
+        std::unique_lock lock (queue_lock);
+        std::string group;
+        group.swap (pending);
+        uint64_t group_seq = enqueued_seq;
+        lock.unlock ();
+
+        bool ok = write_durable (group);
+
+        // Groups are contiguous, this one starts after the last committed
+        lock.lock ();
+        if (!ok)
+            fail_from (committed_seq + 1);
+        committed_seq = std::max (committed_seq, group_seq);
+        done_cv.notify_all ();
+    }
+
     /**
-     * Open path as binary append mode
+     * Path of segment id
      */
-    WAL (const std::string& path = wal_path) : path (path)
+    std::string segment_path (uint64_t id) const
     {
-        file.open (path, std::ios::binary | std::ios::app);
-        
-        if (!file.is_open ())
+        return dir + "wal_" + std::to_string (id) + ".wal";
+    }
+
+    /**
+     * Ids of segments on disk, ascending
+     */
+    std::vector<uint64_t> list_segments () const
+    {
+        std::vector<uint64_t> ids;
+        std::regex re ("wal_(\\d+)\\.wal");
+        std::smatch match;
+
+        for (const auto& entry : std::filesystem::directory_iterator (dir))
+        {
+            std::string filename = entry.path ().filename ().string ();
+
+            if (std::regex_match (filename, match, re))
+                ids.push_back (std::stoull (match[1]));
+        }
+
+        std::sort (ids.begin (), ids.end ());
+        return ids;
+    }
+
+    /**
+     * Open segment id for appends and write its header, caller holds write_lock
+     */
+    void open_segment (uint64_t id)
+    {
+        if (fd >= 0)
+            ::close (fd);
+
+        segment_id = id;
+        segment_size = 0;
+        path = segment_path (id);
+        fd = ::open (path.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+        if (fd < 0)
         {
             std::cerr << "Could not open WAL file at " << path << std::endl;
             perror ("Reason");
             return;
         }
+
+        char header[segment_header];
+        std::memcpy (header, &magic, 4);
+        std::memcpy (header + 4, &version, 4);
+        std::memcpy (header + 8, &id, 8);
+        write_all (header, segment_header);
+    }
+
+    /**
+     * Frame payload as a record with seq, crc_payload is crc32 of payload
+     */
+    static void frame_record (std::string& out, const std::string& payload,
+                              uint32_t crc_payload, uint64_t seq)
+    {
+        uint32_t crc = crc::crc32 (&seq, sizeof (seq), crc_payload);
+        uint32_t len = static_cast<uint32_t> (payload.size ());
+
+        out.append (reinterpret_cast<const char*> (&crc), sizeof (crc));
+        out.append (reinterpret_cast<const char*> (&len), sizeof (len));
+        out.append (reinterpret_cast<const char*> (&seq), sizeof (seq));
+        out.append (payload);
     }
 
+public:
     /**
-     * Write raw bytes to disk
+     * Result of decoding one segment
      */
-    void append (const tag_t& tag, time_t time_ms, const data_t& val)
+    struct SegmentData
     {
-        std::lock_guard<std::mutex> lock (write_lock);
-        if (!file.is_open ())
+        table_t table;
+        uint64_t last_seq {0};
+        size_t records {0};
+        bool corrupt {false};
+    };
+
+    /**
+     * Open a fresh segment in dir, existing segments are left for recover ()
+     */
+    WAL (const std::string& dir = wal_dir, WalSync mode = wal_sync_mode,
+         std::chrono::milliseconds window = std::chrono::milliseconds {wal_group_window_ms},
+         size_t max_segment_bytes = wal_segment_bytes)
+        : dir (dir), max_segment_bytes (max_segment_bytes), mode (mode), window (window)
+    {
+        std::filesystem::create_directories (dir);
+
+        std::vector<uint64_t> existing = list_segments ();
+        open_segment (existing.empty () ? 1 : existing.back () + 1);
+
+        if (fd < 0)
             return;
 
-        // Write
-        size_t tag_len = tag.size ();
-        file.write (reinterpret_cast<const char*> (&tag_len), sizeof (tag_len));
-        file.write (tag.c_str (), tag_len);
-        file.write (reinterpret_cast<const char*> (&time_ms), sizeof (time_ms));
-        file.write (reinterpret_cast<const char*> (&val), sizeof (val));
+        // Async mode never waits but still commits in the background
+        if (mode == WalSync::async && window.count () == 0)
+            this->window = std::chrono::milliseconds {1};
 
-        // Flush buffer
-        file.flush ();
+        if (mode != WalSync::every_write)
+            commit_thread = std::thread ([this] { run_commits (); });
     }
 
     /**
-     * Recover WAL into mem_db
+     * Serialize one point onto the end of buf, by series id when interned
      */
-    void recover (MemTable& mem_db) const
+    static void encode_record (std::string& buf, const Point& point)
     {
-        std::ifstream reader (path);
+        buf.append (reinterpret_cast<const char*> (&point.series), sizeof (point.series));
+        if (point.series == 0)
+        {
+            uint32_t tag_len = static_cast<uint32_t> (point.tag.size ());
+            buf.append (reinterpret_cast<const char*> (&tag_len), sizeof (tag_len));
+            buf.append (point.tag);
+        }
+        buf.append (reinterpret_cast<const char*> (&point.data.time_ms), sizeof (time_t));
+        buf.append (reinterpret_cast<const char*> (&point.data.value), sizeof (data_t));
+    }
+
+    /**
+     * Enqueue a batch into the group buffer, returns its commit sequence number
+     */
+    uint64_t submit (const batch_t& batch)
+    {
+        std::string payload;
+        payload.reserve (batch.size () * (sizeof (series_id_t) + sizeof (Data)));
+        for (const Point& point : batch)
+            encode_record (payload, point);
+
+        // Payload crc outside the lock, seq is folded in once assigned
+        uint32_t crc_payload = crc::crc32 (payload.data (), payload.size ());
+
+        if (mode == WalSync::every_write)
+        {
+            std::lock_guard<std::mutex> io (write_lock);
+            std::lock_guard<std::mutex> lock (queue_lock);
+
+            uint64_t seq = ++enqueued_seq;
+            std::string record;
+            frame_record (record, payload, crc_payload, seq);
+            if (!write_durable (record))
+                fail_from (seq);
+
+            committed_seq = seq;
+            return seq;
+        }
+
+        std::lock_guard<std::mutex> lock (queue_lock);
+        uint64_t seq = ++enqueued_seq;
+        frame_record (pending, payload, crc_payload, seq);
+        commit_cv.notify_one ();
+
+        return seq;
+    }
+
+    /**
+     * Block until seq is durable (no-op in async mode)
+     * Returns false if seq failed to reach disk, see failed_seq
+     */
+    bool wait (uint64_t seq)
+    {
+        if (mode != WalSync::async)
+        {
+            std::unique_lock lock (queue_lock);
+            done_cv.wait (lock, [this, seq] { return committed_seq >= seq; });
+        }
+
+        uint64_t failed = failed_seq.load ();
+        return failed == 0 || seq < failed;
+    }
+
+    /**
+     * Block until everything enqueued so far is durable, in any mode
+     * Returns false if any of it failed to reach disk
+     */
+    bool sync ()
+    {
+        std::unique_lock lock (queue_lock);
+        uint64_t seq = enqueued_seq;
+        done_cv.wait (lock, [this, seq] { return committed_seq >= seq; });
+
+        uint64_t failed = failed_seq.load ();
+        return failed == 0 || seq < failed;
+    }
+
+
+    /**
+     * Write raw bytes to disk, false if they failed to
+     */
+    bool append (const tag_t& tag, time_t time_ms, const data_t& val)
+    {
+        return append_batch (batch_t {Point {tag, Data {time_ms, val}}});
+    }
+
+    /**
+     * Write a batch of records as one group, returns once durable per mode
+     * False if the batch failed to reach disk
+     */
+    bool append_batch (const batch_t& batch)
+    {
+        if (batch.empty ())
+            return true;
+
+        if (fd < 0)
+            return false;
+
+        return wait (submit (batch));
+    }
+
+    /**
+     * Number of write + fsync groups issued so far
+     */
+    size_t get_commit_count () const
+    {
+        return commit_count.load ();
+    }
+
+    /**
+     * Decode one segment file, stops at the first torn or corrupt record
+     * registry resolves series ids, points of unknown ids are dropped
+     */
+    static SegmentData decode_segment (const std::string& seg_path,
+                                       const SeriesRegistry* registry = nullptr)
+    {
+        SegmentData out;
+
+        std::ifstream reader (seg_path, std::ios::binary | std::ios::ate);
         if (!reader)
+            return out;
+
+        // Whole segment in one read
+        std::string buf (static_cast<size_t> (reader.tellg ()), '\0');
+        reader.seekg (0);
+        reader.read (buf.data (), buf.size ());
+
+        if (buf.size () < segment_header)
         {
-            std::cout << "No WAL found." << std::endl;
-            return;
+            out.corrupt = !buf.empty ();
+            return out;
         }
 
-        while (reader.peek () != EOF)
+        uint32_t seg_magic = 0;
+        uint32_t seg_version = 0;
+        std::memcpy (&seg_magic, buf.data (), 4);
+        std::memcpy (&seg_version, buf.data () + 4, 4);
+        if (seg_magic != magic || seg_version < 1 || seg_version > version)
         {
-            size_t tag_len;
+            std::cerr << "Bad WAL segment header in " << seg_path << std::endl;
+            out.corrupt = true;
+            return out;
+        }
 
-            if (!reader.read (reinterpret_cast<char*> (&tag_len), sizeof (tag_len)))
-                break;
-            
-            // Check tag_len before allocating massive memory
-            if (tag_len > 1024)
+        size_t pos = segment_header;
+        std::vector<Data>* series = nullptr;
+        std::string last_tag;
+        series_id_t last_id = 0;
+        size_t unknown = 0;
+        while (pos < buf.size ())
+        {
+            if (buf.size () - pos < record_header)
             {
-                std::cerr << "Unreasonable tag length detected: " << tag_len 
-                          << std::endl;
-                break; 
+                out.corrupt = true;
+                break;
             }
 
-            std::string tag (tag_len, ' ');
-            reader.read (&tag[0], tag_len);
+            uint32_t crc, len;
+            uint64_t seq;
+            std::memcpy (&crc, buf.data () + pos, 4);
+            std::memcpy (&len, buf.data () + pos + 4, 4);
+            std::memcpy (&seq, buf.data () + pos + 8, 8);
 
-            time_t time_ms;
-            if (!reader.read (reinterpret_cast<char*> (&time_ms), sizeof (time_ms)))
+            // Torn tail
+            if (buf.size () - pos - record_header < len)
+            {
+                out.corrupt = true;
                 break;
+            }
 
-            data_t val;
-            if (!reader.read (reinterpret_cast<char*> (&val), sizeof (val)))
+            const char* payload = buf.data () + pos + record_header;
+            uint32_t check = crc::crc32 (&seq, sizeof (seq),
+                                         crc::crc32 (payload, len));
+            if (check != crc || seq <= out.last_seq)
+            {
+                out.corrupt = true;
                 break;
+            }
+
+            // Points of the group, crc passed so the layout is trusted
+            size_t off = 0;
+            while (off < len)
+            {
+                std::string_view tag;
+                if (seg_version == 1)
+                {
+                    size_t tag_len;
+                    if (len - off < sizeof (tag_len))
+                        break;
+                    std::memcpy (&tag_len, payload + off, sizeof (tag_len));
+                    off += sizeof (tag_len);
+
+                    if (tag_len > len - off)
+                        break;
+                    tag = std::string_view (payload + off, tag_len);
+                    off += tag_len;
+                    last_id = 0;
+                }
+                else
+                {
+                    series_id_t id;
+                    if (len - off < sizeof (id))
+                        break;
+                    std::memcpy (&id, payload + off, sizeof (id));
+                    off += sizeof (id);
+
+                    if (id == 0)
+                    {
+                        uint32_t tag_len;
+                        if (len - off < sizeof (tag_len))
+                            break;
+                        std::memcpy (&tag_len, payload + off, sizeof (tag_len));
+                        off += sizeof (tag_len);
+
+                        if (tag_len > len - off)
+                            break;
+                        tag = std::string_view (payload + off, tag_len);
+                        off += tag_len;
+                        last_id = 0;
+                    }
+                    else if (!series || id != last_id)
+                    {
+                        tag_t key = registry ? registry->key_of (id) : tag_t ();
+                        series = key.empty () ? nullptr : &out.table[key];
+                        last_id = id;
+                        last_tag.clear ();
+                    }
+                }
+
+                if (len - off < sizeof (time_t) + sizeof (data_t))
+                    break;
 
-            mem_db.insert (tag, time_ms, val);
+                // Batches are usually runs of one series, skip the lookup
+                if (!last_id && (!series || tag != last_tag))
+                {
+                    series = &out.table[tag_t (tag)];
+                    last_tag = tag;
+                }
+
+                Data point;
+                std::memcpy (&point.time_ms, payload + off, sizeof (time_t));
+                off += sizeof (time_t);
+                std::memcpy (&point.value, payload + off, sizeof (data_t));
+                off += sizeof (data_t);
+
+                if (series)
+                    series->push_back (point);
+                else
+                    ++unknown;
+            }
+
+            out.last_seq = seq;
+            ++out.records;
+            pos += record_header + len;
+        }
+
+        if (unknown)
+            std::cerr << "Dropped " << unknown << " WAL points of unknown series ids in "
+                      << seg_path << std::endl;
+
+        if (out.corrupt)
+            std::cerr << "Torn/corrupt WAL record in " << seg_path
+                      << " after " << out.records << " records, skipping rest of segment"
+                      << std::endl;
+
+        return out;
+    }
+
+    /**
+     * Recover all segments older than the open one into mem_db
+     * Segments are decoded in parallel, then bulk-inserted oldest first.
+     * A torn/corrupt record ends its segment only, later segments still
+     * replay (a crash can leave a torn tail in a segment that was never
+     * flushed before the next crash)
+     * registry resolves the series ids of interned points
+     */
+    void recover (MemTable& mem_db, const SeriesRegistry* registry = nullptr)
+    {
+        std::vector<uint64_t> ids;
+        for (uint64_t id : list_segments ())
+            if (id < segment_id)
+                ids.push_back (id);
+
+        if (ids.empty ())
+        {
+            std::cout << "No WAL found." << std::endl;
+            return;
+        }
+
+        // Decode on workers, each pulls the next unclaimed segment
+        std::vector<SegmentData> decoded (ids.size ());
+        std::atomic<size_t> next {0};
+        size_t workers = std::min<size_t> (ids.size (),
+                                           std::max (1u, std::thread::hardware_concurrency ()));
+
+        std::vector<std::future<void>> tasks;
+        for (size_t w = 0; w < workers; ++w)
+            tasks.push_back (std::async (std::launch::async, [&] ()
+            {
+                for (size_t i = next++; i < ids.size (); i = next++)
+                    decoded[i] = decode_segment (segment_path (ids[i]), registry);
+            }));
+
+        for (auto& task : tasks)
+            task.get ();
+
+        // Concatenate per series in log order
+        table_t merged;
+        uint64_t last_seq = 0;
+        size_t records = 0;
+        for (SegmentData& segment : decoded)
+        {
+            for (auto& [tag, points] : segment.table)
+            {
+                std::vector<Data>& series = merged[tag];
+                if (series.empty ())
+                    series = std::move (points);
+                else
+                    series.insert (series.end (), points.begin (), points.end ());
+            }
+
+            last_seq = std::max (last_seq, segment.last_seq);
+            records += segment.records;
+        }
+
+        mem_db.insert_table (std::move (merged));
+
+        // Continue numbering after the recovered log
+        {
+            std::lock_guard<std::mutex> lock (queue_lock);
+            enqueued_seq = std::max (enqueued_seq, last_seq);
+            committed_seq = std::max (committed_seq, last_seq);
         }
 
         if (debug)
-            std::cout << "Recovered data from " << path << std::endl;
+            std::cout << "Recovered " << records << " WAL records from "
+                      << ids.size () << " segment(s) in " << dir << std::endl;
+    }
+
+    /**
+     * Seal the open segment and start a new one
+     * Records submitted before the call land in the old segment, records
+     * submitted after in the new one. Returns the new segment id
+     */
+    uint64_t rotate ()
+    {
+        std::lock_guard<std::mutex> io (write_lock);
+        commit_pending ();
+        open_segment (segment_id + 1);
+
+        return segment_id;
     }
 
     /**
-     * Reset WAL to empty
+     * Delete segments older than id, once their data is durable elsewhere
      */
-    void reset ()
+    void remove_segments_before (uint64_t id)
     {
-        std::lock_guard<std::mutex> lock (write_lock);
-        if (file.is_open ())
-            file.close ();
-        
-        file.open (path, std::ios::binary | std::ios::out | std::ios::trunc);
+        for (uint64_t seg : list_segments ())
+        {
+            if (seg >= id)
+                break;
 
-        if (!file.is_open ())
-            std::cerr << "Failed to reset WAL" << std::endl;
+            std::filesystem::remove (segment_path (seg));
+        }
     }
 
     /**
-     * Destructor
+     * Destructor, drains queued records before closing
      */
     ~WAL ()
     {
-        // No need for lock
-        if (file.is_open ())
         {
-            file.flush ();
-            file.close ();
+            std::lock_guard<std::mutex> lock (queue_lock);
+            stopping = true;
         }
+        commit_cv.notify_all ();
+
+        if (commit_thread.joinable ())
+            commit_thread.join ();
+
+        if (fd >= 0)
+            ::close (fd);
     }
-};
\ No newline at end of file
+};
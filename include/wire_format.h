@@ -0,0 +1,182 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include "types.h"
+#include "gorilla.h"
+#include "chunk_codec.h"
+#include "bit_buffer.h"
+
+/**
+ * Binary /read response formats
+ *
+ * binary (application/octet-stream), columnar, little-endian:
+ *   magic u32 "TSDC", version u32, count u64,
+ *   count x ts i64, then count x value f64
+ *
+ * gorilla (application/x-tsdb-gorilla), compressed chunks as stored:
+ *   magic u32 "TSDG", version u32,
+ *   frames: count u64, min_ts i64, max_ts i64, size u32, encoding u32, bytes
+ *   ended by a frame with count 0
+ *   Each frame decodes on its own, encoding is its chunk format: a bare
+ *   gorilla stream (format_v1 from older SSTables, format_v2) or an SSTable
+ *   block with its codec byte (see codec::decode). Frames are in
+ *   source order (SSTables oldest first, then memory) and may overlap in
+ *   time, clients merge them
+ */
+namespace wire
+{
+    static constexpr uint32_t columns_magic  {0x43445354}; // "TSDC"
+    static constexpr uint32_t gorilla_magic  {0x47445354}; // "TSDG"
+    static constexpr uint32_t version        {1};
+    static constexpr const char* columns_content_type {"application/octet-stream"};
+    static constexpr const char* gorilla_content_type {"application/x-tsdb-gorilla"};
+    static constexpr size_t columns_header_size {16};
+    static constexpr size_t frame_header_size   {32};
+
+    // Frame encodings, the gorilla stream formats
+    static constexpr uint32_t encoding_gorilla    {gorilla::format_v1};
+    static constexpr uint32_t encoding_gorilla_v2 {gorilla::format_v2};
+    static constexpr uint32_t encoding_blocks     {codec::format_blocks};
+
+    /**
+     * Append val little-endian
+     */
+    template <typename T>
+    void put_le (std::string& buf, T val)
+    {
+        static_assert (sizeof (T) == 4 || sizeof (T) == 8);
+        uint64_t bits = 0;
+        std::memcpy (&bits, &val, sizeof (T));
+        for (size_t i = 0; i < sizeof (T); ++i)
+            buf.push_back (static_cast<char> (bits >> (8 * i)));
+    }
+
+    /**
+     * Read a little-endian val at pos and advance, false if out of bounds
+     */
+    template <typename T>
+    bool get_le (const std::string& buf, size_t& pos, T& val)
+    {
+        static_assert (sizeof (T) == 4 || sizeof (T) == 8);
+        if (pos + sizeof (T) > buf.size ())
+            return false;
+
+        uint64_t bits = 0;
+        for (size_t i = 0; i < sizeof (T); ++i)
+            bits |= uint64_t (static_cast<uint8_t> (buf[pos + i])) << (8 * i);
+        std::memcpy (&val, &bits, sizeof (T));
+
+        pos += sizeof (T);
+        return true;
+    }
+
+    /**
+     * Header of a columnar response of count points
+     */
+    inline std::string columns_header (uint64_t count)
+    {
+        std::string buf;
+        put_le (buf, columns_magic);
+        put_le (buf, version);
+        put_le (buf, count);
+        return buf;
+    }
+
+    /**
+     * Header of a gorilla stream
+     */
+    inline std::string gorilla_header ()
+    {
+        std::string buf;
+        put_le (buf, gorilla_magic);
+        put_le (buf, version);
+        return buf;
+    }
+
+    /**
+     * Header of one gorilla frame, count 0 ends the stream
+     */
+    inline std::string frame_header (uint64_t count, time_t min_ts, time_t max_ts,
+                                     uint32_t size, uint32_t encoding = encoding_gorilla_v2)
+    {
+        std::string buf;
+        put_le (buf, count);
+        put_le (buf, static_cast<int64_t> (min_ts));
+        put_le (buf, static_cast<int64_t> (max_ts));
+        put_le (buf, size);
+        put_le (buf, encoding);
+        return buf;
+    }
+
+    /**
+     * Parse a columnar response, false if malformed (reference client)
+     */
+    inline bool decode_columns (const std::string& buf, std::vector<Data>& out)
+    {
+        size_t pos = 0;
+        uint32_t magic, ver;
+        uint64_t count;
+        if (!get_le (buf, pos, magic) || !get_le (buf, pos, ver) || !get_le (buf, pos, count) ||
+            magic != columns_magic || ver != version ||
+            buf.size () != columns_header_size + count * 16)
+            return false;
+
+        out.resize (count);
+        size_t value_pos = pos + count * 8;
+        for (uint64_t i = 0; i < count; ++i)
+        {
+            int64_t ts;
+            get_le (buf, pos, ts);
+            get_le (buf, value_pos, out[i].value);
+            out[i].time_ms = ts;
+        }
+
+        return true;
+    }
+
+    /**
+     * Parse a gorilla stream into points in frame order, false if
+     * malformed (reference client)
+     */
+    inline bool decode_gorilla (const std::string& buf, std::vector<Data>& out)
+    {
+        size_t pos = 0;
+        uint32_t magic, ver;
+        if (!get_le (buf, pos, magic) || !get_le (buf, pos, ver) ||
+            magic != gorilla_magic || ver != version)
+            return false;
+
+        while (true)
+        {
+            uint64_t count;
+            int64_t min_ts, max_ts;
+            uint32_t size, encoding;
+            if (!get_le (buf, pos, count) || !get_le (buf, pos, min_ts) ||
+                !get_le (buf, pos, max_ts) || !get_le (buf, pos, size) ||
+                !get_le (buf, pos, encoding))
+                return false;
+
+            if (count == 0)
+                return pos == buf.size ();
+
+            if (encoding < encoding_gorilla || encoding > encoding_blocks ||
+                pos + size > buf.size ())
+                return false;
+
+            Columns columns;
+            if (!codec::decode_columns (static_cast<uint8_t> (encoding),
+                                        reinterpret_cast<const byte_t*> (buf.data () + pos),
+                                        size, count, columns))
+                return false;
+
+            std::vector<Data> points;
+            for (size_t i = 0; i < columns.size (); ++i)
+                points.push_back (columns.at (i));
+            out.insert (out.end (), points.begin (), points.end ());
+            pos += size;
+        }
+    }
+}
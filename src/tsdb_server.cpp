@@ -2,10 +2,21 @@
 #include <iostream>
 #include "memtable.h"
 #include "wal.h"
+#include "sstable.h"
+#include "compactor.h"
+#include "aggregate.h"
+#include "rollup.h"
+#include "json_writer.h"
+#include "wire_format.h"
+#include "tag_index.h"
+#include "series.h"
+#include "line_protocol.h"
 #include <sstream>
 #include <filesystem>
 #include <regex>
 #include <set>
+#include <charconv>
+#include <algorithm>
 #include "types.h"
 #include "tsdb_config.h"
 
@@ -31,6 +42,33 @@ size_t get_next_batch_id (const std::string& dir = sstable_dir)
     return max_id + 1;
 }
 
+/**
+ * Parse integer query param into out, left untouched if absent
+ * Returns false if present but malformed
+ */
+template <typename T>
+bool parse_param (const httplib::Request& req, const char* key, T& out)
+{
+    if (!req.has_param (key))
+        return true;
+
+    std::string raw = req.get_param_value (key);
+    auto [end, err] = std::from_chars (raw.data (), raw.data () + raw.size (), out);
+
+    return err == std::errc () && end == raw.data () + raw.size ();
+}
+
+/**
+ * tag query param in canonical label order, as given if malformed
+ */
+std::string get_tag_param (const httplib::Request& req)
+{
+    std::string raw = req.get_param_value ("tag");
+    std::string tag;
+
+    return labels::canonicalize (raw, tag) ? tag : raw;
+}
+
 /**
  * Wrapper for TSDB components
  */
@@ -38,14 +76,37 @@ class TSDBServer
 {
 private:
     httplib::Server server;
-    MemTable mem_db;
     WAL wal;
+
+    // Active table takes writes, frozen table is being flushed but stays
+    // readable until its SSTable is durable. Both guarded by rotate_mutex,
+    // writers hold it shared so a WAL record and its insert land in the
+    // same generation
+    std::shared_ptr<MemTable> active_db;
+    std::shared_ptr<MemTable> frozen_db;
+    mutable std::shared_mutex rotate_mutex;
+
+    // Flushed data, indexes loaded once at startup / flush
+    SSTableSet sstables;
     
     std::atomic<size_t> batch_id;
 
+    // Tags of every series, flushed or in memory
+    TagIndex tag_index;
+
+    // Series ids (what the WAL stores) and label postings
+    SeriesRegistry series;
+
+    // Decoded chunks of recently read SSTable series
+    mutable BlockCache block_cache;
+
+    // Merges flushed SSTables into time partitions, shares batch_id
+    Compactor compactor;
+
     std::atomic<bool> running {true};
     std::thread debug_thread;
     std::thread flush_thread;
+    std::thread compaction_thread;
 
     /**
      * Debug thread
@@ -60,7 +121,7 @@ private:
             {
                 std::this_thread::sleep_for (std::chrono::seconds (1));
                 // Clear terminal and print to screen
-                mem_db.print ();
+                get_tables ().first->print ();
                 std::cout << std::endl;
             }
         });
@@ -78,20 +139,71 @@ private:
             while (running.load ())
             {
                 // flush at ~1MB
-                if ((mem_db.get_total_count () * sizeof (Data)) < memtable_bytes)
+                if (active_db->get_bytes () < memtable_bytes)
                 {
                     std::this_thread::sleep_for (std::chrono::milliseconds {100});
                     continue;
                 }
 
-                table_t data = mem_db.extract ();
+                // Freeze active table and start a new WAL segment for its successor
+                std::shared_ptr<MemTable> to_flush;
+                uint64_t next_segment;
+                {
+                    std::unique_lock lock (rotate_mutex);
+                    to_flush = active_db;
+                    frozen_db = to_flush;
+                    active_db = std::make_shared<MemTable> ();
+                    next_segment = wal.rotate ();
+                }
+
                 size_t cur_id = batch_id.fetch_add (1);
 
                 if (debug)
                     std::cout << "Flushing batch " << cur_id << "..." << std::endl;
 
-                mem_db.flush (data, cur_id);
-                wal.reset ();
+                // Keep the frozen table and its WAL segments until it's on disk
+                bool flushed = to_flush->flush (cur_id);
+                while (!flushed && running.load ())
+                {
+                    std::cerr << "Flush of batch " << cur_id << " failed, retrying" << std::endl;
+                    std::this_thread::sleep_for (std::chrono::seconds {1});
+                    flushed = to_flush->flush (cur_id);
+                }
+
+                // Shutting down, the WAL replays it on restart
+                if (!flushed)
+                    break;
+
+                auto table = std::make_shared<const SSTableReader>
+                             (get_sstable_path (std::to_string (cur_id)), cur_id);
+
+                // SSTable is durable, publish it and drop the frozen table in one
+                // step so readers see the data exactly once, then its WAL segments.
+                // Until the MANIFEST lists it the frozen table and WAL stay
+                bool published = false;
+                while (running.load ())
+                {
+                    {
+                        std::unique_lock lock (rotate_mutex);
+                        published = sstables.add (table);
+                        if (published)
+                            frozen_db.reset ();
+                    }
+
+                    if (published)
+                        break;
+
+                    std::cerr << "Publishing batch " << cur_id << " failed, retrying" << std::endl;
+                    std::this_thread::sleep_for (std::chrono::seconds {1});
+                }
+
+                // Shutting down, the unlisted SSTable goes at startup, the WAL replays
+                if (!published)
+                    break;
+
+                // Before the WAL goes, a crash until here replays the tags
+                tag_index.save (tag_index_path);
+                wal.remove_segments_before (next_segment);
             }
         });
 
@@ -100,55 +212,421 @@ private:
     }
 
     /**
-     * Search an sstable for tag
+     * Background compaction thread
+     */
+    void start_compaction_thread ()
+    {
+        compaction_thread = std::thread ([this] ()
+        {
+            while (running.load ())
+            {
+                if (!compactor.maybe_compact ())
+                    std::this_thread::sleep_for (std::chrono::seconds {1});
+            }
+        });
+
+        if (debug)
+            std::cout << "Compactor Initialized" << std::endl;
+    }
+
+    /**
+     * Snapshot of {active, frozen} tables, frozen may be null
+     */
+    std::pair<std::shared_ptr<MemTable>, std::shared_ptr<MemTable>> get_tables () const
+    {
+        std::shared_lock lock (rotate_mutex);
+        return {active_db, frozen_db};
+    }
+
+    /**
+     * Keep at most limit points of an ascending series (0 = all),
+     * the newest ones if descending
+     */
+    static void trim_to_limit (std::vector<Data>& points, size_t limit, bool descending)
+    {
+        if (limit == 0 || points.size () <= limit)
+            return;
+
+        if (descending)
+            points.erase (points.begin (), points.end () - limit);
+        else
+            points.resize (limit);
+    }
+
+    /**
+     * Every place a series can live, oldest first
+     */
+    struct Sources
+    {
+        std::vector<SSTableSet::Entry> tables;
+        std::shared_ptr<MemTable> frozen;
+        std::shared_ptr<MemTable> active;
+    };
+
+    /**
+     * Consistent view of all sources, see start_flush_thread
+     */
+    Sources get_sources () const
+    {
+        std::shared_lock lock (rotate_mutex);
+        return Sources {sstables.entries (), frozen_db, active_db};
+    }
+
+    /**
+     * Whether two sources may both hold points of tag inside range at the
+     * same time, judged from SSTable indexes and MemTable bounds only
+     */
+    bool sources_overlap (const Sources& sources, const tag_t& tag,
+                          const TimeRange& range) const
+    {
+        std::vector<std::pair<time_t, time_t>> extents;
+        auto add_extent = [&] (time_t first, time_t last)
+        {
+            first = std::max (first, range.start);
+            last = std::min (last, range.end);
+            if (first <= last)
+                extents.emplace_back (first, last);
+        };
+
+        for (const SSTableSet::Entry& entry : sources.tables)
+        {
+            if (!entry.table->overlaps (range) || !entry.table->may_contain (tag))
+                continue;
+
+            std::vector<const sstable::ChunkEntry*> chunks = entry.table->find_chunks (tag, range);
+            if (!chunks.empty ())
+                add_extent (chunks.front ()->min_ts, chunks.back ()->max_ts);
+        }
+
+        time_t first, last;
+        for (const MemTable* table : {sources.frozen.get (), sources.active.get ()})
+            if (table && table->get_bounds (tag, first, last))
+                add_extent (first, last);
+
+        std::sort (extents.begin (), extents.end ());
+        for (size_t i = 1; i < extents.size (); ++i)
+            if (extents[i].first <= extents[i - 1].second)
+                return true;
+
+        return false;
+    }
+
+    /**
+     * Call fn (ts, values, n) on ascending column spans of tag inside range
+     * from every source, without assembling the series. When sources
+     * overlap in time the series is merged like read_series instead, so
+     * replayed points are not counted twice
+     */
+    template <typename Fn>
+    void visit_series (const Sources& sources, const tag_t& tag,
+                       const TimeRange& range, Fn&& fn) const
+    {
+        if (sources_overlap (sources, tag, range))
+        {
+            std::vector<Data> points = read_series (sources, tag, range, 0, false);
+            Columns columns;
+            columns.reserve (points.size ());
+            for (const Data& point : points)
+                columns.push_back (point);
+
+            if (columns.size ())
+                fn (columns.ts.data (), columns.values.data (), columns.size ());
+            return;
+        }
+
+        for (const SSTableSet::Entry& entry : sources.tables)
+            if (entry.table->overlaps (range) && entry.table->may_contain (tag))
+                entry.table->visit (tag, range, &block_cache, fn);
+
+        // MemTable series are rows, transpose their span
+        auto transpose = [&] (const Data* points, size_t n)
+        {
+            Columns columns;
+            columns.reserve (n);
+            for (size_t i = 0; i < n; ++i)
+                columns.push_back (points[i]);
+
+            fn (columns.ts.data (), columns.values.data (), n);
+        };
+
+        if (sources.frozen)
+            sources.frozen->visit_range (tag, range, transpose);
+
+        sources.active->visit_range (tag, range, transpose);
+    }
+
+    /**
+     * Bucket tag inside range, flushed data from rollups when resolution > 0
+     * and the table has them, raw points otherwise. Overlapping sources
+     * are merged like read_series first, rollups would count duplicates
      */
-    std::vector<Data> search_sstable (const std::string& path, const tag_t& tag) const
+    void aggregate_series (const Sources& sources, const tag_t& tag, const TimeRange& range,
+                           time_t resolution, BucketAggregator& buckets) const
     {
-        std::ifstream in (path, std::ios::binary);
+        if (sources_overlap (sources, tag, range))
+        {
+            std::vector<Data> points = read_series (sources, tag, range, 0, false);
+            buckets.add (points.data (), points.size ());
+            return;
+        }
+
+        auto add_columns = [&] (const time_t* ts, const data_t* values, size_t n)
+                           { buckets.add (ts, values, n); };
+        auto add_raw = [&] (const Data* p, size_t n) { buckets.add (p, n); };
 
-        while (in.peek () != EOF)
+        for (const SSTableSet::Entry& entry : sources.tables)
         {
-            // Read tag
-            size_t tag_len;
-            in.read (reinterpret_cast<char*> (&tag_len), sizeof (tag_len));
-            std::string cur_tag (tag_len, ' ');
-            in.read (&cur_tag[0], tag_len);
+            const SSTableReader& table = *entry.table;
+            if (!table.overlaps (range) || !table.may_contain (tag))
+                continue;
 
-            // Read # points
-            size_t num_pts;
-            in.read (reinterpret_cast<char*> (&num_pts), sizeof (num_pts));
+            if (resolution == 0 || !entry.rollup)
+            {
+                table.visit (tag, range, &block_cache, add_columns);
+                continue;
+            }
+
+            // Stat columns share timestamps, one point per rollup bucket
+            std::vector<Data> columns[4];
+            for (int s = 0; s < 4; ++s)
+                columns[s] = entry.rollup->read (rollup::series_name (tag, resolution,
+                                                                      rollup::stats[s]),
+                                                 range, &block_cache);
 
-            // Read size
-            size_t comp_size;
-            in.read (reinterpret_cast<char*> (&comp_size), sizeof (comp_size));
+            // A torn or partly compacted rollup would mix up buckets
+            bool aligned = true;
+            for (int s = 0; s < 3 && aligned; ++s)
+                aligned = columns[s].size () == columns[3].size ();
+            for (size_t i = 0; aligned && i < columns[3].size (); ++i)
+                aligned = columns[0][i].time_ms == columns[3][i].time_ms &&
+                          columns[1][i].time_ms == columns[3][i].time_ms &&
+                          columns[2][i].time_ms == columns[3][i].time_ms;
 
-            // If found tag, read all points into result
-            if (cur_tag == tag)
+            if (!aligned)
             {
-                std::vector<byte_t> compressed_data (comp_size);
-                in.read (reinterpret_cast<char*> (compressed_data.data ()), comp_size);
+                std::cerr << "Rollup columns of " << tag << " disagree in "
+                          << table.get_path () << ", using raw points" << std::endl;
+                table.visit (tag, range, &block_cache, add_columns);
+                continue;
+            }
 
-                Gorilla gorilla;
-                return gorilla.decode (compressed_data, num_pts);
+            for (size_t i = 0; i < columns[3].size (); ++i)
+            {
+                Bucket part;
+                part.min = columns[0][i].value;
+                part.max = columns[1][i].value;
+                part.sum = columns[2][i].value;
+                part.count = static_cast<size_t> (columns[3][i].value);
+                buckets.add_partial (columns[3][i].time_ms, part);
             }
-            else
+        }
+
+        if (sources.frozen)
+            sources.frozen->visit_range (tag, range, add_raw);
+
+        sources.active->visit_range (tag, range, add_raw);
+    }
+
+    /**
+     * Points of tag inside range from every source, ascending by time
+     * limit: max points (0 = all), the newest ones if descending
+     */
+    std::vector<Data> read_series (const tag_t& tag, const TimeRange& range,
+                                   size_t limit, bool descending) const
+    {
+        return read_series (get_sources (), tag, range, limit, descending);
+    }
+
+    /**
+     * read_series over a given view of the sources
+     */
+    std::vector<Data> read_series (const Sources& sources, const tag_t& tag,
+                                   const TimeRange& range, size_t limit, bool descending) const
+    {
+        const auto& [tables, frozen, active] = sources;
+        std::vector<Data> results;
+
+        // Flushed data, files outside the window or without the tag (Bloom
+        // filter) are skipped without touching their index. Oldest source
+        // first like the compactor: level 1, then level 0 by id
+        for (int level : {1, 0})
+            for (const SSTableSet::Entry& entry : tables)
             {
-                // Jump over this block to next tag
-                in.seekg (comp_size, std::ios::cur);
+                const SSTableReader& table = *entry.table;
+                if (entry.level != level || !table.overlaps (range) || !table.may_contain (tag))
+                    continue;
+
+                std::vector<Data> disk_data = table.read (tag, range, &block_cache);
+                trim_to_limit (disk_data, limit, descending);
+                results.insert (results.end (), disk_data.begin (), disk_data.end ());
             }
+
+        // Frozen table holds older points than the active one
+        if (frozen)
+        {
+            std::vector<Data> frozen_data = frozen->get_range (tag, range, limit, descending);
+            results.insert (results.end (), frozen_data.begin (), frozen_data.end ());
         }
 
-        return {};
+        std::vector<Data> recent = active->get_range (tag, range, limit, descending);
+        results.insert (results.end (), recent.begin (), recent.end ());
+
+        // A crash between an SSTable publish and its WAL cleanup replays
+        // points already flushed, newest source wins
+        Compactor::merge_dedup (results);
+
+        // Each source was cut to limit, cut the merge too
+        trim_to_limit (results, limit, descending);
+
+        return results;
+    }
+
+    /**
+     * read_series of every tag, series decoded across threads
+     */
+    std::vector<std::vector<Data>> read_many (const std::vector<tag_t>& tags,
+                                              const TimeRange& range,
+                                              size_t limit, bool descending) const
+    {
+        std::vector<std::vector<Data>> series (tags.size ());
+        size_t workers = std::min<size_t> (std::max (1u, std::thread::hardware_concurrency ()),
+                                           tags.size ());
+
+        std::vector<std::future<void>> tasks;
+        for (size_t w = 0; w < workers; ++w)
+            tasks.push_back (std::async (std::launch::async, [&, w] ()
+            {
+                for (size_t i = w; i < tags.size (); i += workers)
+                    series[i] = read_series (tags[i], range, limit, descending);
+            }));
+
+        for (auto& task : tasks)
+            task.get ();
+
+        return series;
+    }
+
+    /**
+     * One frame of a gorilla /read response, either a chunk referenced in
+     * place in its SSTable mapping or freshly encoded bytes
+     */
+    struct Frame
+    {
+        std::shared_ptr<const SSTableReader> table;  // keeps the mapping alive
+        const byte_t* data {nullptr};                // in the mapping, null if encoded
+        std::vector<byte_t> encoded;
+        size_t size {0};
+        uint64_t count {0};
+        time_t min_ts {0};
+        time_t max_ts {0};
+        uint32_t encoding {wire::encoding_gorilla_v2};
+    };
+
+    /**
+     * Compressed frames of tag inside range from every source, oldest first
+     * SSTable chunks fully inside range are passed through undecoded, only
+     * chunks cut by the range edges and MemTable points get encoded
+     */
+    std::vector<Frame> read_frames (const tag_t& tag, const TimeRange& range) const
+    {
+        Sources sources = get_sources ();
+        std::vector<Frame> frames;
+
+        auto encode = [&] (const Data* points, size_t n)
+        {
+            Gorilla gorilla;
+            for (size_t first = 0; first < n; first += sstable_chunk_points)
+            {
+                std::vector<Data> chunk (points + first,
+                                         points + std::min (first + sstable_chunk_points, n));
+                BitWriter writer;
+                gorilla.encode (chunk, writer);
+                writer.flush ();
+
+                Frame frame;
+                frame.encoded = writer.get_buffer ();
+                frame.size = frame.encoded.size ();
+                frame.count = chunk.size ();
+                frame.min_ts = chunk.front ().time_ms;
+                frame.max_ts = chunk.back ().time_ms;
+                frames.push_back (std::move (frame));
+            }
+        };
+
+        for (const SSTableSet::Entry& entry : sources.tables)
+        {
+            const SSTableReader& table = *entry.table;
+            if (!table.overlaps (range) || !table.may_contain (tag))
+                continue;
+
+            for (const sstable::ChunkEntry* chunk : table.find_chunks (tag, range))
+            {
+                if (range.contains (chunk->min_ts) && range.contains (chunk->max_ts))
+                {
+                    frames.push_back (Frame {entry.table, table.chunk_bytes (*chunk), {},
+                                             chunk->size, chunk->count,
+                                             chunk->min_ts, chunk->max_ts, table.codec ()});
+                    continue;
+                }
+
+                // Straddles an edge, re-encode the part inside
+                BlockCache::block_t block = table.load_chunk (*chunk, &block_cache);
+                std::vector<Data> inside;
+                for (size_t i = 0; i < block->size (); ++i)
+                    if (range.contains (block->ts[i]))
+                        inside.push_back (block->at (i));
+
+                if (!inside.empty ())
+                    encode (inside.data (), inside.size ());
+            }
+        }
+
+        if (sources.frozen)
+            sources.frozen->visit_range (tag, range, encode);
+
+        sources.active->visit_range (tag, range, encode);
+
+        return frames;
     }
 
 public:
     /**
      * Default constructor
      */
-    TSDBServer () : server (), mem_db (), wal (),
-                    batch_id {get_next_batch_id ()}
+    TSDBServer () : server (), wal (),
+                    active_db {std::make_shared<MemTable> ()},
+                    batch_id {get_next_batch_id ()},
+                    compactor (sstables, batch_id) {}
+
+    /**
+     * Load series, SSTables and the WAL from disk, before init_endpoint
+     */
+    bool init_storage ()
     {
-        wal.recover (mem_db);
+        // Before the WAL, its points name series by id, replaying without
+        // them would file points under the wrong series
+        if (!series.open ())
+        {
+            std::cerr << "Error: Could not open series registry " << series_registry_path
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        sstables.load_dir ();
+        wal.recover (*active_db, &series);
+
+        // Without a TAGS file (first start on older data) rebuild it once
+        // from the SSTable indexes
+        if (!tag_index.load (tag_index_path))
+            for (const SSTableSet::Entry& entry : sstables.entries ())
+                for (const auto& [tag, index_entry] : entry.table->get_index ())
+                    tag_index.add (tag);
+
+        tag_index.add_all (active_db->get_tags ());
+        tag_index.add_all (series.get_keys ());
+        tag_index.save (tag_index_path);
+
+        return EXIT_SUCCESS;
     }
 
     /**
@@ -162,29 +640,63 @@ public:
         {
             res.set_header("Access-Control-Allow-Origin", "*");
             
-            std::stringstream package (req.body);
-            std::string part;
-            std::vector<std::string> parts;
-            while (std::getline (package, part, ','))
-                parts.push_back (part);
-
-            // Expect device_tag, timestamp, value
-            if (parts.size () != 3)
-                res.status = httplib::StatusCode::BadRequest_400;
-            else
+            // One "tag,timestamp,value" per line, parsed in a single pass
+            ParseResult parsed = parse_batch (req.body);
+
+            // New series are made durable here, before any WAL record names them
+            if (!series.intern_batch (parsed.points))
             {
-                // Parse package
-                std::string tag = parts[0];
-                time_t time_ms = std::stoll (parts[1]);
-                data_t val = std::stod (parts[2]);
+                res.status = httplib::StatusCode::InternalServerError_500;
+                res.set_content ("could not persist new series", "text/plain");
+                return;
+            }
+
+            if (!parsed.points.empty ())
+            {
+                uint64_t seq;
+                {
+                    std::shared_lock lock (rotate_mutex);
 
-                // Write to disk for durability
-                wal.append (tag, time_ms, val);
-                
-                // Write to memory for availability
-                mem_db.insert (tag, time_ms, val);
+                    // Write to disk for durability, one record group
+                    seq = wal.submit (parsed.points);
+
+                    // Write to memory for availability, one lock per shard
+                    active_db->insert_batch (parsed.points);
+
+                    // Under the lock so the flush of these points saves their tags
+                    tag_index.add_batch (parsed.points);
+                }
+
+                if (!wal.wait (seq))
+                {
+                    res.status = httplib::StatusCode::InternalServerError_500;
+                    res.set_content ("WAL write failed, batch not durable", "text/plain");
+                    return;
+                }
+            }
+
+            if (parsed.errors.empty () && !parsed.points.empty ())
+            {
                 res.set_content ("OK", "text/plain");
+                return;
             }
+
+            // Report rejected lines
+            if (parsed.points.empty ())
+                res.status = httplib::StatusCode::BadRequest_400;
+
+            std::ostringstream oss;
+            oss << "{\"written\":" << parsed.points.size () << ",\"errors\":[";
+            for (size_t i = 0; i < parsed.errors.size (); ++i)
+            {
+                if (i > 0)
+                    oss << ",";
+                oss << "{\"line\":" << parsed.errors[i].line
+                    << ",\"error\":\"" << parsed.errors[i].reason << "\"}";
+            }
+            oss << "]}";
+
+            res.set_content (oss.str (), "application/json");
         });
 
         // Build read endpoint
@@ -193,38 +705,441 @@ public:
         {
             res.set_header("Access-Control-Allow-Origin", "*");
 
-            // TODO: start and end time
-            std::string tag = req.get_param_value ("tag");
-            std::vector<Data> results = mem_db.get_data (tag);
+            // ?tag=&start=&end= (ms, inclusive) &limit=&order=asc|desc
+            std::string tag = get_tag_param (req);
+            TimeRange range;
+            size_t limit = 0;
+            std::string order = req.has_param ("order") ? req.get_param_value ("order")
+                                                        : "asc";
 
-            // Scan all files from db (TODO: optimize)
-            // for (int i = 0; i < batch_id.load (); ++i)
-            // {
-            //     std::string path = get_sstable_path (std::to_string (i));
-            //     std::vector<Data> disk_data = search_sstable (path, tag);
-            //     results.insert (results.end (), disk_data.begin (), disk_data.end ());
-            // }
+            if (!parse_param (req, "start", range.start) ||
+                !parse_param (req, "end", range.end) ||
+                !parse_param (req, "limit", limit) ||
+                (order != "asc" && order != "desc"))
+            {
+                res.status = httplib::StatusCode::BadRequest_400;
+                res.set_content ("bad start/end/limit/order", "text/plain");
+                return;
+            }
 
-            // Format as json
-            std::ostringstream oss;
-            oss << "[\n";
-            
-            for (size_t i = 0; i < results.size (); ++i)
-            {
-                oss << "    {\"ts\": " << results[i].time_ms << ",\n"
-                    << "     \"val\": " << std::fixed << std::setprecision (2) << results[i].value << "\n"
-                    << "    }";
-                
-                // Don't add a comma after the last element
-                if (i < results.size() - 1)
-                    oss << ",";
+            bool descending = order == "desc";
 
-                oss << "\n";
+            // ?format=json|binary|gorilla, else by Accept, json by default
+            std::string format = req.get_param_value ("format");
+            if (format.empty ())
+            {
+                std::string accept = req.get_header_value ("Accept");
+                if (accept.find (wire::gorilla_content_type) != std::string::npos)
+                    format = "gorilla";
+                else if (accept.find (wire::columns_content_type) != std::string::npos)
+                    format = "binary";
+                else
+                    format = "json";
             }
-            
-            oss << "]";
-            
-            res.set_content (oss.str (), "application/json");
+
+            if (format != "json" && format != "binary" && format != "gorilla")
+            {
+                res.status = httplib::StatusCode::BadRequest_400;
+                res.set_content ("bad format, expected json|binary|gorilla", "text/plain");
+                return;
+            }
+
+            // Several series in one request: ?tags=a,b,c, ?match=glob or
+            // ?labels=site=a;type=temp (series carrying all the labels)
+            if (req.has_param ("tags") || req.has_param ("match") || req.has_param ("labels"))
+            {
+                std::vector<tag_t> tags;
+                if (req.has_param ("labels"))
+                {
+                    if (!series.select_keys (req.get_param_value ("labels"), tags))
+                    {
+                        res.status = httplib::StatusCode::BadRequest_400;
+                        res.set_content ("bad labels, expected name;key=value;...",
+                                         "text/plain");
+                        return;
+                    }
+                }
+                else if (req.has_param ("match"))
+                    tags = tag_index.match (req.get_param_value ("match"),
+                                            multi_read_max_series + 1);
+                else
+                {
+                    std::string list = req.get_param_value ("tags");
+                    std::set<tag_t> unique;
+                    for (size_t pos = 0; pos <= list.size ();)
+                    {
+                        size_t comma = std::min (list.find (',', pos), list.size ());
+                        std::string tag;
+                        if (comma > pos && labels::canonicalize (list.substr (pos, comma - pos), tag))
+                            unique.insert (tag);
+                        pos = comma + 1;
+                    }
+                    tags.assign (unique.begin (), unique.end ());
+                }
+
+                if (format != "json" || tags.size () > multi_read_max_series)
+                {
+                    res.status = httplib::StatusCode::BadRequest_400;
+                    res.set_content (format != "json" ? "multi-series reads are json only"
+                                                      : "too many series, narrow the match",
+                                     "text/plain");
+                    return;
+                }
+
+                // {"tag":[points],...}, one series per streamed chunk
+                struct MultiStream
+                {
+                    std::vector<tag_t> tags;
+                    std::vector<std::vector<Data>> series;
+                    bool descending;
+                    size_t next {0};
+                    JsonWriter writer;
+                };
+
+                auto stream = std::make_shared<MultiStream> ();
+                stream->series = read_many (tags, range, limit, descending);
+                stream->tags = std::move (tags);
+                stream->descending = descending;
+
+                res.set_chunked_content_provider ("application/json",
+                    [stream] (size_t, httplib::DataSink& sink)
+                    {
+                        JsonWriter& writer = stream->writer;
+                        writer.clear ();
+
+                        if (stream->next == 0)
+                            writer.raw ("{");
+
+                        if (stream->next < stream->tags.size ())
+                        {
+                            const std::vector<Data>& points = stream->series[stream->next];
+                            if (stream->next > 0)
+                                writer.raw (",");
+                            writer.string (stream->tags[stream->next]);
+                            writer.raw (":[");
+                            for (size_t i = 0; i < points.size (); ++i)
+                            {
+                                if (i > 0)
+                                    writer.raw (",");
+                                writer.point (stream->descending ? points[points.size () - 1 - i]
+                                                                 : points[i]);
+                            }
+                            writer.raw ("]");
+
+                            // Formatted, drop the points
+                            std::vector<Data> ().swap (stream->series[stream->next]);
+                            ++stream->next;
+                        }
+
+                        bool last = stream->next == stream->tags.size ();
+                        if (last)
+                            writer.raw ("}");
+
+                        const std::string& out = writer.get_buffer ();
+                        if (!sink.write (out.data (), out.size ()))
+                            return false;
+
+                        if (last)
+                            sink.done ();
+
+                        return true;
+                    });
+                return;
+            }
+
+            if (format == "gorilla")
+            {
+                // Frames come per source in storage order, limit/desc would
+                // need them decoded
+                if (limit || descending)
+                {
+                    res.status = httplib::StatusCode::BadRequest_400;
+                    res.set_content ("limit/order=desc not supported with format=gorilla",
+                                     "text/plain");
+                    return;
+                }
+
+                struct FrameStream
+                {
+                    std::vector<Frame> frames;
+                    size_t next {0};
+                    std::string buf;
+                };
+
+                auto stream = std::make_shared<FrameStream> ();
+                stream->frames = read_frames (tag, range);
+
+                res.set_chunked_content_provider (wire::gorilla_content_type,
+                    [stream] (size_t, httplib::DataSink& sink)
+                    {
+                        std::string& buf = stream->buf;
+                        buf.clear ();
+
+                        if (stream->next == 0)
+                            buf = wire::gorilla_header ();
+
+                        // Batch small frames, stored bytes go out as they are
+                        const std::vector<Frame>& frames = stream->frames;
+                        while (stream->next < frames.size () && buf.size () < 64 * 1024)
+                        {
+                            const Frame& frame = frames[stream->next++];
+                            buf += wire::frame_header (frame.count, frame.min_ts, frame.max_ts,
+                                                       static_cast<uint32_t> (frame.size),
+                                                       frame.encoding);
+                            const byte_t* bytes = frame.data ? frame.data : frame.encoded.data ();
+                            buf.append (reinterpret_cast<const char*> (bytes), frame.size);
+                        }
+
+                        bool last = stream->next == frames.size ();
+                        if (last)
+                            buf += wire::frame_header (0, 0, 0, 0);
+
+                        if (!sink.write (buf.data (), buf.size ()))
+                            return false;
+
+                        if (last)
+                            sink.done ();
+
+                        return true;
+                    });
+                return;
+            }
+
+            if (format == "binary")
+            {
+                // Timestamp column then value column, json_chunk_points
+                // values per chunk
+                struct ColumnStream
+                {
+                    std::vector<Data> points;
+                    bool descending;
+                    size_t next {0};
+                    std::string buf;
+                };
+
+                auto stream = std::make_shared<ColumnStream> ();
+                stream->points = read_series (tag, range, limit, descending);
+                stream->descending = descending;
+
+                res.set_chunked_content_provider (wire::columns_content_type,
+                    [stream] (size_t, httplib::DataSink& sink)
+                    {
+                        const std::vector<Data>& points = stream->points;
+                        size_t n = points.size ();
+                        std::string& buf = stream->buf;
+                        buf.clear ();
+
+                        if (stream->next == 0)
+                            buf = wire::columns_header (n);
+
+                        // next runs over 2n slots: timestamps, then values
+                        size_t end = std::min (stream->next + json_chunk_points, 2 * n);
+                        for (size_t& i = stream->next; i < end; ++i)
+                        {
+                            size_t row = i < n ? i : i - n;
+                            const Data& point = points[stream->descending ? n - 1 - row : row];
+                            if (i < n)
+                                wire::put_le (buf, static_cast<int64_t> (point.time_ms));
+                            else
+                                wire::put_le (buf, static_cast<double> (point.value));
+                        }
+
+                        bool last = stream->next == 2 * n;
+                        if (!sink.write (buf.data (), buf.size ()))
+                            return false;
+
+                        if (last)
+                            sink.done ();
+
+                        return true;
+                    });
+                return;
+            }
+
+            // Stream as compact json, json_chunk_points per chunk through one
+            // reused buffer, so the text never exists whole
+            struct ReadStream
+            {
+                std::vector<Data> points;
+                bool descending;
+                size_t next {0};
+                JsonWriter writer;
+            };
+
+            auto stream = std::make_shared<ReadStream> ();
+            stream->points = read_series (tag, range, limit, descending);
+            stream->descending = descending;
+            stream->writer.reserve (json_chunk_points * 48);
+
+            res.set_chunked_content_provider ("application/json",
+                [stream] (size_t, httplib::DataSink& sink)
+                {
+                    const std::vector<Data>& points = stream->points;
+                    JsonWriter& writer = stream->writer;
+                    writer.clear ();
+
+                    if (stream->next == 0)
+                        writer.raw ("[");
+
+                    size_t end = std::min (stream->next + json_chunk_points, points.size ());
+                    for (size_t& i = stream->next; i < end; ++i)
+                    {
+                        if (i > 0)
+                            writer.raw (",");
+                        writer.point (stream->descending ? points[points.size () - 1 - i]
+                                                         : points[i]);
+                    }
+
+                    bool last = stream->next == points.size ();
+                    if (last)
+                        writer.raw ("]");
+
+                    if (!sink.write (writer.get_buffer ().data (), writer.get_buffer ().size ()))
+                        return false;
+
+                    if (last)
+                        sink.done ();
+
+                    return true;
+                });
+        });
+
+        // Build query endpoint, aggregates/downsamples inside the server
+        server.Get ("/query", [&] (const httplib::Request& req,
+                                         httplib::Response& res)
+        {
+            res.set_header("Access-Control-Allow-Origin", "*");
+
+            // ?tag=&start=&end= (ms, inclusive)
+            // &step= (ms) &agg=min,max,avg,sum,count,first,last   bucketed
+            // &agg=lttb&points=                                  downsampled
+            std::string tag = get_tag_param (req);
+            std::string agg = req.has_param ("agg") ? req.get_param_value ("agg") : "avg";
+            TimeRange range;
+            time_t step = 0;
+            size_t points = 0;
+
+            if (!parse_param (req, "start", range.start) ||
+                !parse_param (req, "end", range.end) ||
+                !parse_param (req, "step", step) ||
+                !parse_param (req, "points", points))
+            {
+                res.status = httplib::StatusCode::BadRequest_400;
+                res.set_content ("bad start/end/step/points", "text/plain");
+                return;
+            }
+
+            Sources sources = get_sources ();
+            JsonWriter json;
+
+            if (agg == "lttb")
+            {
+                if (points < 3 || points > query_max_buckets)
+                {
+                    res.status = httplib::StatusCode::BadRequest_400;
+                    res.set_content ("lttb needs 3 <= points <= " +
+                                     std::to_string (query_max_buckets), "text/plain");
+                    return;
+                }
+
+                // Open-ended ranges need the series' own bounds first
+                Bucket bounds;
+                if (range.start == TimeRange {}.start || range.end == TimeRange {}.end)
+                    visit_series (sources, tag, range, [&] (const time_t* ts, const data_t* v,
+                                                            size_t n)
+                    {
+                        bounds.add (Data {ts[0], v[0]});
+                        bounds.add (Data {ts[n - 1], v[n - 1]});
+                    });
+
+                LttbSampler sampler (range.start == TimeRange {}.start ? bounds.first.time_ms
+                                                                       : range.start,
+                                     range.end == TimeRange {}.end ? bounds.last.time_ms
+                                                                   : range.end,
+                                     points);
+
+                visit_series (sources, tag, range, [&] (const time_t* ts, const data_t* v,
+                                                        size_t n)
+                              { sampler.add_pass1 (ts, v, n); });
+                sampler.finish_pass1 ();
+                visit_series (sources, tag, range, [&] (const time_t* ts, const data_t* v,
+                                                        size_t n)
+                              { sampler.add_pass2 (ts, v, n); });
+
+                std::vector<Data> sampled = sampler.result ();
+                json.raw ("[");
+                for (size_t i = 0; i < sampled.size (); ++i)
+                {
+                    json.raw (i ? "," : "");
+                    json.point (sampled[i]);
+                }
+                json.raw ("]");
+
+                res.set_content (json.get_buffer (), "application/json");
+                return;
+            }
+
+            std::vector<AggFn> fns;
+            for (size_t pos = 0; pos <= agg.size ();)
+            {
+                size_t comma = std::min (agg.find (',', pos), agg.size ());
+                AggFn fn;
+                if (!parse_agg (std::string_view (agg).substr (pos, comma - pos), fn))
+                {
+                    res.status = httplib::StatusCode::BadRequest_400;
+                    res.set_content ("unknown agg, expected lttb or a list of "
+                                     "min,max,avg,sum,count,first,last", "text/plain");
+                    return;
+                }
+                fns.push_back (fn);
+                pos = comma + 1;
+            }
+
+            if (step <= 0)
+            {
+                res.status = httplib::StatusCode::BadRequest_400;
+                res.set_content ("step (ms) required", "text/plain");
+                return;
+            }
+
+            // Buckets align to start when given, else to the epoch
+            time_t origin = range.start == TimeRange {}.start ? 0 : range.start;
+            BucketAggregator buckets (origin, step, query_max_buckets);
+
+            // Rollups carry no first/last
+            bool rollup_ok = std::none_of (fns.begin (), fns.end (), [] (AggFn fn)
+                                           { return fn == AggFn::first || fn == AggFn::last; });
+            time_t resolution = rollup_ok ? rollup::pick_resolution (step, origin, range) : 0;
+
+            aggregate_series (sources, tag, range, resolution, buckets);
+
+            if (buckets.overflowed ())
+            {
+                res.status = httplib::StatusCode::BadRequest_400;
+                res.set_content ("more than " + std::to_string (query_max_buckets) +
+                                 " buckets, raise step or narrow start/end", "text/plain");
+                return;
+            }
+
+            json.raw ("[");
+            bool first = true;
+            for (const auto& [idx, bucket] : buckets.get_buckets ())
+            {
+                json.raw (first ? "{\"ts\":" : ",{\"ts\":");
+                json.number (static_cast<int64_t> (buckets.bucket_start (idx)));
+                for (AggFn fn : fns)
+                {
+                    json.raw (",\"");
+                    json.raw (agg_name (fn));
+                    json.raw ("\":");
+                    json.number (bucket.get (fn));
+                }
+                json.raw ("}");
+                first = false;
+            }
+            json.raw ("]");
+
+            res.set_content (json.get_buffer (), "application/json");
         });
 
         // Build tags endpoint to list all available tags
@@ -233,26 +1148,100 @@ public:
         {
             res.set_header("Access-Control-Allow-Origin", "*");
 
-            // Get tags from memtable
-            std::set<std::string> tags;
-            
-            // Get tags from memory
-            const std::set<std::string> mem_tags = mem_db.get_tags ();
-            for (const auto& tag : mem_tags)
-                tags.insert (tag);
+            // ?prefix= | ?match=glob (*, ?) | ?regex= (whole tag), &limit=
+            size_t limit = 0;
+            if (!parse_param (req, "limit", limit))
+            {
+                res.status = httplib::StatusCode::BadRequest_400;
+                res.set_content ("bad limit", "text/plain");
+                return;
+            }
+
+            std::vector<tag_t> tags;
+            if (req.has_param ("regex"))
+            {
+                std::regex re;
+                try
+                {
+                    re = std::regex (req.get_param_value ("regex"));
+                }
+                catch (const std::regex_error&)
+                {
+                    res.status = httplib::StatusCode::BadRequest_400;
+                    res.set_content ("bad regex", "text/plain");
+                    return;
+                }
+                tags = tag_index.match_regex (re, limit);
+            }
+            else if (req.has_param ("match"))
+                tags = tag_index.match (req.get_param_value ("match"), limit);
+            else
+                tags = tag_index.match_prefix (req.get_param_value ("prefix"), limit);
 
             // Format as json array
-            std::ostringstream oss;
-            oss << "[";
+            JsonWriter json;
+            json.raw ("[");
+            for (size_t i = 0; i < tags.size (); ++i)
+            {
+                if (i > 0)
+                    json.raw (",");
+                json.string (tags[i]);
+            }
+            json.raw ("]");
+
+            res.set_content (json.get_buffer (), "application/json");
+        });
+
+        // Series ids matching a label query, ?labels=site=a;type=temp
+        server.Get ("/series", [&] (const httplib::Request& req,
+                                          httplib::Response& res)
+        {
+            res.set_header("Access-Control-Allow-Origin", "*");
+
+            std::vector<labels::label_t> matchers;
+            if (!labels::parse (req.get_param_value ("labels"), matchers))
+            {
+                res.status = httplib::StatusCode::BadRequest_400;
+                res.set_content ("bad labels, expected name;key=value;...", "text/plain");
+                return;
+            }
+
+            // [{"id":..,"key":".."}], ascending id
+            JsonWriter json;
+            json.raw ("[");
             bool first = true;
-            for (const auto& tag : tags)
+            for (series_id_t id : series.select (matchers))
             {
-                if (!first) oss << ",";
-                oss << "\"" << tag << "\"";
+                if (!first)
+                    json.raw (",");
+                json.raw ("{\"id\":");
+                json.number (static_cast<int64_t> (id));
+                json.raw (",\"key\":");
+                json.string (series.key_of (id));
+                json.raw ("}");
                 first = false;
             }
-            oss << "]";
-            
+            json.raw ("]");
+
+            res.set_content (json.get_buffer (), "application/json");
+        });
+
+        // Cache counters
+        server.Get ("/stats", [&] (const httplib::Request&, httplib::Response& res)
+        {
+            res.set_header("Access-Control-Allow-Origin", "*");
+
+            BlockCache::Stats stats = block_cache.get_stats ();
+            size_t lookups = stats.hits + stats.misses;
+
+            std::ostringstream oss;
+            oss << "{\"block_cache\":{\"hits\":" << stats.hits
+                << ",\"misses\":" << stats.misses
+                << ",\"hit_rate\":" << (lookups ? double (stats.hits) / lookups : 0.0)
+                << ",\"evictions\":" << stats.evictions
+                << ",\"bytes\":" << stats.bytes
+                << ",\"capacity\":" << stats.capacity << "}}";
+
             res.set_content (oss.str (), "application/json");
         });
 
@@ -268,6 +1257,7 @@ public:
             start_debug_thread ();
 
         start_flush_thread ();
+        start_compaction_thread ();
 
         // Listen
         if (!server.listen (host, port))
@@ -294,6 +1284,9 @@ public:
         
         if (flush_thread.joinable ())
             flush_thread.join ();
+
+        if (compaction_thread.joinable ())
+            compaction_thread.join ();
     }
 };
 
@@ -305,6 +1298,12 @@ int main ()
 {
     TSDBServer tsdb;
 
+    if (tsdb.init_storage () == EXIT_FAILURE)
+    {
+        std::cerr << "Failed to initialize storage" << std::endl;
+        return EXIT_FAILURE;
+    }
+
     if (tsdb.init_endpoint () == EXIT_FAILURE)
     {   
         std::cerr << "Failed to initialize endpoint" << std::endl;
@@ -1,6 +1,21 @@
 #include "gorilla.h"
 #include <iostream>
 #include "types.h"
+#include "memtable.h"
+#include "line_protocol.h"
+#include "wal.h"
+#include "sstable.h"
+#include "compactor.h"
+#include "aggregate.h"
+#include "rollup.h"
+#include "simd_agg.h"
+#include "json_writer.h"
+#include "wire_format.h"
+#include "tag_index.h"
+#include "series.h"
+#include <filesystem>
+#include <thread>
+#include <algorithm>
 
 void test_gorilla_logic ()
 {
@@ -41,27 +56,1189 @@ void test_gorilla_logic ()
         std::cout << "SUCCESS: Gorilla round-trip perfect!" << std::endl;
 }
 
+void test_bit_buffer ()
+{
+    // Reference: plain MSB-first bit list
+    std::vector<bool> bits;
+    std::vector<std::pair<uint64_t, int>> writes;
+    uint64_t state = 88172645463325252ull;
+    for (int i = 0; i < 5000; ++i)
+    {
+        state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+        int count = 1 + static_cast<int> (state % 64);
+        writes.push_back ({state, count});
+        for (int b = count - 1; b >= 0; --b)
+            bits.push_back ((state >> b) & 1);
+    }
+
+    BitWriter writer;
+    for (const auto& [value, count] : writes)
+        writer.write_bits (value, count);
+    writer.flush ();
+
+    std::vector<byte_t> expected ((bits.size () + 7) / 8, 0);
+    for (size_t i = 0; i < bits.size (); ++i)
+        if (bits[i])
+            expected[i / 8] |= 1 << (7 - i % 8);
+
+    BitReader reader (writer.get_buffer ());
+    bool read_ok = true;
+    for (const auto& [value, count] : writes)
+    {
+        uint64_t mask = count == 64 ? ~0ull : (1ull << count) - 1;
+        read_ok = read_ok && reader.read_bits (count) == (value & mask);
+    }
+
+    if (writer.get_buffer () != expected || !read_ok)
+        std::cerr << "FAIL: word-at-a-time bit buffer" << std::endl;
+    else
+        std::cout << "SUCCESS: word-at-a-time bit buffer is bit-compatible" << std::endl;
+}
+
+void test_gorilla_streaming ()
+{
+    std::vector<Data> series;
+    for (time_t t = 0; t < 500; ++t)
+        series.push_back (Data {1000 + t * 10 + (t % 3), 20.0 + (t % 11) * 0.25});
+
+    BitWriter whole;
+    Gorilla ().encode (series, whole);
+    whole.flush ();
+
+    // Appended one at a time, readable mid-stream
+    GorillaEncoder encoder;
+    std::vector<byte_t> prefix;
+    for (size_t i = 0; i < series.size (); ++i)
+    {
+        encoder.append (series[i]);
+        if (i == 99)
+            prefix = encoder.get_bytes ();
+    }
+
+    bool prefix_ok = Gorilla ().decode (prefix, 100).back ().time_ms == series[99].time_ms;
+    bool stream_ok = encoder.size () == 500 && encoder.first_time () == 1000 &&
+                     encoder.last_time () == series.back ().time_ms &&
+                     encoder.finish () == whole.get_buffer () && encoder.size () == 0;
+
+    // Lazy reads: seek, stop early, run off the end
+    GorillaDecoder decoder (whole.get_buffer (), series.size ());
+    Data point;
+    bool seek_ok = decoder.seek_to_time (2005) && decoder.next (point) &&
+                   point.time_ms == series[101].time_ms && point.value == series[101].value &&
+                   decoder.remaining () == 398 && decoder.seek_to_time (2005) == true &&
+                   !decoder.seek_to_time (series.back ().time_ms + 1) &&
+                   !decoder.next (point) && decoder.remaining () == 0;
+
+    if (!prefix_ok || !stream_ok || !seek_ok)
+        std::cerr << "FAIL: streaming gorilla encoder/decoder" << std::endl;
+    else
+        std::cout << "SUCCESS: streaming gorilla encoder/decoder" << std::endl;
+}
+
+void test_gorilla_fuzz ()
+{
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    auto next = [&state] ()
+    {
+        state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+        return state;
+    };
+
+    // Random irregular series: jitter, multi-second gaps, backwards steps,
+    // duplicates and extreme timestamps, every bit pattern as a value
+    size_t failures = 0;
+    for (int round = 0; round < 500; ++round)
+    {
+        std::vector<Data> series;
+        time_t ts = static_cast<time_t> (next ());
+        size_t n = 1 + next () % 300;
+        for (size_t i = 0; i < n; ++i)
+        {
+            uint64_t kind = next () % 8;
+            if (kind < 4)
+                ts += 1000 + static_cast<time_t> (next () % 21) - 10;
+            else if (kind == 4)
+                ts += static_cast<time_t> (next () % 10000000);
+            else if (kind == 5)
+                ts -= static_cast<time_t> (next () % 100000);
+            else if (kind == 6)
+                ts = static_cast<time_t> (next ());
+
+            uint64_t val_bits = next () % 3 ? 0x4035000000000000ull ^ (next () & 0xFFFF) : next ();
+            data_t val;
+            std::memcpy (&val, &val_bits, sizeof (val));
+            series.push_back (Data {ts, val});
+        }
+
+        BitWriter writer;
+        Gorilla ().encode (series, writer);
+        writer.flush ();
+        std::vector<Data> decoded = Gorilla ().decode (writer.get_buffer (), series.size ());
+
+        bool same = decoded.size () == series.size ();
+        for (size_t i = 0; same && i < series.size (); ++i)
+            same = decoded[i].time_ms == series[i].time_ms &&
+                   std::memcmp (&decoded[i].value, &series[i].value, sizeof (data_t)) == 0;
+        failures += !same;
+    }
+
+    // format_v1 streams still decode, 32-bit dods now sign extended
+    std::vector<Data> old_series = {{1000, 1.0}, {2000, 2.0}, {2010, 3.0}, {2020, 4.0}};
+    BitWriter old_writer;
+    Gorilla (gorilla::format_v1).encode (old_series, old_writer);
+    old_writer.flush ();
+    std::vector<Data> old_decoded = Gorilla (gorilla::format_v1).decode (old_writer.get_buffer (), 4);
+
+    // A legacy SSTable (no footer) of the same stream reads back as format_v1
+    std::string path = (std::filesystem::temp_directory_path () /
+                        "tsdb_test_legacy.db").string ();
+    {
+        std::ofstream out (path, std::ios::binary | std::ios::trunc);
+        size_t fields[] = {1, 4, old_writer.get_buffer ().size ()};
+        out.write (reinterpret_cast<const char*> (&fields[0]), sizeof (size_t));
+        out.write ("x", 1);
+        out.write (reinterpret_cast<const char*> (&fields[1]), 2 * sizeof (size_t));
+        out.write (reinterpret_cast<const char*> (old_writer.get_buffer ().data ()),
+                   old_writer.get_buffer ().size ());
+    }
+    std::vector<Data> legacy = SSTableReader (path, 1).read ("x");
+    std::filesystem::remove (path);
+
+    if (failures || old_decoded.size () != 4 || old_decoded[3].time_ms != 2020 ||
+        legacy.size () != 4 || legacy[2].time_ms != 2010)
+        std::cerr << "FAIL: gorilla fuzz, " << failures << " of 500 series corrupted" << std::endl;
+    else
+        std::cout << "SUCCESS: gorilla round-trips 500 random irregular series" << std::endl;
+}
+
+std::string test_sstable_path ()
+{
+    return (std::filesystem::temp_directory_path () / "tsdb_test_sstable.db").string ();
+}
+
+void test_value_codecs ()
+{
+    uint64_t state = 0x2545F4914F6CDD1Dull;
+    auto next = [&state] ()
+    {
+        state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+        return state;
+    };
+
+    // Counter, enum-like, step function and noisy series, 10s apart
+    std::vector<Data> counter, states, steps, noise;
+    for (time_t i = 0; i < 1000; ++i)
+    {
+        time_t ts = 1700000000000 + i * 10000;
+        counter.push_back (Data {ts, static_cast<data_t> (i * 3 + next () % 3)});
+        states.push_back (Data {ts, 0.25 * static_cast<data_t> (next () % 5)});
+        steps.push_back (Data {ts, i < 600 ? 12.5 : -0.5});
+        noise.push_back (Data {ts, static_cast<data_t> (next () % 1000000) / 997.0});
+    }
+
+    auto same = [] (const std::vector<Data>& a, const std::vector<Data>& b)
+    {
+        if (a.size () != b.size ())
+            return false;
+        for (size_t i = 0; i < a.size (); ++i)
+            if (a[i].time_ms != b[i].time_ms ||
+                std::memcmp (&a[i].value, &b[i].value, sizeof (data_t)) != 0)
+                return false;
+        return true;
+    };
+
+    // Every codec that applies round-trips every series
+    bool round_trips = true;
+    for (const std::vector<Data>* series : {&counter, &states, &steps, &noise})
+        for (size_t c = 0; c < codec::codec_count; ++c)
+        {
+            std::vector<byte_t> chunk = codec::encode (static_cast<codec::Codec> (c),
+                                                       series->data (), series->size ());
+            if (!chunk.empty ())
+                round_trips &= same (*series, codec::decode (codec::format_blocks, chunk.data (),
+                                                             chunk.size (), series->size ()));
+        }
+
+    auto best = [] (const std::vector<Data>& series)
+    {
+        std::vector<byte_t> chunk = codec::encode_best (series.data (), series.size ());
+        return codec::codec_of (chunk.data (), chunk.size ());
+    };
+    bool chosen = best (counter) == codec::Codec::delta_int &&
+                  best (states) == codec::Codec::dictionary &&
+                  best (steps) == codec::Codec::rle &&
+                  codec::encode (codec::Codec::delta_int, noise.data (), noise.size ()).empty ();
+
+    // SSTable chunks keep their codec, pre-codec gorilla streams still decode
+    std::string path = (std::filesystem::temp_directory_path () /
+                        "tsdb_test_codecs.db").string ();
+    {
+        SSTableWriter writer (path, 250);
+        writer.add ("counter", counter);
+        writer.add ("noise", noise);
+        writer.finish ();
+    }
+    SSTableReader table (path, 1);
+    bool table_ok = table.codec () == codec::format_blocks &&
+                    same (table.read ("counter"), counter) && same (table.read ("noise"), noise);
+    std::filesystem::remove (path);
+
+    // Flushed gorilla chunks are re-encoded only when the probe finds a
+    // better codec: a noisy start keeps an otherwise integral chunk as is
+    std::vector<Data> mixed (noise.begin (), noise.begin () + sstable_codec_probe_points);
+    mixed.insert (mixed.end (), counter.begin () + sstable_codec_probe_points, counter.end ());
+    auto flushed = [] (const std::vector<Data>& series)
+    {
+        BitWriter stream;
+        Gorilla ().encode (series, stream);
+        stream.flush ();
+
+        sstable::Block block (series.size ());
+        block.add_encoded ("s", stream.get_buffer ().data (), stream.get_buffer ().size (),
+                           series.size (), series.front ().time_ms, series.back ().time_ms);
+        const sstable::ChunkEntry& chunk = block.get_chunks ().front ().second;
+        return codec::codec_of (block.get_bytes ().data () + chunk.offset, chunk.size);
+    };
+    bool flush_ok = flushed (counter) == codec::Codec::delta_int &&
+                    flushed (steps) == codec::Codec::rle &&
+                    flushed (noise) == codec::Codec::gorilla &&
+                    flushed (mixed) == codec::Codec::gorilla;
+
+    BitWriter old_writer;
+    Gorilla ().encode (noise, old_writer);
+    old_writer.flush ();
+    bool old_ok = same (codec::decode (gorilla::format_v2, old_writer.get_buffer ().data (),
+                                       old_writer.get_buffer ().size (), noise.size ()), noise);
+
+    if (!round_trips || !chosen || !table_ok || !flush_ok || !old_ok)
+        std::cerr << "FAIL: value codecs" << std::endl;
+    else
+        std::cout << "SUCCESS: value codecs round-trip and the chooser picks the smallest" << std::endl;
+}
+
 void test_cold_store ()
 {
-    std::cout << "FAIL" << std::endl;
+    MemTable mem_db;
+    for (time_t t = 0; t < 1000; ++t)
+    {
+        mem_db.insert ("a", 1000 + t, t * 0.5);
+        mem_db.insert ("b", 5000 + t, 7.0);
+    }
+    mem_db.flush_to (test_sstable_path ());
+
+    SSTableReader table (test_sstable_path (), 1);
+    const sstable::index_t& index = table.get_index ();
+
+    if (index.size () != 2 || index.at ("a").count != 1000 ||
+        index.at ("a").min_ts != 1000 || index.at ("a").max_ts != 1999 ||
+        index.at ("b").min_ts != 5000 || !table.overlaps (TimeRange {1500, 1600}) ||
+        table.overlaps (TimeRange {7000, 8000}))
+        std::cerr << "FAIL: SSTable index/footer" << std::endl;
+    else
+        std::cout << "SUCCESS: SSTable index/footer" << std::endl;
 }
 
 void test_mem_get ()
 {
-    std::cout << "FAIL" << std::endl;
+    MemTable mem_db;
+    batch_t batch =
+    {
+        {"a", {1000, 1.0}}, {"b", {1000, 2.0}}, {"a", {1001, 3.0}}
+    };
+    mem_db.insert_batch (batch);
+    mem_db.insert ("b", 1001, 4.0);
+
+    std::vector<Data> a = mem_db.get_data ("a");
+    std::vector<Data> b = mem_db.get_data ("b");
+
+    if (mem_db.get_total_count () != 4 || a.size () != 2 || b.size () != 2 ||
+        a[1].value != 3.0 || b[1].time_ms != 1001)
+        std::cerr << "FAIL: MemTable batch insert/get" << std::endl;
+    else
+        std::cout << "SUCCESS: MemTable batch insert/get" << std::endl;
+}
+
+void test_mem_range ()
+{
+    MemTable mem_db;
+    for (time_t t = 0; t < 100; t += 10)
+        mem_db.insert ("r", t, static_cast<data_t> (t));
+
+    // Late point lands in order
+    mem_db.insert ("r", 45, 45.0);
+
+    TimeRange range {20, 50};
+    std::vector<Data> all = mem_db.get_range ("r", range);
+    std::vector<Data> first = mem_db.get_range ("r", range, 2);
+    std::vector<Data> last = mem_db.get_range ("r", range, 2, true);
+
+    if (all.size () != 5 || all[3].time_ms != 45 ||
+        first.size () != 2 || first[0].time_ms != 20 ||
+        last.size () != 2 || last[0].time_ms != 45 || last[1].time_ms != 50 ||
+        !mem_db.get_range ("r", TimeRange {101, 200}).empty ())
+        std::cerr << "FAIL: MemTable range query" << std::endl;
+    else
+        std::cout << "SUCCESS: MemTable range query" << std::endl;
+}
+
+bool same_points (const std::vector<Data>& a, const std::vector<Data>& b)
+{
+    return std::equal (a.begin (), a.end (), b.begin (), b.end (), [] (const Data& x, const Data& y)
+                       { return x.time_ms == y.time_ms && x.value == y.value; });
+}
+
+void test_compressed_memtable ()
+{
+    std::string path = (std::filesystem::temp_directory_path () /
+                        "tsdb_test_compressed.db").string ();
+    MemTable raw (MemTableMode::raw);
+    MemTable packed (MemTableMode::compressed);
+
+    // Enough points to seal chunks, plus late points into sealed, open and tail
+    for (time_t t = 0; t < 3000; ++t)
+    {
+        raw.insert ("s", t * 10, 20.0 + (t % 7));
+        packed.insert ("s", t * 10, 20.0 + (t % 7));
+    }
+    for (time_t t : {55, 15005, 29995})
+    {
+        raw.insert ("s", t, -1.0);
+        packed.insert ("s", t, -1.0);
+    }
+
+    TimeRange range {10000, 20000};
+    std::vector<Data> window = raw.get_range ("s", range);
+    std::vector<Data> newest (window.end () - 100, window.end ());
+    bool reads = same_points (raw.get_range ("s", range, 100, true), newest) &&
+                 same_points (packed.get_range ("s", range, 100, true), newest) &&
+                 same_points (packed.get_data ("s"), raw.get_data ("s")) &&
+                 same_points (packed.get_range ("s", range), raw.get_range ("s", range)) &&
+                 same_points (packed.get_range ("s", range, 100), raw.get_range ("s", range, 100)) &&
+                 same_points (packed.get_range ("s", range, 1500, true),
+                              raw.get_range ("s", range, 1500, true)) &&
+                 same_points (packed.get_range ("s", TimeRange {}, 10, true),
+                              raw.get_range ("s", TimeRange {}, 10, true)) &&
+                 packed.get_count ("s") == 3003;
+
+    packed.flush_to (path);
+    SSTableReader table (path, 1);
+    bool flushed = same_points (table.read ("s"), raw.get_data ("s")) &&
+                   table.get_index ().at ("s").chunks.size () >= 2;
+    std::filesystem::remove (path);
+
+    if (!reads || !flushed || packed.get_bytes () * 4 > raw.get_bytes ())
+        std::cerr << "FAIL: compressed MemTable (" << packed.get_bytes () << " vs "
+                  << raw.get_bytes () << " bytes)" << std::endl;
+    else
+        std::cout << "SUCCESS: compressed MemTable matches raw in "
+                  << packed.get_bytes () << "/" << raw.get_bytes () << " bytes" << std::endl;
+}
+
+void test_parallel_flush ()
+{
+    std::string path = (std::filesystem::temp_directory_path () /
+                        "tsdb_test_parallel_flush.db").string ();
+    std::string rollup_path = (std::filesystem::temp_directory_path () /
+                               "tsdb_test_parallel_flush_rollup.db").string ();
+
+    // Enough series for every worker, some with sealed chunks
+    size_t series_count = 40 * memtable_parallel_flush_series;
+    MemTable mem;
+    for (size_t s = 0; s < series_count; ++s)
+    {
+        size_t points = s % 10 == 0 ? 3000 : 100 + s % 50;
+        for (size_t t = 0; t < points; ++t)
+            mem.insert ("series_" + std::to_string (s), t * 1000, static_cast<data_t> (s + t % 13));
+    }
+
+    bool renamed = mem.flush_to (path, rollup_path) &&
+                   !std::filesystem::exists (path + ".tmp") &&
+                   !std::filesystem::exists (rollup_path + ".tmp");
+
+    // A failed write reports it and leaves nothing behind
+    std::string bad_path = (std::filesystem::temp_directory_path () /
+                            "tsdb_no_such_dir" / "x.db").string ();
+    bool refused = !mem.flush_to (bad_path, rollup_path + "2") &&
+                   !std::filesystem::exists (rollup_path + "2");
+
+    SSTableReader table (path, 1);
+    SSTableReader rollups (rollup_path, 2);
+    bool all_read = table.get_index ().size () == series_count &&
+                    rollups.get_index ().size () == series_count * std::size (rollup_resolutions_ms) * 4;
+    for (size_t s = 0; all_read && s < series_count; s += 7)
+    {
+        std::string tag = "series_" + std::to_string (s);
+        all_read = same_points (table.read (tag), mem.get_data (tag));
+    }
+
+    // Chunks laid out in tag order, one sequential run
+    uint64_t expected_offset = 0;
+    bool in_order = true;
+    for (const auto& [tag, entry] : table.get_index ())
+        for (const sstable::ChunkEntry& chunk : entry.chunks)
+        {
+            in_order &= chunk.offset == expected_offset;
+            expected_offset = chunk.offset + chunk.size;
+        }
+
+    std::filesystem::remove (path);
+    std::filesystem::remove (rollup_path);
+
+    if (!renamed || !refused || !all_read || !in_order)
+        std::cerr << "FAIL: parallel flush" << std::endl;
+    else
+        std::cout << "SUCCESS: parallel flush writes " << series_count
+                  << " series in tag order" << std::endl;
+}
+
+void test_parse_batch ()
+{
+    ParseResult parsed = parse_batch ("temp,1000,25.5\r\n"
+                                      "\n"
+                                      "temp,1001\n"
+                                      "noise,abc,1\n"
+                                      "encoder,1002,-3e2");
+
+    if (parsed.points.size () != 2 || parsed.errors.size () != 2 ||
+        parsed.errors[0].line != 3 || parsed.errors[1].line != 4 ||
+        parsed.points[1].tag != "encoder" || parsed.points[1].data.value != -300.0)
+        std::cerr << "FAIL: batch parse" << std::endl;
+    else
+        std::cout << "SUCCESS: batch parse with per-line errors" << std::endl;
 }
 
 void test_cold_get ()
 {
-    std::cout << "FAIL" << std::endl;
+    SSTableReader table (test_sstable_path (), 1);
+
+    std::vector<Data> all = table.read ("a");
+    std::vector<Data> window = table.read ("a", TimeRange {1100, 1109});
+    std::vector<Data> outside = table.read ("b", TimeRange {0, 4999});
+    std::filesystem::remove (test_sstable_path ());
+
+    if (all.size () != 1000 || all[999].value != 499.5 || window.size () != 10 ||
+        window[0].time_ms != 1100 || !outside.empty () || !table.read ("c").empty ())
+        std::cerr << "FAIL: SSTable range read" << std::endl;
+    else
+        std::cout << "SUCCESS: SSTable range read" << std::endl;
+}
+
+void test_mem_shards ()
+{
+    MemTable mem_db;
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 4; ++t)
+        writers.emplace_back ([&mem_db, t] ()
+        {
+            for (int i = 0; i < 1000; ++i)
+                mem_db.insert ("device_" + std::to_string (i % 50), i, t);
+        });
+
+    for (std::thread& writer : writers)
+        writer.join ();
+
+    size_t tags = mem_db.get_tags ().size ();
+    table_t snapshot = mem_db.extract ();
+
+    size_t extracted = 0;
+    for (const auto& [tag, data] : snapshot)
+        extracted += data.size ();
+
+    if (tags != 50 || snapshot.size () != 50 || extracted != 4000 ||
+        mem_db.get_total_count () != 0 || !mem_db.get_tags ().empty ())
+        std::cerr << "FAIL: sharded MemTable extract" << std::endl;
+    else
+        std::cout << "SUCCESS: sharded MemTable extract" << std::endl;
+}
+
+void test_wal_group_commit ()
+{
+    std::string dir = (std::filesystem::temp_directory_path () /
+                       "tsdb_test_wal/").string ();
+    std::filesystem::remove_all (dir);
+
+    {
+        WAL wal (dir, WalSync::group_commit);
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 4; ++t)
+            writers.emplace_back ([&wal, t] ()
+            {
+                for (int i = 0; i < 100; ++i)
+                    wal.append ("w" + std::to_string (t), i, t);
+            });
+
+        for (std::thread& writer : writers)
+            writer.join ();
+    }
+
+    MemTable mem_db;
+    WAL (dir, WalSync::async).recover (mem_db);
+    std::filesystem::remove_all (dir);
+
+    // A segment on a full disk fails its waiters, and every write after
+    bool reported = true;
+    if (std::filesystem::exists ("/dev/full"))
+    {
+        WAL wal (dir, WalSync::group_commit);
+        bool before = wal.append ("ok", 1, 1.0);
+        std::filesystem::create_symlink ("/dev/full", dir + "wal_2.wal");
+        wal.rotate ();
+        reported = before && !wal.append ("lost", 2, 2.0) && !wal.append ("lost", 3, 3.0);
+    }
+    std::filesystem::remove_all (dir);
+
+    if (mem_db.get_total_count () != 400 || mem_db.get_count ("w3") != 100 || !reported)
+        std::cerr << "FAIL: WAL group commit recovered "
+                  << mem_db.get_total_count () << " points" << std::endl;
+    else
+        std::cout << "SUCCESS: WAL group commit round-trip" << std::endl;
+}
+
+void test_wal_rotate ()
+{
+    std::string dir = (std::filesystem::temp_directory_path () /
+                       "tsdb_test_wal_rotate/").string ();
+    std::filesystem::remove_all (dir);
+
+    {
+        WAL wal (dir, WalSync::group_commit);
+        wal.append ("old", 1, 1.0);
+        uint64_t next = wal.rotate ();
+        wal.append ("new", 2, 2.0);
+
+        // Old generation is flushed, its segment goes away
+        wal.remove_segments_before (next);
+    }
+
+    MemTable mem_db;
+    WAL (dir, WalSync::async).recover (mem_db);
+    std::filesystem::remove_all (dir);
+
+    if (mem_db.get_count ("old") != 0 || mem_db.get_count ("new") != 1)
+        std::cerr << "FAIL: WAL rotate keeps only live segments" << std::endl;
+    else
+        std::cout << "SUCCESS: WAL rotate keeps only live segments" << std::endl;
+}
+
+void test_wal_torn_tail ()
+{
+    std::string dir = (std::filesystem::temp_directory_path () /
+                       "tsdb_test_wal_torn/").string ();
+    std::filesystem::remove_all (dir);
+
+    // Tiny segments so recovery spans many files
+    {
+        WAL wal (dir, WalSync::every_write, std::chrono::milliseconds {0}, 256);
+        for (int i = 0; i < 100; ++i)
+            wal.append ("s", i, i);
+    }
+
+    // Tear the last segment and one in the middle mid-record
+    std::vector<std::filesystem::path> segments;
+    for (const auto& entry : std::filesystem::directory_iterator (dir))
+        segments.push_back (entry.path ());
+    std::sort (segments.begin (), segments.end (),
+               [] (const auto& a, const auto& b)
+               {
+                   return std::stoull (a.stem ().string ().substr (4)) <
+                          std::stoull (b.stem ().string ().substr (4));
+               });
+    for (const std::filesystem::path& torn : {segments[segments.size () / 2], segments.back ()})
+        std::filesystem::resize_file (torn, std::filesystem::file_size (torn) - 3);
+
+    MemTable mem_db;
+    WAL (dir, WalSync::async).recover (mem_db);
+    std::filesystem::remove_all (dir);
+
+    // One record lost per torn segment, the segments after them replay
+    std::vector<Data> data = mem_db.get_data ("s");
+    bool ordered = !data.empty () && data.back ().time_ms == 98;
+    for (size_t i = 1; i < data.size (); ++i)
+        ordered = ordered && data[i].time_ms > data[i - 1].time_ms;
+
+    if (segments.size () < 3 || data.size () != 98 || !ordered)
+        std::cerr << "FAIL: WAL torn tail recovered " << data.size ()
+                  << " points" << std::endl;
+    else
+        std::cout << "SUCCESS: WAL parallel recovery skips torn records, not later segments" << std::endl;
+}
+
+void test_sstable_chunks ()
+{
+    std::string path = (std::filesystem::temp_directory_path () /
+                        "tsdb_test_chunks.db").string ();
+    std::vector<Data> series;
+    for (time_t t = 0; t < 1000; ++t)
+        series.push_back (Data {t * 10, static_cast<data_t> (t)});
+
+    SSTableWriter writer (path, 100);
+    writer.add ("c", series);
+    writer.finish ();
+
+    SSTableReader table (path, 1);
+    std::vector<const sstable::ChunkEntry*> hit = table.find_chunks ("c", TimeRange {995, 2005});
+    std::vector<Data> window = table.read ("c", TimeRange {995, 2005});
+    std::vector<Data> all = table.read ("c");
+    std::filesystem::remove (path);
+
+    if (table.get_index ().at ("c").chunks.size () != 10 || hit.size () != 2 ||
+        window.size () != 101 || window.front ().time_ms != 1000 ||
+        window.back ().time_ms != 2000 || all.size () != 1000 || all[999].value != 999)
+        std::cerr << "FAIL: SSTable chunked read" << std::endl;
+    else
+        std::cout << "SUCCESS: SSTable chunked read decodes only overlapping chunks" << std::endl;
+}
+
+void test_compaction ()
+{
+    std::string dir = (std::filesystem::temp_directory_path () /
+                       "tsdb_test_compaction/").string ();
+    std::filesystem::remove_all (dir);
+
+    SSTableSet sstables;
+    sstables.load_dir (dir);
+    std::atomic<size_t> next_id {1};
+
+    // 4 overlapping flushes over two 1000 ms partitions, t=500 rewritten
+    for (int f = 0; f < 4; ++f)
+    {
+        size_t id = next_id.fetch_add (1);
+        std::vector<Data> series;
+        for (time_t t = f * 400; t < f * 400 + 500; t += 10)
+            series.push_back (Data {t, static_cast<data_t> (f)});
+
+        SSTableWriter writer (sstables.path_for (id));
+        writer.add ("c", series);
+        writer.finish ();
+        sstables.add (std::make_shared<const SSTableReader> (sstables.path_for (id), id));
+    }
+
+    Compactor compactor (sstables, next_id, 4, 1000, 0);
+
+    // First output can't be renamed into place, the inputs must survive
+    std::string blocker = sstables.path_for (next_id.load ());
+    std::filesystem::create_directories (std::filesystem::path (blocker) / "block");
+    bool kept = !compactor.maybe_compact () && sstables.entries ().size () == 4;
+    for (size_t id = 1; id <= 4; ++id)
+        kept = kept && std::filesystem::exists (sstables.path_for (id));
+    std::filesystem::remove_all (blocker);
+
+    // Nor can the MANIFEST be swapped, the old one and the inputs stay
+    std::string manifest_blocker = dir + "MANIFEST.tmp";
+    std::filesystem::create_directories (std::filesystem::path (manifest_blocker) / "block");
+    kept = kept && !compactor.maybe_compact () && sstables.entries ().size () == 4 &&
+           !sstables.add (std::make_shared<const SSTableReader> (sstables.path_for (1), 1));
+    for (size_t id = 1; id <= 4; ++id)
+        kept = kept && std::filesystem::exists (sstables.path_for (id));
+    std::filesystem::remove_all (manifest_blocker);
+
+    bool ran = compactor.maybe_compact ();
+
+    // Reload from the manifest like a restart
+    SSTableSet reloaded;
+    reloaded.load_dir (dir);
+    std::vector<SSTableSet::Entry> entries = reloaded.entries ();
+
+    std::vector<Data> merged;
+    for (const SSTableSet::Entry& entry : entries)
+    {
+        std::vector<Data> points = entry.table->read ("c");
+        merged.insert (merged.end (), points.begin (), points.end ());
+    }
+    // 2 tables + their rollups + MANIFEST
+    size_t files = std::distance (std::filesystem::directory_iterator (dir),
+                                  std::filesystem::directory_iterator {});
+    std::filesystem::remove_all (dir);
+
+    auto at = [&] (time_t t)
+    {
+        for (const Data& d : merged)
+            if (d.time_ms == t)
+                return d.value;
+        return data_t {-1};
+    };
+
+    bool levels = entries.size () == 2 && entries[0].level == 1 && entries[1].level == 1 &&
+                  entries[0].rollup && entries[1].rollup;
+    if (!kept || !ran || !levels || files != 5 || merged.size () != 170 ||
+        at (0) != 0 || at (450) != 1 || at (850) != 2 || at (1999) != -1 || at (1690) != 3)
+        std::cerr << "FAIL: Compaction produced " << entries.size () << " tables, "
+                  << merged.size () << " points" << std::endl;
+    else
+        std::cout << "SUCCESS: Compaction merges into deduplicated time partitions" << std::endl;
+}
+
+void test_sstable_bloom ()
+{
+    std::string path = (std::filesystem::temp_directory_path () /
+                        "tsdb_test_bloom.db").string ();
+    {
+        SSTableWriter writer (path);
+        for (int i = 0; i < 1000; ++i)
+            writer.add ("present_" + std::to_string (i), {Data {i, 1.0}});
+        writer.finish ();
+    }
+
+    SSTableReader table (path, 1);
+    bool no_false_negatives = true;
+    for (int i = 0; i < 1000; ++i)
+        no_false_negatives = no_false_negatives && table.may_contain ("present_" + std::to_string (i));
+
+    size_t false_positives = 0;
+    for (int i = 0; i < 10000; ++i)
+        false_positives += table.may_contain ("absent_" + std::to_string (i));
+
+    bool reads = table.read ("present_7").size () == 1 && table.read ("absent_7").empty () &&
+                 table.overlaps (TimeRange {999, 2000}) && !table.overlaps (TimeRange {1000, 2000});
+    std::filesystem::remove (path);
+
+    // Configured for 1%, allow slack
+    if (!no_false_negatives || false_positives > 300 || !reads)
+        std::cerr << "FAIL: SSTable Bloom filter, " << false_positives
+                  << " false positives in 10000" << std::endl;
+    else
+        std::cout << "SUCCESS: SSTable Bloom filter skips absent tags ("
+                  << false_positives << "/10000 false positives)" << std::endl;
+}
+
+void test_block_cache ()
+{
+    std::string path = (std::filesystem::temp_directory_path () /
+                        "tsdb_test_cache.db").string ();
+    std::vector<Data> series;
+    for (time_t t = 0; t < 1000; ++t)
+        series.push_back (Data {t, static_cast<data_t> (t)});
+
+    SSTableWriter writer (path, 100);
+    writer.add ("c", series);
+    writer.finish ();
+
+    SSTableReader table (path, 1);
+    BlockCache cache (1 << 20);
+    std::vector<Data> cold = table.read ("c", TimeRange {150, 349}, &cache);
+    std::vector<Data> warm = table.read ("c", TimeRange {150, 349}, &cache);
+    BlockCache::Stats stats = cache.get_stats ();
+    std::filesystem::remove (path);
+
+    // Tiny budget: 16 shards of ~1 block each, old blocks must go
+    BlockCache small (16 * 1000);
+    for (uint64_t i = 0; i < 100; ++i)
+    {
+        Columns block;
+        block.ts.resize (50);
+        block.values.resize (50);
+        small.put (BlockCache::Key {1, i}, std::make_shared<const Columns> (block));
+    }
+    BlockCache::Stats small_stats = small.get_stats ();
+
+    if (cold.size () != 200 || warm.size () != 200 || warm.front ().time_ms != 150 ||
+        stats.misses != 3 || stats.hits != 3 || small_stats.evictions == 0 ||
+        small_stats.bytes > small_stats.capacity)
+        std::cerr << "FAIL: block cache " << stats.hits << " hits, " << stats.misses
+                  << " misses" << std::endl;
+    else
+        std::cout << "SUCCESS: block cache serves repeated chunk reads" << std::endl;
+}
+
+void test_aggregate ()
+{
+    // Two overlapping sources, as from an SSTable and the MemTable
+    std::vector<Data> older, newer;
+    for (time_t t = 0; t < 100; ++t)
+        older.push_back (Data {t, static_cast<data_t> (t)});
+    for (time_t t = 95; t < 120; ++t)
+        newer.push_back (Data {t, static_cast<data_t> (t) * 2});
+
+    BucketAggregator buckets (0, 50, 100);
+    buckets.add (older.data (), older.size ());
+    buckets.add (newer.data (), newer.size ());
+    const std::map<time_t, Bucket>& b = buckets.get_buckets ();
+
+    BucketAggregator capped (0, 1, 10);
+    capped.add (older.data (), older.size ());
+
+    // LTTB keeps the ends plus the spike
+    std::vector<Data> wave;
+    for (time_t t = 0; t < 1000; ++t)
+        wave.push_back (Data {t, t == 500 ? 100.0 : 0.0});
+
+    LttbSampler sampler (0, 999, 10);
+    sampler.add_pass1 (wave.data (), wave.size ());
+    sampler.finish_pass1 ();
+    sampler.add_pass2 (wave.data (), wave.size ());
+    std::vector<Data> sampled = sampler.result ();
+    bool spike = std::any_of (sampled.begin (), sampled.end (),
+                              [] (const Data& d) { return d.time_ms == 500; });
+
+    if (b.size () != 3 || b.at (0).get (AggFn::avg) != 24.5 ||
+        b.at (1).get (AggFn::count) != 55 || b.at (1).get (AggFn::max) != 198 ||
+        b.at (1).get (AggFn::first) != 50 || b.at (1).get (AggFn::last) != 198 ||
+        b.at (2).get (AggFn::sum) != 2 * (100 + 119) * 10 || !capped.overflowed () ||
+        sampled.size () != 10 || sampled.front ().time_ms != 0 ||
+        sampled.back ().time_ms != 999 || !spike)
+        std::cerr << "FAIL: bucket aggregation / LTTB" << std::endl;
+    else
+        std::cout << "SUCCESS: bucket aggregation and LTTB downsampling" << std::endl;
+}
+
+void test_rollups ()
+{
+    std::string path = (std::filesystem::temp_directory_path () /
+                        "sstable_rollup_test.db").string ();
+    std::string rollup_path = rollup::path_for (path);
+
+    MemTable mem_db;
+    batch_t batch;
+    for (time_t t = 0; t < 130000; t += 10)
+        batch.push_back (Point {"r", Data {t, static_cast<data_t> (t % 1000)}});
+    mem_db.insert_batch (batch);
+    mem_db.flush_to (path, rollup_path);
+
+    SSTableReader raw (path, 1);
+    SSTableReader rollups (rollup_path, 1);
+
+    // Same 1 minute buckets from raw points and from the 1s rollup
+    BucketAggregator from_raw (0, 60000, 100);
+    raw.visit ("r", TimeRange {}, nullptr, [&] (const time_t* ts, const data_t* v, size_t n)
+               { from_raw.add (ts, v, n); });
+
+    BucketAggregator from_rollup (0, 60000, 100);
+    std::vector<Data> columns[4];
+    for (int s = 0; s < 4; ++s)
+        columns[s] = rollups.read (rollup::series_name ("r", 1000, rollup::stats[s]));
+    for (size_t i = 0; i < columns[3].size (); ++i)
+    {
+        Bucket part;
+        part.min = columns[0][i].value;
+        part.max = columns[1][i].value;
+        part.sum = columns[2][i].value;
+        part.count = static_cast<size_t> (columns[3][i].value);
+        from_rollup.add_partial (columns[3][i].time_ms, part);
+    }
+
+    bool same = from_raw.get_buckets ().size () == 3 &&
+                from_rollup.get_buckets ().size () == 3;
+    for (const auto& [idx, bucket] : from_raw.get_buckets ())
+    {
+        const Bucket& other = from_rollup.get_buckets ().at (idx);
+        same = same && bucket.count == other.count && bucket.sum == other.sum &&
+               bucket.min == other.min && bucket.max == other.max;
+    }
+
+    size_t hourly = rollups.read (rollup::series_name ("r", 3600000, "count")).size ();
+
+    // A table and its rollup share the id and chunk offsets, cached blocks
+    // of one must never answer reads of the other
+    std::string dir = (std::filesystem::temp_directory_path () /
+                       "tsdb_test_rollup_cache/").string ();
+    std::filesystem::remove_all (dir);
+    SSTableSet set;
+    set.load_dir (dir);
+    mem_db.flush_to (set.path_for (1), set.rollup_path_for (1));
+    set.add (std::make_shared<const SSTableReader> (set.path_for (1), 1));
+    SSTableSet::Entry entry = set.entries ().front ();
+
+    BlockCache cache;
+    bool cached_apart = entry.rollup != nullptr;
+    if (cached_apart)
+    {
+        for (const auto& [name, index_entry] : entry.rollup->get_index ())
+            entry.rollup->read (name, TimeRange {}, &cache);
+        cached_apart = same_points (entry.table->read ("r", TimeRange {}, &cache), raw.read ("r")) &&
+                       cache.get_stats ().misses >= 2;
+    }
+
+    std::filesystem::remove_all (dir);
+    std::filesystem::remove (path);
+    std::filesystem::remove (rollup_path);
+
+    bool picks = rollup::pick_resolution (60000, 0, TimeRange {}) == 60000 &&
+                 rollup::pick_resolution (90000, 0, TimeRange {}) == 1000 &&
+                 rollup::pick_resolution (500, 0, TimeRange {}) == 0 &&
+                 rollup::pick_resolution (60000, 0, TimeRange {0, 59999}) == 60000 &&
+                 rollup::pick_resolution (60000, 0, TimeRange {0, 60000}) == 0;
+
+    if (!same || columns[3].size () != 130 || hourly != 1 || !picks || !cached_apart)
+        std::cerr << "FAIL: rollups disagree with raw aggregation" << std::endl;
+    else
+        std::cout << "SUCCESS: flush rollups match raw aggregation" << std::endl;
+}
+
+void test_simd_kernels ()
+{
+    Columns columns;
+    uint64_t state = 88172645463325252ull;
+    for (time_t t = 0; t < 1003; ++t)
+    {
+        state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+        columns.push_back (Data {static_cast<time_t> (state % 2000) - 500,
+                                 static_cast<data_t> (state % 10000) / 8.0});
+    }
+
+    const time_t* ts = columns.ts.data ();
+    const data_t* values = columns.values.data ();
+    simd::Summary want = simd::scalar::summarize (values, columns.size ());
+    simd::Summary want_range = simd::scalar::summarize_range (ts, values, columns.size (), -100, 700);
+
+    // Every Isa this CPU runs, on every tail length
+    bool same = true;
+    for (int isa = 0; isa <= static_cast<int> (simd::best_isa ()); ++isa)
+        for (size_t n : {size_t {0}, size_t {1}, size_t {7}, columns.size ()})
+        {
+            simd::Isa which = static_cast<simd::Isa> (isa);
+            simd::Summary got = simd::summarize (values, n, which);
+            simd::Summary got_range = simd::summarize_range (ts, values, n, -100, 700, which);
+            simd::Summary ref = simd::scalar::summarize (values, n);
+            simd::Summary ref_range = simd::scalar::summarize_range (ts, values, n, -100, 700);
+
+            same = same && got.count == ref.count && got.min == ref.min &&
+                   got.max == ref.max && std::abs (got.sum - ref.sum) < 1e-6 &&
+                   got_range.count == ref_range.count && got_range.min == ref_range.min &&
+                   got_range.max == ref_range.max &&
+                   std::abs (got_range.sum - ref_range.sum) < 1e-6;
+        }
+
+    if (!same || want.count != 1003 || want_range.count == 0 || want_range.count == 1003)
+        std::cerr << "FAIL: SIMD kernels disagree with scalar" << std::endl;
+    else
+        std::cout << "SUCCESS: SIMD kernels match scalar (best: "
+                  << simd::isa_name (simd::best_isa ()) << ")" << std::endl;
+}
+
+void test_json_writer ()
+{
+    JsonWriter json;
+    json.raw ("[");
+    json.point (Data {1700000000123, 0.1});
+    json.raw (",");
+    json.point (Data {-5, 1e300});
+    json.raw (",");
+    json.number (std::numeric_limits<double>::quiet_NaN ());
+    json.raw (",");
+    json.string ("a\"b\\c\n");
+    json.raw ("]");
+
+    // Round trip: shortest form parses back to the same double
+    double third = 1.0 / 3.0;
+    JsonWriter exact;
+    exact.number (third);
+    bool round_trip = std::stod (exact.get_buffer ()) == third;
+
+    std::string want = "[{\"ts\":1700000000123,\"val\":0.1},{\"ts\":-5,\"val\":1e+300},"
+                       "null,\"a\\\"b\\\\c\\u000a\"]";
+    if (json.get_buffer () != want || !round_trip)
+        std::cerr << "FAIL: JSON writer produced " << json.get_buffer () << std::endl;
+    else
+        std::cout << "SUCCESS: compact JSON with round-trip numbers" << std::endl;
+}
+
+void test_wire_format ()
+{
+    std::vector<Data> points;
+    for (int i = 0; i < 300; ++i)
+        points.push_back (Data {1700000000000 + i * 1000, i * 0.25 - 10});
+
+    // Columnar: header, timestamps, values
+    std::string columns = wire::columns_header (points.size ());
+    for (const Data& p : points)
+        wire::put_le (columns, static_cast<int64_t> (p.time_ms));
+    for (const Data& p : points)
+        wire::put_le (columns, static_cast<double> (p.value));
+
+    std::vector<Data> from_columns;
+    bool columns_ok = columns.compare (0, 4, "TSDC") == 0 &&
+                      wire::decode_columns (columns, from_columns) &&
+                      from_columns.size () == points.size ();
+    for (size_t i = 0; columns_ok && i < points.size (); ++i)
+        columns_ok = from_columns[i].time_ms == points[i].time_ms &&
+                     from_columns[i].value == points[i].value;
+
+    // Gorilla: two independently encoded frames, then the terminator
+    std::string stream = wire::gorilla_header ();
+    Gorilla gorilla;
+    for (size_t first : {size_t (0), size_t (200)})
+    {
+        std::vector<Data> chunk (points.begin () + first,
+                                 points.begin () + std::min<size_t> (first + 200, points.size ()));
+        BitWriter writer;
+        gorilla.encode (chunk, writer);
+        writer.flush ();
+        const std::vector<byte_t>& bytes = writer.get_buffer ();
+
+        stream += wire::frame_header (chunk.size (), chunk.front ().time_ms,
+                                      chunk.back ().time_ms, bytes.size ());
+        stream.append (reinterpret_cast<const char*> (bytes.data ()), bytes.size ());
+    }
+    stream += wire::frame_header (0, 0, 0, 0);
+
+    std::vector<Data> from_gorilla;
+    bool gorilla_ok = wire::decode_gorilla (stream, from_gorilla) &&
+                      from_gorilla.size () == points.size ();
+    for (size_t i = 0; gorilla_ok && i < points.size (); ++i)
+        gorilla_ok = from_gorilla[i].time_ms == points[i].time_ms &&
+                     from_gorilla[i].value == points[i].value;
+
+    // Truncation is detected, not decoded as garbage
+    std::vector<Data> ignored;
+    bool rejects = !wire::decode_gorilla (stream.substr (0, stream.size () - 1), ignored) &&
+                   !wire::decode_columns (columns.substr (0, columns.size () - 8), ignored);
+
+    if (!columns_ok || !gorilla_ok || !rejects)
+        std::cerr << "FAIL: wire format round trip (columns " << columns_ok
+                  << ", gorilla " << gorilla_ok << ", rejects " << rejects << ")" << std::endl;
+    else
+        std::cout << "SUCCESS: binary and gorilla /read formats round trip" << std::endl;
+}
+
+void test_tag_index ()
+{
+    std::string path = "test_tags/TAGS";
+    std::filesystem::remove_all ("test_tags");
+    std::filesystem::create_directories ("test_tags");
+
+    TagIndex index;
+    index.add_batch ({Point {"device_1", {1, 1}}, Point {"device_1", {2, 2}},
+                      Point {"device_10", {1, 1}}, Point {"device_2", {1, 1}}});
+    index.add_all (std::vector<tag_t> {"dev", "sensor_a", "device_2"});
+    index.add ("devices");
+
+    auto same = [] (const std::vector<tag_t>& got, const std::vector<tag_t>& want)
+                { return got == want; };
+
+    bool ok = index.size () == 6 &&
+              same (index.match_prefix ("device_"), {"device_1", "device_10", "device_2"}) &&
+              same (index.match ("device_?"), {"device_1", "device_2"}) &&
+              same (index.match ("dev*"), {"dev", "device_1", "device_10", "device_2", "devices"}) &&
+              same (index.match ("*_1*"), {"device_1", "device_10"}) &&
+              same (index.match ("sensor_a"), {"sensor_a"}) &&
+              same (index.match ("sensor"), {}) &&
+              same (index.match ("", 2), {"dev", "device_1"}) &&
+              same (index.match_regex (std::regex ("device_[0-9]+"), 0),
+                    {"device_1", "device_10", "device_2"}) &&
+              TagIndex::glob_match ("a*b*c", "aXXbYbc") && !TagIndex::glob_match ("a*b", "ab_");
+
+    // Survives a restart through the TAGS file
+    TagIndex reloaded;
+    bool persisted = index.save (path) && reloaded.load (path) &&
+                     reloaded.match ("") == index.match ("");
+
+    std::filesystem::remove_all ("test_tags");
+
+    if (!ok || !persisted)
+        std::cerr << "FAIL: tag index (matching " << ok << ", persisted " << persisted << ")"
+                  << std::endl;
+    else
+        std::cout << "SUCCESS: tag index prefix/glob/regex matching and persistence" << std::endl;
+}
+
+void test_series_labels ()
+{
+    std::string dir = (std::filesystem::temp_directory_path () /
+                       "tsdb_test_series/").string ();
+    std::filesystem::remove_all (dir);
+
+    // Label order doesn't matter, malformed sets are rejected
+    std::string a, b, bad;
+    bool canonical = labels::canonicalize ("temp;type=t;site=a", a) &&
+                     labels::canonicalize ("temp;site=a;type=t", b) && a == b &&
+                     a == "temp;site=a;type=t" &&
+                     !labels::canonicalize ("site=a;site=b", bad) &&
+                     !labels::canonicalize ("site=a;temp", bad) &&
+                     !labels::canonicalize ("site=", bad);
+
+    // Interned points go to the WAL by id and come back by key
+    bool ids_ok, selects;
+    {
+        SeriesRegistry series;
+        series.open (dir + "SERIES");
+
+        batch_t batch;
+        for (const char* key : {"site=a;type=temp", "site=a;type=hum", "site=b;type=temp",
+                                "site=a;type=temp", "cpu;site=a"})
+            for (time_t t = 0; t < 10; ++t)
+                batch.push_back (Point {key, Data {t, 1.0}});
+        ids_ok = series.intern_batch (batch) && batch.front ().series == 1 && batch.back ().series == 4 &&
+                 series.find ("site=a;type=temp") == 1 && series.size () == 4;
+
+        std::vector<tag_t> keys;
+        selects = series.select_keys ("site=a;type=temp", keys) &&
+                  keys == std::vector<tag_t> {"site=a;type=temp"} &&
+                  series.select ({{"site", "a"}}) == std::vector<series_id_t> {1, 2, 4} &&
+                  series.select ({{"type", "temp"}}) == std::vector<series_id_t> {1, 3} &&
+                  series.select ({{"__name__", "cpu"}}) == std::vector<series_id_t> {4} &&
+                  series.select ({{"site", "c"}}).empty ();
+
+        WAL wal (dir + "wal/", WalSync::every_write);
+        wal.append_batch (batch);
+    }
+
+    // Ids survive a restart, a torn registry line is cut off
+    {
+        std::ofstream torn (dir + "SERIES", std::ios::app);
+        torn << "5 half";
+    }
+
+    SeriesRegistry reopened;
+    reopened.open (dir + "SERIES");
+    MemTable mem_db;
+    WAL (dir + "wal/", WalSync::async).recover (mem_db, &reopened);
+    bool recovered = reopened.size () == 4 && reopened.key_of (3) == "site=b;type=temp" &&
+                     reopened.intern ("site=c") == 5 &&
+                     mem_db.get_count ("site=a;type=temp") == 20 &&
+                     mem_db.get_count ("cpu;site=a") == 10;
+
+    // Label keys share prefixes, the index stores them front coded
+    std::string path = dir + "sstable_1.db";
+    {
+        SSTableWriter writer (path);
+        for (const char* key : {"site=a;type=hum", "site=a;type=temp", "site=b;type=temp", "x"})
+            writer.add (key, std::vector<Data> {{1, 1.0}, {2, 2.0}});
+        writer.finish ();
+    }
+    SSTableReader reader (path, 1);
+    bool front_coded = reader.get_index ().size () == 4 &&
+                       reader.read ("site=a;type=temp").size () == 2 &&
+                       reader.read ("x").size () == 2 && reader.read ("site=a").empty ();
+
+    std::filesystem::remove_all (dir);
+
+    if (!canonical || !ids_ok || !selects || !recovered || !front_coded)
+        std::cerr << "FAIL: series labels (canonical " << canonical << ", ids " << ids_ok
+                  << ", select " << selects << ", recovered " << recovered
+                  << ", front coded " << front_coded << ")" << std::endl;
+    else
+        std::cout << "SUCCESS: label series interned, selected and recovered by id" << std::endl;
 }
 
 int main ()
 {
     test_gorilla_logic ();
+    test_bit_buffer ();
+    test_gorilla_streaming ();
+    test_gorilla_fuzz ();
+    test_value_codecs ();
     test_cold_store ();
     test_mem_get ();
+    test_mem_range ();
+    test_compressed_memtable ();
+    test_parallel_flush ();
+    test_parse_batch ();
+    test_mem_shards ();
+    test_wal_group_commit ();
+    test_wal_rotate ();
+    test_wal_torn_tail ();
     test_cold_get ();
+    test_sstable_chunks ();
+    test_compaction ();
+    test_sstable_bloom ();
+    test_block_cache ();
+    test_aggregate ();
+    test_rollups ();
+    test_simd_kernels ();
+    test_json_writer ();
+    test_wire_format ();
+    test_tag_index ();
+    test_series_labels ();
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,706 @@
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "types.h"
+#include "tsdb_config.h"
+#include "wal.h"
+#include "memtable.h"
+#include "bit_buffer.h"
+#include "gorilla.h"
+#include "chunk_codec.h"
+#include "simd_agg.h"
+#include "aggregate.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+/**
+ * Percentile of sorted latencies (us)
+ */
+double percentile (const std::vector<double>& sorted, double p)
+{
+    if (sorted.empty ())
+        return 0;
+
+    size_t idx = static_cast<size_t> (p * (sorted.size () - 1));
+    return sorted[idx];
+}
+
+/**
+ * WAL throughput/latency per durability mode
+ * threads: concurrent writers (like HTTP workers)
+ * appends: single-point appends per writer
+ */
+void bench_wal (size_t threads = 8, size_t appends = 2000)
+{
+    struct Mode
+    {
+        config::WalSync sync;
+        size_t window_ms;
+        const char* name;
+    };
+
+    const Mode modes[] =
+    {
+        {config::WalSync::every_write,  0, "every_write"},
+        {config::WalSync::group_commit, 0, "group_commit"},
+        {config::WalSync::group_commit, 1, "group_1ms"},
+        {config::WalSync::async,        1, "async"}
+    };
+
+    std::string dir = (std::filesystem::temp_directory_path () /
+                       "tsdb_bench_wal/").string ();
+
+    std::printf ("== WAL (%zu writers x %zu appends) ==\n", threads, appends);
+    std::printf ("%-14s %12s %10s %10s %10s\n",
+                 "mode", "points/s", "p50 us", "p99 us", "commits");
+
+    for (const auto& [mode, window_ms, name] : modes)
+    {
+        std::filesystem::remove_all (dir);
+        std::vector<std::vector<double>> latencies (threads);
+        size_t commits = 0;
+
+        auto start = bench_clock::now ();
+        {
+            WAL wal (dir, mode, std::chrono::milliseconds {window_ms});
+            std::vector<std::thread> writers;
+
+            for (size_t t = 0; t < threads; ++t)
+                writers.emplace_back ([&, t] ()
+                {
+                    tag_t tag = "bench_" + std::to_string (t);
+                    latencies[t].reserve (appends);
+
+                    for (size_t i = 0; i < appends; ++i)
+                    {
+                        auto op_start = bench_clock::now ();
+                        wal.append (tag, static_cast<time_t> (i), 1.0);
+                        std::chrono::duration<double, std::micro> op
+                            = bench_clock::now () - op_start;
+                        latencies[t].push_back (op.count ());
+                    }
+                });
+
+            for (std::thread& writer : writers)
+                writer.join ();
+
+            // Drain async mode, count it in the wall time
+            wal.sync ();
+            commits = wal.get_commit_count ();
+        }
+        std::chrono::duration<double> elapsed = bench_clock::now () - start;
+
+        std::vector<double> all;
+        for (const auto& lat : latencies)
+            all.insert (all.end (), lat.begin (), lat.end ());
+        std::sort (all.begin (), all.end ());
+
+        std::printf ("%-14s %12.0f %10.1f %10.1f %10zu\n", name,
+                     all.size () / elapsed.count (),
+                     percentile (all, 0.50), percentile (all, 0.99), commits);
+    }
+
+    std::filesystem::remove_all (dir);
+    std::printf ("\n");
+}
+
+/**
+ * Startup WAL replay time
+ * mb: approximate WAL size to write then recover
+ */
+void bench_recovery (size_t mb = 256)
+{
+    std::string dir = (std::filesystem::temp_directory_path () /
+                       "tsdb_bench_recovery/").string ();
+    std::filesystem::remove_all (dir);
+
+    // Fill with 1000-point batches over 64 series
+    size_t points = 0;
+    {
+        WAL wal (dir, config::WalSync::async);
+        batch_t batch;
+        size_t target = mb << 20;
+        size_t bytes = 0;
+
+        while (bytes < target)
+        {
+            batch.clear ();
+            for (size_t i = 0; i < 1000; ++i, ++points)
+                batch.push_back (Point {"device_" + std::to_string (points % 64),
+                                        Data {static_cast<time_t> (points), 1.0}});
+
+            bytes += 1000 * (sizeof (size_t) + 9 + sizeof (Data));
+            wal.append_batch (batch);
+        }
+        wal.sync ();
+    }
+
+    auto start = bench_clock::now ();
+    MemTable mem_db;
+    WAL (dir, config::WalSync::async).recover (mem_db);
+    std::chrono::duration<double> elapsed = bench_clock::now () - start;
+
+    std::printf ("== WAL recovery (~%zu MB, %zu points) ==\n", mb, points);
+    std::printf ("recovered %zu points in %.2f s (%.0f MB/s)\n\n",
+                 mem_db.get_total_count (), elapsed.count (), mb / elapsed.count ());
+
+    std::filesystem::remove_all (dir);
+}
+
+/**
+ * Concurrent MemTable ingest, one series per writer
+ * points: single-point inserts per writer
+ */
+void bench_memtable (size_t points = 200000)
+{
+    size_t max_threads = std::max (1u, std::thread::hardware_concurrency ());
+
+    std::printf ("== MemTable insert (%zu points per writer) ==\n", points);
+    std::printf ("%-10s %14s\n", "writers", "points/s");
+
+    for (size_t threads = 1; threads <= max_threads; threads *= 2)
+    {
+        MemTable mem_db;
+        std::vector<std::thread> writers;
+
+        auto start = bench_clock::now ();
+        for (size_t t = 0; t < threads; ++t)
+            writers.emplace_back ([&, t] ()
+            {
+                tag_t tag = "device_" + std::to_string (t);
+                for (size_t i = 0; i < points; ++i)
+                    mem_db.insert (tag, static_cast<time_t> (i), 1.0);
+            });
+
+        for (std::thread& writer : writers)
+            writer.join ();
+        std::chrono::duration<double> elapsed = bench_clock::now () - start;
+
+        std::printf ("%-10zu %14.0f\n", threads,
+                     threads * points / elapsed.count ());
+    }
+
+    std::printf ("\n");
+}
+
+/**
+ * Original byte-at-a-time writer, kept as the bit I/O baseline
+ */
+class LegacyBitWriter
+{
+private:
+    std::vector<byte_t> buf;
+    byte_t current_byte = 0;
+    size_t bit_count = 0;
+
+public:
+    void write_bit (bool bit)
+    {
+        if (bit)
+            current_byte |= (1 << (7 - bit_count));
+
+        if (++bit_count == 8)
+        {
+            buf.push_back (current_byte);
+            current_byte = 0x0;
+            bit_count = 0;
+        }
+    }
+
+    void write_bits (uint64_t value, int count)
+    {
+        for (int i = count - 1; i >= 0; --i)
+            write_bit ((value >> i) & 1);
+    }
+
+    void flush ()
+    {
+        if (bit_count == 0)
+            return;
+
+        buf.push_back (current_byte);
+        current_byte = 0;
+        bit_count = 0;
+    }
+
+    const std::vector<byte_t>& get_buffer () const
+    {
+        return buf;
+    }
+};
+
+/**
+ * Original bit-at-a-time reader, kept as the bit I/O baseline
+ */
+class LegacyBitReader
+{
+private:
+    const std::vector<byte_t>& buf;
+    size_t byte_pos = 0;
+    int bit_pos = 0;
+
+public:
+    LegacyBitReader (const std::vector<byte_t>& buf) : buf (buf) {}
+
+    bool read_bit ()
+    {
+        if (byte_pos >= buf.size ())
+            return false;
+
+        bool bit = (buf[byte_pos] >> (7 - bit_pos++)) & 1;
+        if (bit_pos == 8)
+        {
+            bit_pos = 0;
+            ++byte_pos;
+        }
+
+        return bit;
+    }
+
+    uint64_t read_bits (size_t count)
+    {
+        uint64_t value = 0;
+        for (size_t i = 0; i < count; ++i)
+            value = (value << 1) | read_bit ();
+
+        return value;
+    }
+};
+
+/**
+ * Write + read a Gorilla-like mix of field widths through Writer/Reader
+ * Returns {write MB/s, read MB/s}, sink defeats dead code elimination
+ */
+template <typename Writer, typename Reader>
+std::pair<double, double> run_bits (const std::vector<std::pair<uint64_t, int>>& ops,
+                                    uint64_t& sink)
+{
+    auto start = bench_clock::now ();
+    Writer writer;
+    for (const auto& [value, count] : ops)
+        writer.write_bits (value, count);
+    writer.flush ();
+    std::chrono::duration<double> write_s = bench_clock::now () - start;
+
+    start = bench_clock::now ();
+    Reader reader (writer.get_buffer ());
+    for (const auto& op : ops)
+        sink += reader.read_bits (op.second);
+    std::chrono::duration<double> read_s = bench_clock::now () - start;
+
+    double mb = writer.get_buffer ().size () / double (1 << 20);
+    return {mb / write_s.count (), mb / read_s.count ()};
+}
+
+/**
+ * MemTable flush time as series count grows, series encoded on
+ * min (cores, series / memtable_parallel_flush_series) workers
+ * points: points per series
+ */
+void bench_flush (size_t points = 2000)
+{
+    std::string path = (std::filesystem::temp_directory_path () / "tsdb_bench_flush.db").string ();
+    std::string rollup_path = path + ".rollup";
+
+    std::printf ("== MemTable flush (%zu points per series, %u cores) ==\n", points,
+                 std::max (1u, std::thread::hardware_concurrency ()));
+    std::printf ("%-10s %10s %14s\n", "series", "ms", "points/s");
+
+    for (size_t series : {10, 100, 1000})
+    {
+        MemTable mem_db;
+        for (size_t s = 0; s < series; ++s)
+        {
+            tag_t tag = "device_" + std::to_string (s);
+            for (size_t i = 0; i < points; ++i)
+                mem_db.insert (tag, static_cast<time_t> (i * 1000),
+                               20.0 + std::sin (static_cast<double> (i + s) / 50));
+        }
+
+        auto start = bench_clock::now ();
+        mem_db.flush_to (path, rollup_path);
+        std::chrono::duration<double> elapsed = bench_clock::now () - start;
+
+        std::printf ("%-10zu %10.1f %14.0f\n", series, elapsed.count () * 1e3,
+                     series * points / elapsed.count ());
+    }
+
+    std::filesystem::remove (path);
+    std::filesystem::remove (rollup_path);
+    std::printf ("\n");
+}
+
+/**
+ * Word-at-a-time vs byte-at-a-time bit I/O, plus Gorilla on top of it
+ * ops: number of write_bits calls
+ */
+void bench_bits (size_t ops_count = 5000000)
+{
+    // Field widths seen in Gorilla: control bits, 7-bit dod, 5/6-bit headers,
+    // meaningful XOR bits, 64-bit first values
+    const int widths[] = {1, 1, 2, 7, 5, 6, 20, 1, 38, 64};
+    std::vector<std::pair<uint64_t, int>> ops;
+    ops.reserve (ops_count);
+    uint64_t state = 88172645463325252ull;
+    for (size_t i = 0; i < ops_count; ++i)
+    {
+        state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+        ops.push_back ({state, widths[i % 10]});
+    }
+
+    uint64_t sink = 0;
+    auto [legacy_w, legacy_r] = run_bits<LegacyBitWriter, LegacyBitReader> (ops, sink);
+    auto [word_w, word_r] = run_bits<BitWriter, BitReader> (ops, sink);
+
+    std::printf ("== Bit I/O (%zu mixed-width fields) ==\n", ops_count);
+    std::printf ("%-16s %12s %12s\n", "impl", "write MB/s", "read MB/s");
+    std::printf ("%-16s %12.0f %12.0f\n", "byte-at-a-time", legacy_w, legacy_r);
+    std::printf ("%-16s %12.0f %12.0f\n", "word-at-a-time", word_w, word_r);
+
+    // Gorilla end to end on a sine-like 1 kHz series
+    std::vector<Data> series;
+    series.reserve (1000000);
+    for (size_t i = 0; i < 1000000; ++i)
+        series.push_back (Data {static_cast<time_t> (1700000000000 + i),
+                                25.0 + 5.0 * std::sin (i / 1000.0)});
+
+    Gorilla gorilla;
+    auto start = bench_clock::now ();
+    BitWriter writer;
+    gorilla.encode (series, writer);
+    writer.flush ();
+    std::chrono::duration<double> enc_s = bench_clock::now () - start;
+
+    start = bench_clock::now ();
+    std::vector<Data> decoded = gorilla.decode (writer.get_buffer (), series.size ());
+    std::chrono::duration<double> dec_s = bench_clock::now () - start;
+    sink += decoded.size ();
+
+    std::printf ("gorilla encode %.1f Mpts/s, decode %.1f Mpts/s (sink %llu)\n\n",
+                 series.size () / enc_s.count () / 1e6,
+                 series.size () / dec_s.count () / 1e6,
+                 static_cast<unsigned long long> (sink & 0xF));
+}
+
+/**
+ * load_gen stream: rate (ms) and value
+ */
+struct Workload
+{
+    const char* name;
+    time_t rate_ms;
+    std::function<data_t (time_t)> value;
+};
+
+static const std::vector<Workload> workloads =
+{
+    {"temp",    1, [] (time_t t) { return 25.0 + 5.0 * std::sin ((2.0 * M_PI * t) / 60000); }},
+    {"encoder", 2, [] (time_t t) { return 2.0 + std::fmod (t, 4000) * 17.0 / 4000; }},
+    {"noise",   3, [] (time_t) { return static_cast<double> (rand () % 10); }}
+};
+
+/**
+ * points of workload, sleep_for jitter of +0..2 ms and the device offline
+ * for 20 s every 100k points
+ */
+std::vector<Data> workload_series (const Workload& workload, size_t points, uint64_t& state)
+{
+    std::vector<Data> series;
+    series.reserve (points);
+
+    time_t ts = 1700000000000;
+    for (size_t i = 0; i < points; ++i)
+    {
+        state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+        ts += workload.rate_ms + (state % 8 == 0 ? 1 + state % 2 : 0);
+        if (i % 100000 == 1)
+            ts += 20000;
+
+        series.push_back (Data {ts, workload.value (ts)});
+    }
+
+    return series;
+}
+
+/**
+ * Gorilla bits/point per stream format on the load_gen workloads, encoded
+ * in sstable_chunk_points chunks as flushes do
+ * points: points per workload
+ */
+void bench_compression (size_t points = 1 << 20)
+{
+    std::printf ("== Gorilla bits/point (%zu points per workload, %zu point chunks) ==\n",
+                 points, sstable_chunk_points);
+    std::printf ("%-10s %-7s %10s %10s %10s %8s\n", "workload", "format", "bits/pt",
+                 "ts bits/pt", "Mpts/s", "exact");
+
+    uint64_t state = 88172645463325252ull;
+    for (const Workload& workload : workloads)
+    {
+        std::vector<Data> series = workload_series (workload, points, state);
+        std::vector<Data> times_only;
+        for (const Data& point : series)
+            times_only.push_back (Data {point.time_ms, 0.0});
+
+        for (uint8_t format : {gorilla::format_v1, gorilla::format_v2})
+        {
+            Gorilla gorilla (format);
+            auto encode = [&] (const std::vector<Data>& points_in, std::vector<std::vector<byte_t>>& out)
+            {
+                size_t bytes = 0;
+                for (size_t first = 0; first < points_in.size (); first += sstable_chunk_points)
+                {
+                    std::vector<Data> chunk (points_in.begin () + first, points_in.begin () +
+                                             std::min (first + sstable_chunk_points, points_in.size ()));
+                    BitWriter writer;
+                    gorilla.encode (chunk, writer);
+                    out.push_back (writer.release ());
+                    bytes += out.back ().size ();
+                }
+                return bytes;
+            };
+
+            std::vector<std::vector<byte_t>> chunks, ts_chunks;
+            auto start = bench_clock::now ();
+            size_t bytes = encode (series, chunks);
+            std::chrono::duration<double> enc_s = bench_clock::now () - start;
+            size_t ts_bytes = encode (times_only, ts_chunks);
+
+            // Constant values cost 1 bit/point, the rest is timestamps
+            bool exact = true;
+            for (size_t c = 0; c < chunks.size (); ++c)
+            {
+                size_t first = c * sstable_chunk_points;
+                size_t n = std::min (sstable_chunk_points, points - first);
+                std::vector<Data> decoded = gorilla.decode (chunks[c], n);
+                for (size_t i = 0; i < n && exact; ++i)
+                    exact = decoded[i].time_ms == series[first + i].time_ms &&
+                            decoded[i].value == series[first + i].value;
+            }
+
+            std::printf ("%-10s %-7s %10.2f %10.2f %10.1f %8s\n", workload.name,
+                         format == gorilla::format_v1 ? "v1" : "v2",
+                         bytes * 8.0 / points, ts_bytes * 8.0 / points - 1.0,
+                         points / enc_s.count () / 1e6, exact ? "yes" : "NO");
+        }
+    }
+
+    std::printf ("\n");
+}
+
+/**
+ * Chunk codecs (chunk_codec.h) on the load_gen workloads plus a counter and
+ * an enum-like state series: bytes/point, ratio to raw Data, decode speed
+ * per codec, and what encode_best picks per chunk
+ * points: points per workload
+ */
+void bench_codecs (size_t points = 1 << 20)
+{
+    std::vector<Workload> all = workloads;
+    all.push_back ({"counter", 1000, [] (time_t t) { return static_cast<double> ((t / 1000) * 7 % 100000); }});
+    all.push_back ({"state",   1000, [] (time_t t) { return static_cast<double> ((t / 60000) % 4) * 0.5; }});
+
+    std::printf ("== Chunk codecs (%zu points per workload, %zu point chunks) ==\n",
+                 points, sstable_chunk_points);
+    std::printf ("%-10s %-11s %10s %8s %12s %8s\n", "workload", "codec", "bytes/pt", "ratio",
+                 "decode Mpt/s", "exact");
+
+    uint64_t state = 88172645463325252ull;
+    uint64_t sink = 0;
+    for (const Workload& workload : all)
+    {
+        std::vector<Data> series = workload_series (workload, points, state);
+
+        // Codecs one by one, then the chooser (codec_count)
+        for (size_t c = 0; c <= codec::codec_count; ++c)
+        {
+            std::vector<std::vector<byte_t>> chunks;
+            size_t bytes = 0;
+            size_t picked[codec::codec_count] = {};
+            for (size_t first = 0; first < points; first += sstable_chunk_points)
+            {
+                size_t n = std::min (sstable_chunk_points, points - first);
+                chunks.push_back (c == codec::codec_count
+                                  ? codec::encode_best (series.data () + first, n)
+                                  : codec::encode (static_cast<codec::Codec> (c),
+                                                   series.data () + first, n));
+                if (chunks.back ().empty ())
+                    break;
+
+                bytes += chunks.back ().size ();
+                ++picked[chunks.back ()[0]];
+            }
+
+            const char* name = c == codec::codec_count ? "best"
+                                                       : codec::name (static_cast<codec::Codec> (c));
+            if (chunks.back ().empty ())
+            {
+                std::printf ("%-10s %-11s %10s\n", workload.name, name, "n/a");
+                continue;
+            }
+
+            bool exact = true;
+            Columns columns;
+            auto start = bench_clock::now ();
+            for (size_t i = 0; i < chunks.size (); ++i)
+            {
+                size_t first = i * sstable_chunk_points;
+                size_t n = std::min (sstable_chunk_points, points - first);
+                codec::decode_columns (codec::format_blocks, chunks[i].data (), chunks[i].size (),
+                                       n, columns);
+                sink += columns.ts[n - 1];
+                exact &= columns.ts[0] == series[first].time_ms &&
+                         columns.values[n - 1] == series[first + n - 1].value;
+            }
+            std::chrono::duration<double> dec_s = bench_clock::now () - start;
+
+            std::printf ("%-10s %-11s %10.2f %7.1f%% %12.1f %8s", workload.name, name,
+                         static_cast<double> (bytes) / points,
+                         100.0 * bytes / (points * sizeof (Data)),
+                         points / dec_s.count () / 1e6, exact ? "yes" : "NO");
+
+            if (c == codec::codec_count)
+                for (size_t p = 0; p < codec::codec_count; ++p)
+                    if (picked[p])
+                        std::printf (" %s:%zu", codec::name (static_cast<codec::Codec> (p)), picked[p]);
+            std::printf ("\n");
+        }
+    }
+
+    std::printf ("(sink %llu)\n\n", static_cast<unsigned long long> (sink & 0xF));
+}
+
+/**
+ * Aggregation kernels: scalar loop over rows (std::vector<Data>) vs the
+ * columnar kernels per Isa, single thread (points/s per core)
+ * points: series length, repeated until ~1 s of work per row
+ */
+void bench_simd (size_t points = 1 << 20)
+{
+    std::vector<Data> rows;
+    Columns columns;
+    rows.reserve (points);
+    columns.reserve (points);
+    for (size_t i = 0; i < points; ++i)
+    {
+        Data point {static_cast<time_t> (i), 25.0 + 5.0 * std::sin (i / 1000.0)};
+        rows.push_back (point);
+        columns.push_back (point);
+    }
+
+    // Middle half of the series
+    time_t lo = points / 4, hi = 3 * points / 4;
+    const size_t reps = std::max<size_t> (1, (size_t {1} << 28) / points);
+    double sink = 0;
+
+    auto run = [&] (auto&& kernel)
+    {
+        auto start = bench_clock::now ();
+        for (size_t r = 0; r < reps; ++r)
+            sink += kernel ().sum;
+        std::chrono::duration<double> elapsed = bench_clock::now () - start;
+        return reps * points / elapsed.count () / 1e6;
+    };
+
+    auto rows_all = [&] ()
+    {
+        simd::Summary out;
+        for (const Data& d : rows)
+        {
+            ++out.count;
+            out.sum += d.value;
+            out.min = std::min (out.min, d.value);
+            out.max = std::max (out.max, d.value);
+        }
+        return out;
+    };
+
+    auto rows_range = [&] ()
+    {
+        simd::Summary out;
+        for (const Data& d : rows)
+        {
+            if (d.time_ms < lo || d.time_ms > hi)
+                continue;
+            ++out.count;
+            out.sum += d.value;
+            out.min = std::min (out.min, d.value);
+            out.max = std::max (out.max, d.value);
+        }
+        return out;
+    };
+
+    std::printf ("== Aggregation kernels (%zu points, best %s) ==\n", points,
+                 simd::isa_name (simd::best_isa ()));
+    std::printf ("%-16s %16s %16s\n", "impl", "sum/min/max Mpt/s", "in-range Mpt/s");
+    std::printf ("%-16s %16.0f %16.0f\n", "rows scalar", run (rows_all), run (rows_range));
+
+    for (int isa = 0; isa <= static_cast<int> (simd::best_isa ()); ++isa)
+    {
+        simd::Isa which = static_cast<simd::Isa> (isa);
+        double all = run ([&] ()
+                          { return simd::summarize (columns.values.data (), points, which); });
+        double range = run ([&] ()
+                            { return simd::summarize_range (columns.ts.data (),
+                                                            columns.values.data (),
+                                                            points, lo, hi, which); });
+
+        std::string name = std::string ("columns ") + simd::isa_name (which);
+        std::printf ("%-16s %16.0f %16.0f\n", name.c_str (), all, range);
+    }
+
+    // End to end: 1 minute buckets of a 1 kHz series
+    BucketAggregator by_rows (0, 60000, points);
+    BucketAggregator by_columns (0, 60000, points);
+    auto start = bench_clock::now ();
+    by_rows.add (rows.data (), rows.size ());
+    std::chrono::duration<double> rows_s = bench_clock::now () - start;
+
+    start = bench_clock::now ();
+    by_columns.add (columns.ts.data (), columns.values.data (), points);
+    std::chrono::duration<double> columns_s = bench_clock::now () - start;
+
+    std::printf ("bucket 1m: rows %.0f Mpt/s, columns %.0f Mpt/s (sink %d)\n\n",
+                 points / rows_s.count () / 1e6, points / columns_s.count () / 1e6,
+                 static_cast<int> (sink) & 1);
+}
+
+/**
+ * Runner, optional suite name as first arg
+ */
+int main (int argc, char** argv)
+{
+    std::string suite = argc > 1 ? argv[1] : "all";
+
+    if (suite == "all" || suite == "wal")
+        bench_wal ();
+
+    if (suite == "all" || suite == "memtable")
+        bench_memtable ();
+
+    if (suite == "all" || suite == "flush")
+        bench_flush ();
+
+    if (suite == "all" || suite == "bits")
+        bench_bits ();
+
+    if (suite == "all" || suite == "compression")
+        bench_compression ();
+
+    if (suite == "all" || suite == "codecs")
+        bench_codecs ();
+
+    if (suite == "all" || suite == "simd")
+        bench_simd ();
+
+    if (suite == "all" || suite == "recovery")
+        bench_recovery (argc > 2 ? std::stoull (argv[2]) : 256);
+
+    return EXIT_SUCCESS;
+}